@@ -0,0 +1,61 @@
+# trace_file.hpp の圧縮コーデック（zstd / lz4）を、見つかった分だけリンクする
+# ヘッダだけが見えてライブラリが無いとリンクできないので、リンクしたものを TRACE_FILE_HAS_ZSTD / TRACE_FILE_HAS_LZ4 で明示する
+# CMake の config が無いパッケージ（Debian / Ubuntu の liblz4-dev など）は pkg-config か find_library で探す
+function(trace_link_codecs target)
+    find_package(PkgConfig QUIET)
+
+    set(has_zstd 0)
+    find_package(zstd CONFIG QUIET)
+    if (TARGET zstd::libzstd_shared)
+        target_link_libraries(${target} PRIVATE zstd::libzstd_shared)
+        set(has_zstd 1)
+    elseif (TARGET zstd::libzstd_static)
+        target_link_libraries(${target} PRIVATE zstd::libzstd_static)
+        set(has_zstd 1)
+    else()
+        if (PkgConfig_FOUND)
+            pkg_check_modules(libzstd QUIET IMPORTED_TARGET libzstd)
+        endif()
+        if (TARGET PkgConfig::libzstd)
+            target_link_libraries(${target} PRIVATE PkgConfig::libzstd)
+            set(has_zstd 1)
+        else()
+            find_path(TRACE_ZSTD_INCLUDE_DIR zstd.h)
+            find_library(TRACE_ZSTD_LIBRARY NAMES zstd zstd_static libzstd)
+            if (TRACE_ZSTD_INCLUDE_DIR AND TRACE_ZSTD_LIBRARY)
+                target_include_directories(${target} PRIVATE ${TRACE_ZSTD_INCLUDE_DIR})
+                target_link_libraries(${target} PRIVATE ${TRACE_ZSTD_LIBRARY})
+                set(has_zstd 1)
+            endif()
+        endif()
+    endif()
+
+    set(has_lz4 0)
+    find_package(lz4 CONFIG QUIET)
+    if (TARGET LZ4::lz4_shared)
+        target_link_libraries(${target} PRIVATE LZ4::lz4_shared)
+        set(has_lz4 1)
+    elseif (TARGET LZ4::lz4_static)
+        target_link_libraries(${target} PRIVATE LZ4::lz4_static)
+        set(has_lz4 1)
+    else()
+        if (PkgConfig_FOUND)
+            pkg_check_modules(liblz4 QUIET IMPORTED_TARGET liblz4)
+        endif()
+        if (TARGET PkgConfig::liblz4)
+            target_link_libraries(${target} PRIVATE PkgConfig::liblz4)
+            set(has_lz4 1)
+        else()
+            find_path(TRACE_LZ4_INCLUDE_DIR lz4hc.h)
+            find_library(TRACE_LZ4_LIBRARY NAMES lz4 liblz4)
+            if (TRACE_LZ4_INCLUDE_DIR AND TRACE_LZ4_LIBRARY)
+                target_include_directories(${target} PRIVATE ${TRACE_LZ4_INCLUDE_DIR})
+                target_link_libraries(${target} PRIVATE ${TRACE_LZ4_LIBRARY})
+                set(has_lz4 1)
+            endif()
+        endif()
+    endif()
+
+    target_compile_definitions(${target} PRIVATE TRACE_FILE_HAS_ZSTD=${has_zstd} TRACE_FILE_HAS_LZ4=${has_lz4})
+    message(STATUS "${target}: zstd=${has_zstd} lz4=${has_lz4}")
+endfunction()
\ No newline at end of file
@@ -41,14 +41,8 @@ struct SrcPos
 	DWORD col = 0;
 };
 
-bool VaToLine(IDiaSession* ses, ULONGLONG va, SrcPos& out)
+bool FirstLineToSrcPos(IDiaEnumLineNumbers* e, SrcPos& out)
 {
-    out = {};
-
-    // findLinesByVA: アドレスvaに対応する行情報のエントリを列挙する
-    CComPtr<IDiaEnumLineNumbers> e;
-    if (FAILED(ses->findLinesByVA(va, 1, &e))) return false;
-
     // エントリの最初の要素を取得
     CComPtr<IDiaLineNumber> ln;
     ULONG fetched = 0;
@@ -71,3 +65,41 @@ bool VaToLine(IDiaSession* ses, ULONGLONG va, SrcPos& out)
 
     return true;
 }
+
+bool VaToLine(IDiaSession* ses, ULONGLONG va, SrcPos& out)
+{
+    out = {};
+
+    // findLinesByVA: アドレスvaに対応する行情報のエントリを列挙する
+    CComPtr<IDiaEnumLineNumbers> e;
+    if (FAILED(ses->findLinesByVA(va, 1, &e))) return false;
+
+    return FirstLineToSrcPos(e, out);
+}
+
+// ロードアドレスに依存しないので、複数のセッションから同じように引ける
+bool RvaToLine(IDiaSession* ses, DWORD rva, SrcPos& out)
+{
+    out = {};
+
+    CComPtr<IDiaEnumLineNumbers> e;
+    if (FAILED(ses->findLinesByRVA(rva, 1, &e))) return false;
+
+    return FirstLineToSrcPos(e, out);
+}
+
+// rva を含む関数の名前
+bool RvaToFunction(IDiaSession* ses, DWORD rva, std::wstring& out)
+{
+    out.clear();
+
+    CComPtr<IDiaSymbol> sym;
+    if (ses->findSymbolByRVA(rva, SymTagFunction, &sym) != S_OK || !sym) return false;
+
+    BSTR b = nullptr;
+    if (FAILED(sym->get_name(&b))) return false;
+    out = b ? b : L"";
+    SysFreeString(b);
+
+    return !out.empty();
+}
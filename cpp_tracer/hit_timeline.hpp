@@ -0,0 +1,286 @@
+﻿#pragma once
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+
+// 列（時間方向）ごとのヒット数を多段階の解像度で持つタイムライン
+// ヒットはキー（ファイル ID と行をまとめたもの）ごとに数える
+// レベル k のバケットは 2^k 列分をまとめたもので、ヒットはレベル 0 にだけ加算し、粗いレベルは読むときに下のレベルから作り直す
+// 各レベルは直近 bucketsPerLevel 個のバケットだけを持つリングで、上書きされるバケットの中身は 1 つ上のレベルへ移すので、古い細かいデータは粗いレベルにだけ残る
+class HitTimeline
+{
+public:
+
+	struct Cell
+	{
+		uint64_t key = 0;
+		uint32_t count = 0;
+	};
+
+	explicit HitTimeline(uint32_t bucketsPerLevel = 512, uint32_t levelCount = 24)
+		: m_bucketsPerLevel(bucketsPerLevel)
+		, m_levels(levelCount, std::vector<Bucket>(bucketsPerLevel))
+	{
+	}
+
+	// column は概ね単調増加で与える（保持されている範囲なら前の列にも加えられる）
+	void add(uint64_t column, uint64_t key, uint32_t count = 1)
+	{
+		// レベル 0 から上書きされている古い列は、保持されている一番細かいレベルへ直接加える
+		for (uint32_t level = 0; level < m_levels.size(); ++level)
+		{
+			if (Bucket* bucket = acquire(level, column))
+			{
+				AddCell((level == 0) ? bucket->cells : bucket->retiredCells, key, count);
+				markStale(level, column);
+				break;
+			}
+		}
+
+		m_columnCount = std::max(m_columnCount, column + 1);
+	}
+
+	// column に同じ並びの列を count 回畳んだことを記録する
+	void addRepeat(uint64_t column, uint32_t count = 1)
+	{
+		for (uint32_t level = 0; level < m_levels.size(); ++level)
+		{
+			if (Bucket* bucket = acquire(level, column))
+			{
+				((level == 0) ? bucket->repeatCount : bucket->retiredRepeatCount) += count;
+				markStale(level, column);
+				break;
+			}
+		}
+
+		m_columnCount = std::max(m_columnCount, column + 1);
+	}
+
+	// level の index 番目のバケットに畳まれている列の数
+	uint32_t repeatCount(uint32_t level, uint64_t index) const
+	{
+		if (!isRetained(level, index))
+		{
+			return 0;
+		}
+
+		const Bucket& bucket = m_levels[level][index % m_bucketsPerLevel];
+		refresh(level, bucket);
+		return bucket.repeatCount;
+	}
+
+	// 確保したバケットは残したまま空にする
+	void clear()
+	{
+		for (auto& buckets : m_levels)
+		{
+			for (auto& bucket : buckets)
+			{
+				bucket.index = UINT64_MAX;
+				bucket.cells.clear();
+				bucket.repeatCount = 0;
+				bucket.retiredCells.clear();
+				bucket.retiredRepeatCount = 0;
+				bucket.stale = false;
+			}
+		}
+
+		m_columnCount = 0;
+	}
+
+	uint64_t columnCount() const
+	{
+		return m_columnCount;
+	}
+
+	uint32_t levelCount() const
+	{
+		return static_cast<uint32_t>(m_levels.size());
+	}
+
+	// level の index 番目のバケットがまだ保持されているか
+	bool isRetained(uint32_t level, uint64_t index) const
+	{
+		return level < m_levels.size() && m_levels[level][index % m_bucketsPerLevel].index == index;
+	}
+
+	// level の index 番目のバケットで [firstKey, lastKey) のセルをキーの昇順に列挙する
+	template <class Func>
+	void forEachCell(uint32_t level, uint64_t index, uint64_t firstKey, uint64_t lastKey, Func&& func) const
+	{
+		if (!isRetained(level, index))
+		{
+			return;
+		}
+
+		const Bucket& bucket = m_levels[level][index % m_bucketsPerLevel];
+		refresh(level, bucket);
+
+		const auto& cells = bucket.cells;
+		auto it = std::lower_bound(cells.begin(), cells.end(), firstKey,
+			[](const Cell& c, uint64_t k) { return c.key < k; });
+		for (; it != cells.end() && it->key < lastKey; ++it)
+		{
+			func(*it);
+		}
+	}
+
+private:
+
+	struct Bucket
+	{
+		uint64_t index = UINT64_MAX;
+
+		// キーでソート済み（レベル 1 以上では読むときに作り直すキャッシュ）
+		mutable std::vector<Cell> cells;
+
+		mutable uint32_t repeatCount = 0;
+
+		// レベル 1 以上で、下のレベルに残っていない分（上書きされた下のバケットから移した分と、古い列へ直接加えた分）
+		std::vector<Cell> retiredCells;
+		uint32_t retiredRepeatCount = 0;
+
+		// 下のレベルが変わって cells / repeatCount を作り直す必要がある（作り直したバケットの下のバケットはすべて作り直し済み）
+		mutable bool stale = false;
+	};
+
+	static void AddCell(std::vector<Cell>& cells, uint64_t key, uint32_t count)
+	{
+		const auto it = std::lower_bound(cells.begin(), cells.end(), key,
+			[](const Cell& c, uint64_t k) { return c.key < k; });
+		if (it != cells.end() && it->key == key)
+		{
+			it->count += count;
+		}
+		else
+		{
+			cells.insert(it, Cell{ key, count });
+		}
+	}
+
+	// ソート済みの src を dst に足し込む
+	static void MergeCells(std::vector<Cell>& dst, const std::vector<Cell>& src)
+	{
+		if (src.empty())
+		{
+			return;
+		}
+
+		std::vector<Cell> merged;
+		merged.reserve(dst.size() + src.size());
+		auto a = dst.begin();
+		auto b = src.begin();
+		while (a != dst.end() || b != src.end())
+		{
+			if (b == src.end() || (a != dst.end() && a->key < b->key))
+			{
+				merged.push_back(*a++);
+			}
+			else if (a == dst.end() || b->key < a->key)
+			{
+				merged.push_back(*b++);
+			}
+			else
+			{
+				merged.push_back(Cell{ a->key, a->count + b->count });
+				++a;
+				++b;
+			}
+		}
+		dst.swap(merged);
+	}
+
+	// column を含む level より上のバケットに作り直しの印を付ける（既に印のあるバケットより上は付いている）
+	void markStale(uint32_t level, uint64_t column)
+	{
+		if (0 < level)
+		{
+			m_levels[level][(column >> level) % m_bucketsPerLevel].stale = true;
+		}
+
+		for (uint32_t upper = level + 1; upper < m_levels.size(); ++upper)
+		{
+			Bucket* bucket = acquire(upper, column);
+			if (!bucket || bucket->stale)
+			{
+				break;
+			}
+			bucket->stale = true;
+		}
+	}
+
+	// 残っている 2 つの下のバケットと、下に残っていない分から作り直す
+	void refresh(uint32_t level, const Bucket& bucket) const
+	{
+		if (!bucket.stale)
+		{
+			return;
+		}
+
+		bucket.cells = bucket.retiredCells;
+		bucket.repeatCount = bucket.retiredRepeatCount;
+		for (uint64_t child = bucket.index * 2; child < bucket.index * 2 + 2; ++child)
+		{
+			if (isRetained(level - 1, child))
+			{
+				const Bucket& lower = m_levels[level - 1][child % m_bucketsPerLevel];
+				refresh(level - 1, lower);
+				MergeCells(bucket.cells, lower.cells);
+				bucket.repeatCount += lower.repeatCount;
+			}
+		}
+		bucket.stale = false;
+	}
+
+	// column を含む level のバケット（既に新しいバケットに上書きされていれば nullptr）
+	Bucket* acquire(uint32_t level, uint64_t column)
+	{
+		const uint64_t index = column >> level;
+		Bucket& bucket = m_levels[level][index % m_bucketsPerLevel];
+		if (bucket.index != index)
+		{
+			if (bucket.index != UINT64_MAX && index < bucket.index)
+			{
+				return nullptr;
+			}
+
+			if (bucket.index != UINT64_MAX)
+			{
+				retire(level, bucket);
+			}
+
+			// 古いバケットを捨てて再利用する
+			bucket.index = index;
+			bucket.cells.clear();
+			bucket.repeatCount = 0;
+			bucket.retiredCells.clear();
+			bucket.retiredRepeatCount = 0;
+			bucket.stale = false;
+		}
+		return &bucket;
+	}
+
+	// 上書きされるバケットの中身を 1 つ上のレベルへ移す
+	void retire(uint32_t level, const Bucket& bucket)
+	{
+		if (m_levels.size() <= level + 1)
+		{
+			return;
+		}
+
+		refresh(level, bucket);
+		const uint64_t column = bucket.index << level;
+		if (Bucket* upper = acquire(level + 1, column))
+		{
+			MergeCells(upper->retiredCells, bucket.cells);
+			upper->retiredRepeatCount += bucket.repeatCount;
+			markStale(level + 1, column);
+		}
+	}
+
+	uint32_t m_bucketsPerLevel;
+
+	std::vector<std::vector<Bucket>> m_levels;
+
+	uint64_t m_columnCount = 0;
+};
@@ -0,0 +1,236 @@
+﻿#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+struct LineRange
+{
+	uint32_t startLine = 0;
+	uint32_t endLine = 0;
+};
+
+// 基本ブロックの開始行 -> 行範囲 の区間インデックス
+// 範囲は開始行でソートされ、互いに重ならないように保たれる
+//   - ブロックの終端が次のブロックと被る場合は、ブロックの開始行の方を優先して前の要素の範囲を切り詰める
+//   - 追加時に直すのは前後の要素だけで、全体を走査しない
+// 要素は固定長のチャンクに詰めて持ち、チャンクはコピー時に共有される（書き込み時にだけ複製する）
+class BlockLineIndex
+{
+public:
+
+	// startLine のブロックが未登録なら追加して true を返す
+	bool insert(uint32_t startLine, uint32_t endLine)
+	{
+		endLine = std::max(endLine, startLine);
+
+		if (m_chunks.empty())
+		{
+			auto chunk = std::make_shared<Chunk>();
+			chunk->ranges[0] = LineRange{ startLine, endLine };
+			chunk->count = 1;
+			m_chunks.push_back(std::move(chunk));
+			m_chunkFirst.push_back(startLine);
+			m_size = 1;
+			return true;
+		}
+
+		size_t chunkIndex = chunkFor(startLine);
+		uint32_t pos = lowerBound(*m_chunks[chunkIndex], startLine);
+
+		if (pos < m_chunks[chunkIndex]->count && m_chunks[chunkIndex]->ranges[pos].startLine == startLine)
+		{
+			return false;
+		}
+
+		// 次の要素の開始行で自分の終端を切り詰める
+		if (const LineRange* next = at(chunkIndex, pos))
+		{
+			endLine = std::min(endLine, next->startLine - 1);
+		}
+		else if (chunkIndex + 1 < m_chunks.size())
+		{
+			endLine = std::min(endLine, m_chunkFirst[chunkIndex + 1] - 1);
+		}
+
+		// 自分の開始行で前の要素の終端を切り詰める
+		if (0 < pos)
+		{
+			LineRange& prev = mutableChunk(chunkIndex).ranges[pos - 1];
+			prev.endLine = std::min(prev.endLine, startLine - 1);
+		}
+		else if (0 < chunkIndex)
+		{
+			Chunk& prevChunk = mutableChunk(chunkIndex - 1);
+			LineRange& prev = prevChunk.ranges[prevChunk.count - 1];
+			prev.endLine = std::min(prev.endLine, startLine - 1);
+		}
+
+		if (m_chunks[chunkIndex]->count == ChunkCapacity)
+		{
+			split(chunkIndex);
+			if (m_chunkFirst[chunkIndex + 1] <= startLine)
+			{
+				++chunkIndex;
+				pos -= ChunkCapacity / 2;
+			}
+		}
+
+		Chunk& chunk = mutableChunk(chunkIndex);
+		std::copy_backward(chunk.ranges.begin() + pos, chunk.ranges.begin() + chunk.count, chunk.ranges.begin() + chunk.count + 1);
+		chunk.ranges[pos] = LineRange{ startLine, endLine };
+		++chunk.count;
+		m_chunkFirst[chunkIndex] = chunk.ranges[0].startLine;
+		++m_size;
+
+		return true;
+	}
+
+	const LineRange* find(uint32_t startLine) const
+	{
+		if (m_chunks.empty())
+		{
+			return nullptr;
+		}
+
+		const size_t chunkIndex = chunkFor(startLine);
+		const uint32_t pos = lowerBound(*m_chunks[chunkIndex], startLine);
+		const LineRange* range = at(chunkIndex, pos);
+		return (range && range->startLine == startLine) ? range : nullptr;
+	}
+
+	// [firstLine, lastLine) と重なる範囲を開始行の昇順に列挙する
+	template <class Func>
+	void forEachOverlapping(uint32_t firstLine, uint32_t lastLine, Func&& func) const
+	{
+		if (m_chunks.empty() || lastLine <= firstLine)
+		{
+			return;
+		}
+
+		// firstLine 以前に始まる最後の要素から調べる（範囲は重ならないので、それより前は firstLine に届かない）
+		size_t chunkIndex = chunkFor(firstLine);
+		uint32_t pos = lowerBound(*m_chunks[chunkIndex], firstLine);
+		const LineRange* range = at(chunkIndex, pos);
+		if (!range || firstLine < range->startLine)
+		{
+			if (0 < pos)
+			{
+				--pos;
+			}
+			else if (0 < chunkIndex)
+			{
+				--chunkIndex;
+				pos = m_chunks[chunkIndex]->count - 1;
+			}
+		}
+
+		for (; chunkIndex < m_chunks.size(); ++chunkIndex, pos = 0)
+		{
+			const Chunk& chunk = *m_chunks[chunkIndex];
+			for (; pos < chunk.count; ++pos)
+			{
+				const LineRange& r = chunk.ranges[pos];
+				if (lastLine <= r.startLine)
+				{
+					return;
+				}
+
+				if (firstLine <= r.endLine)
+				{
+					func(r);
+				}
+			}
+		}
+	}
+
+	template <class Func>
+	void forEach(Func&& func) const
+	{
+		for (const auto& chunk : m_chunks)
+		{
+			for (uint32_t i = 0; i < chunk->count; ++i)
+			{
+				func(chunk->ranges[i]);
+			}
+		}
+	}
+
+	size_t size() const
+	{
+		return m_size;
+	}
+
+	bool empty() const
+	{
+		return m_size == 0;
+	}
+
+private:
+
+	static constexpr uint32_t ChunkCapacity = 64;
+
+	struct Chunk
+	{
+		uint32_t count = 0;
+		std::array<LineRange, ChunkCapacity> ranges;
+	};
+
+	// line 以下で始まる最後のチャンク（line が全体の先頭より前なら 0）
+	size_t chunkFor(uint32_t line) const
+	{
+		const auto it = std::upper_bound(m_chunkFirst.begin(), m_chunkFirst.end(), line);
+		return (it == m_chunkFirst.begin()) ? 0 : static_cast<size_t>(it - m_chunkFirst.begin()) - 1;
+	}
+
+	static uint32_t lowerBound(const Chunk& chunk, uint32_t line)
+	{
+		const auto it = std::lower_bound(chunk.ranges.begin(), chunk.ranges.begin() + chunk.count, line,
+			[](const LineRange& r, uint32_t l) { return r.startLine < l; });
+		return static_cast<uint32_t>(it - chunk.ranges.begin());
+	}
+
+	const LineRange* at(size_t chunkIndex, uint32_t pos) const
+	{
+		const Chunk& chunk = *m_chunks[chunkIndex];
+		return (pos < chunk.count) ? &chunk.ranges[pos] : nullptr;
+	}
+
+	// 他のコピーと共有しているチャンクは書き込む前に複製する
+	Chunk& mutableChunk(size_t chunkIndex)
+	{
+		auto& chunk = m_chunks[chunkIndex];
+		if (chunk.use_count() != 1)
+		{
+			chunk = std::make_shared<Chunk>(*chunk);
+		}
+		else
+		{
+			// 別スレッドのコピーが手放した後の書き込みであることを保証する
+			std::atomic_thread_fence(std::memory_order_acquire);
+		}
+		return *chunk;
+	}
+
+	void split(size_t chunkIndex)
+	{
+		const Chunk& full = *m_chunks[chunkIndex];
+		auto upper = std::make_shared<Chunk>();
+		std::copy(full.ranges.begin() + ChunkCapacity / 2, full.ranges.end(), upper->ranges.begin());
+		upper->count = ChunkCapacity / 2;
+
+		mutableChunk(chunkIndex).count = ChunkCapacity / 2;
+
+		m_chunkFirst.insert(m_chunkFirst.begin() + chunkIndex + 1, upper->ranges[0].startLine);
+		m_chunks.insert(m_chunks.begin() + chunkIndex + 1, std::move(upper));
+	}
+
+	std::vector<std::shared_ptr<Chunk>> m_chunks;
+
+	// 各チャンクの先頭要素の開始行（チャンクの二分探索用）
+	std::vector<uint32_t> m_chunkFirst;
+
+	size_t m_size = 0;
+};
@@ -0,0 +1,173 @@
+﻿#pragma once
+#include <deque>
+#include <unordered_map>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// スレッドごとのヒットキー列を列に区切り、ループの反復で同じ並びになった列を畳む
+// 列は（ビューアの列と同じく）キーが戻ったところで区切る
+// 同じスレッドの直近の列が周期 p（p <= MaxPeriod）で繰り返していて、閉じた列がその続き（p 列前と同じ並び）なら、新しい列を作らずに p 列前の列へ重ねる
+// 周期は直近 p 列とその前の p 列が一致することで確かめるので、本体が p 列にわたるループは 2 回分の 2p 列を出したあと、反復回数によらずそこへ畳まれる
+class LoopFolder
+{
+public:
+
+	static constexpr size_t MaxPeriod = 8;
+
+	// これより長くなった列は区切りを待たずに閉じる
+	static constexpr size_t MaxColumnLength = 4096;
+
+	// foldWindow : 畳む先にできる列の古さの上限（タイムラインが列を保持している範囲）
+	explicit LoopFolder(uint64_t foldWindow)
+		: m_foldWindow(foldWindow)
+	{
+	}
+
+	// 閉じた列は emit(column, keys, folded) で渡す（folded なら column は既に出した列）
+	template <class Emit>
+	void add(uint32_t threadId, uint64_t key, Emit&& emit)
+	{
+		Thread& thread = m_threads[threadId];
+		if (!thread.keys.empty() && (key < thread.keys.back() || MaxColumnLength <= thread.keys.size()))
+		{
+			close(thread, emit);
+		}
+
+		thread.keys.push_back(key);
+	}
+
+	// 閉じていない列もすべて閉じる（しばらくイベントが来ないときに、溜まった分を表示するため）
+	template <class Emit>
+	bool flush(Emit&& emit)
+	{
+		bool flushed = false;
+		for (auto& [threadId, thread] : m_threads)
+		{
+			if (!thread.keys.empty())
+			{
+				close(thread, emit);
+				flushed = true;
+			}
+		}
+		return flushed;
+	}
+
+	void clear()
+	{
+		m_threads.clear();
+		m_columnCount = 0;
+		m_foldedCount = 0;
+	}
+
+	uint64_t columnCount() const
+	{
+		return m_columnCount;
+	}
+
+	// 既にある列に畳んだ列の数
+	uint64_t foldedCount() const
+	{
+		return m_foldedCount;
+	}
+
+private:
+
+	struct Column
+	{
+		uint64_t hash = 0;
+		uint64_t column = 0;
+		std::vector<uint64_t> keys;
+	};
+
+	struct Thread
+	{
+		// 閉じていない列
+		std::vector<uint64_t> keys;
+
+		// 直近に閉じた 2 * MaxPeriod 列（畳んだ列も周期を保つために並べる）
+		std::deque<Column> recent;
+	};
+
+	static bool SameKeys(const Column& a, const Column& b)
+	{
+		return a.hash == b.hash && a.keys == b.keys;
+	}
+
+	// 直近 period 列が、その前の period 列と同じ並びか
+	static bool IsPeriodic(const std::deque<Column>& recent, size_t period)
+	{
+		if (recent.size() < period * 2)
+		{
+			return false;
+		}
+		for (size_t i = recent.size() - period; i < recent.size(); ++i)
+		{
+			if (!SameKeys(recent[i], recent[i - period]))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	static uint64_t Hash(const std::vector<uint64_t>& keys)
+	{
+		uint64_t hash = 0xcbf29ce484222325ull;
+		for (const uint64_t key : keys)
+		{
+			hash = (hash ^ key) * 0x100000001b3ull;
+		}
+		return hash;
+	}
+
+	template <class Emit>
+	void close(Thread& thread, Emit& emit)
+	{
+		Column closed;
+		closed.hash = Hash(thread.keys);
+		closed.column = m_columnCount;
+		closed.keys = std::move(thread.keys);
+		thread.keys.clear();
+
+		bool folded = false;
+		for (size_t period = 1; period <= MaxPeriod; ++period)
+		{
+			if (!IsPeriodic(thread.recent, period))
+			{
+				continue;
+			}
+			const Column& candidate = thread.recent[thread.recent.size() - period];
+			if (SameKeys(candidate, closed) && m_columnCount - candidate.column <= m_foldWindow)
+			{
+				closed.column = candidate.column;
+				folded = true;
+				break;
+			}
+		}
+
+		if (folded)
+		{
+			++m_foldedCount;
+		}
+		else
+		{
+			++m_columnCount;
+		}
+
+		emit(closed.column, closed.keys, folded);
+
+		thread.recent.push_back(std::move(closed));
+		if (MaxPeriod * 2 < thread.recent.size())
+		{
+			thread.recent.pop_front();
+		}
+	}
+
+	uint64_t m_foldWindow;
+
+	std::unordered_map<uint32_t, Thread> m_threads;
+
+	uint64_t m_columnCount = 0;
+	uint64_t m_foldedCount = 0;
+};
@@ -0,0 +1,54 @@
+﻿#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// 書き込みスレッドと読み出しスレッドの間でロックを取らずに最新の値を受け渡すトリプルバッファ
+// 書き込み側は back() を埋めてから publish() し、読み出し側は update() してから front() を読む
+// 読み出し側が追いつかない間に発行された古い値は捨てられる
+template <class T>
+class TripleBuffer
+{
+public:
+
+	T& back()
+	{
+		return m_slots[m_back];
+	}
+
+	void publish()
+	{
+		const uint32_t prev = m_middle.exchange(m_back | DirtyBit, std::memory_order_acq_rel);
+		m_back = prev & IndexMask;
+	}
+
+	// 新しい値が発行されていれば front を差し替えて true を返す
+	bool update()
+	{
+		if ((m_middle.load(std::memory_order_relaxed) & DirtyBit) == 0)
+		{
+			return false;
+		}
+
+		const uint32_t prev = m_middle.exchange(m_front, std::memory_order_acq_rel);
+		m_front = prev & IndexMask;
+		return true;
+	}
+
+	const T& front() const
+	{
+		return m_slots[m_front];
+	}
+
+private:
+
+	static constexpr uint32_t IndexMask = 0x3;
+	static constexpr uint32_t DirtyBit = 0x4;
+
+	std::array<T, 3> m_slots{};
+
+	// back は書き込み側、front は読み出し側だけが触る
+	uint32_t m_back = 0;
+	std::atomic<uint32_t> m_middle = 1;
+	uint32_t m_front = 2;
+};
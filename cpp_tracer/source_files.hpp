@@ -0,0 +1,246 @@
+﻿#pragma once
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <cwctype>
+#include <cstdint>
+#include <Windows.h>
+
+// シンボル解決で見つかったソースファイルのパスに ID を振る
+// 大文字小文字と区切り文字の違いは同じファイルとして扱う
+class SourceFileTable
+{
+public:
+
+	uint32_t intern(const std::wstring& path)
+	{
+		auto [it, inserted] = m_ids.try_emplace(Normalize(path), static_cast<uint32_t>(m_paths.size()));
+		if (inserted)
+		{
+			m_paths.push_back(path);
+		}
+		return it->second;
+	}
+
+	const std::wstring& path(uint32_t fileId) const
+	{
+		return m_paths[fileId];
+	}
+
+	size_t size() const
+	{
+		return m_paths.size();
+	}
+
+private:
+
+	static std::wstring Normalize(const std::wstring& path)
+	{
+		std::wstring result(path);
+		for (auto& ch : result)
+		{
+			ch = (ch == L'/') ? L'\\' : static_cast<wchar_t>(std::towlower(ch));
+		}
+		return result;
+	}
+
+	std::unordered_map<std::wstring, uint32_t> m_ids;
+
+	std::vector<std::wstring> m_paths;
+};
+
+// ソースファイルをメモリマップして行頭位置の索引だけを作る
+// 行の中身は表示するときに line() で参照する（UTF-8 / ASCII のファイルだけ）
+// UTF-16 の BOM がある / NUL を含む / UTF-8 として不正なファイルは索引を作らず isUtf8() が false になるので、呼び出し側で文字コードを判定して読む
+class MappedSourceText
+{
+public:
+
+	MappedSourceText() = default;
+
+	MappedSourceText(const MappedSourceText&) = delete;
+
+	MappedSourceText& operator=(const MappedSourceText&) = delete;
+
+	~MappedSourceText()
+	{
+		close();
+	}
+
+	bool open(const std::wstring& path)
+	{
+		close();
+
+		m_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_file == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+
+		LARGE_INTEGER size = {};
+		if (!GetFileSizeEx(m_file, &size))
+		{
+			close();
+			return false;
+		}
+
+		m_size = static_cast<size_t>(size.QuadPart);
+
+		// 空のファイルはマップできないので行なしとして扱う
+		if (0 < m_size)
+		{
+			m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (!m_mapping)
+			{
+				close();
+				return false;
+			}
+
+			m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+			if (!m_data)
+			{
+				close();
+				return false;
+			}
+		}
+
+		m_utf8 = IsUtf8(m_data, m_size);
+		if (m_utf8)
+		{
+			buildLineIndex();
+		}
+		return true;
+	}
+
+	void close()
+	{
+		if (m_data) { UnmapViewOfFile(m_data); m_data = nullptr; }
+		if (m_mapping) { CloseHandle(m_mapping); m_mapping = nullptr; }
+		if (m_file != INVALID_HANDLE_VALUE) { CloseHandle(m_file); m_file = INVALID_HANDLE_VALUE; }
+		m_size = 0;
+		m_utf8 = true;
+		m_lineStarts.clear();
+	}
+
+	bool isOpen() const
+	{
+		return m_file != INVALID_HANDLE_VALUE;
+	}
+
+	// false なら line() では読めない（開いていないときは true）
+	bool isUtf8() const
+	{
+		return m_utf8;
+	}
+
+	size_t lineCount() const
+	{
+		return m_lineStarts.empty() ? 0 : m_lineStarts.size() - 1;
+	}
+
+	// 改行文字を含まない index 行目（0 始まり）
+	std::string_view line(size_t index) const
+	{
+		if (lineCount() <= index)
+		{
+			return {};
+		}
+
+		size_t begin = m_lineStarts[index];
+		size_t end = m_lineStarts[index + 1];
+		while (begin < end && (m_data[end - 1] == '\n' || m_data[end - 1] == '\r'))
+		{
+			--end;
+		}
+		return std::string_view(m_data + begin, end - begin);
+	}
+
+private:
+
+	// UTF-16 の BOM、NUL（BOM の無い UTF-16 / UTF-32 では ASCII の文字に NUL のバイトが混ざる）、UTF-8 として不正な並びのどれも無ければ UTF-8 とみなす
+	static bool IsUtf8(const char* data, size_t size)
+	{
+		const auto* p = reinterpret_cast<const uint8_t*>(data);
+		if (2 <= size && ((p[0] == 0xFF && p[1] == 0xFE) || (p[0] == 0xFE && p[1] == 0xFF)))
+		{
+			return false;
+		}
+
+		for (size_t i = 0; i < size;)
+		{
+			const uint8_t lead = p[i];
+			if (lead == 0)
+			{
+				return false;
+			}
+			if (lead < 0x80)
+			{
+				++i;
+				continue;
+			}
+
+			// 後続バイトの数と、2 バイト目の範囲（冗長な表現、サロゲート、U+10FFFF を超える値を除く）
+			size_t length = 0;
+			uint8_t low = 0x80;
+			uint8_t high = 0xBF;
+			if (0xC2 <= lead && lead <= 0xDF) { length = 2; }
+			else if (lead == 0xE0) { length = 3; low = 0xA0; }
+			else if (lead == 0xED) { length = 3; high = 0x9F; }
+			else if (0xE1 <= lead && lead <= 0xEF) { length = 3; }
+			else if (lead == 0xF0) { length = 4; low = 0x90; }
+			else if (lead == 0xF4) { length = 4; high = 0x8F; }
+			else if (0xF1 <= lead && lead <= 0xF3) { length = 4; }
+			else { return false; }
+
+			if (size - i < length || p[i + 1] < low || high < p[i + 1])
+			{
+				return false;
+			}
+			for (size_t k = 2; k < length; ++k)
+			{
+				if ((p[i + k] & 0xC0) != 0x80)
+				{
+					return false;
+				}
+			}
+			i += length;
+		}
+		return true;
+	}
+
+	void buildLineIndex()
+	{
+		m_lineStarts.clear();
+
+		size_t pos = 0;
+		if (3 <= m_size && std::string_view(m_data, 3) == "\xEF\xBB\xBF")
+		{
+			pos = 3;
+		}
+
+		m_lineStarts.push_back(pos);
+		for (; pos < m_size; ++pos)
+		{
+			if (m_data[pos] == '\n')
+			{
+				m_lineStarts.push_back(pos + 1);
+			}
+		}
+
+		// 最終行に改行が無い場合も 1 行として数える
+		if (m_lineStarts.back() != m_size)
+		{
+			m_lineStarts.push_back(m_size);
+		}
+	}
+
+	HANDLE m_file = INVALID_HANDLE_VALUE;
+	HANDLE m_mapping = nullptr;
+	const char* m_data = nullptr;
+	size_t m_size = 0;
+	bool m_utf8 = true;
+
+	// 各行の先頭のオフセットと、末尾の番兵
+	std::vector<size_t> m_lineStarts;
+};
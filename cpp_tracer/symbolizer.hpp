@@ -0,0 +1,265 @@
+﻿#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include "dia_session.hpp"
+
+// ブロック 1 つ分のシンボル解決結果
+struct SymbolizedBlock
+{
+	// 行情報が見つからなかった場合は false
+	bool found = false;
+
+	std::wstring file;
+
+	// ブロックを含む関数（見つからなければ空）
+	std::wstring function;
+
+	// 0 始まりの行
+	uint32_t beginLine = 0;
+	uint32_t endLine = 0;
+};
+
+// ブロックの先頭アドレス -> 解決結果 の表
+// 複数のワーカーから同時に書き込めるように、アドレスでシャードを分けてそれぞれにロックを持つ
+class BlockSymbolTable
+{
+public:
+
+	void insert(uint64_t address, SymbolizedBlock block)
+	{
+		Shard& shard = shardOf(address);
+		std::unique_lock lock(shard.mutex);
+		shard.blocks.insert_or_assign(address, std::move(block));
+	}
+
+	bool find(uint64_t address, SymbolizedBlock& out) const
+	{
+		const Shard& shard = shardOf(address);
+		std::shared_lock lock(shard.mutex);
+		const auto it = shard.blocks.find(address);
+		if (it == shard.blocks.end())
+		{
+			return false;
+		}
+
+		out = it->second;
+		return true;
+	}
+
+private:
+
+	static constexpr size_t ShardCount = 64;
+
+	struct Shard
+	{
+		mutable std::shared_mutex mutex;
+		std::unordered_map<uint64_t, SymbolizedBlock> blocks;
+	};
+
+	static size_t shardIndex(uint64_t address)
+	{
+		// ブロックの先頭は 16 バイト境界に揃いやすいので下位ビットは捨てて混ぜる
+		return static_cast<size_t>((address >> 4) * 0x9E3779B97F4A7C15ull >> 58) % ShardCount;
+	}
+
+	Shard& shardOf(uint64_t address)
+	{
+		return m_shards[shardIndex(address)];
+	}
+
+	const Shard& shardOf(uint64_t address) const
+	{
+		return m_shards[shardIndex(address)];
+	}
+
+	std::array<Shard, ShardCount> m_shards;
+};
+
+// ブロックのシンボル解決をワーカースレッドで並列に行う
+// DIA のセッションはスレッド間で共有できないので、ワーカーごとに PDB を開く
+// 呼ぶ側はブロックのアドレスで重複を除いてから request() し、takeCompleted() で解決済みのアドレスを受け取る
+class Symbolizer
+{
+public:
+
+	Symbolizer() = default;
+
+	Symbolizer(const Symbolizer&) = delete;
+
+	Symbolizer& operator=(const Symbolizer&) = delete;
+
+	~Symbolizer()
+	{
+		stop();
+	}
+
+	static size_t DefaultWorkerCount()
+	{
+		// 受信スレッドと描画ループの分を残す
+		const size_t cores = std::thread::hardware_concurrency();
+		return (2 < cores) ? (cores - 2) : 1;
+	}
+
+	void start(const std::wstring& msdiaPath, const std::wstring& exePath, size_t workerCount = DefaultWorkerCount())
+	{
+		stop();
+
+		m_stopRequest = false;
+		m_workerCount = workerCount;
+		m_failedWorkers = 0;
+		for (size_t i = 0; i < workerCount; ++i)
+		{
+			m_workers.emplace_back([this, msdiaPath, exePath]() { workerMain(msdiaPath, exePath); });
+		}
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard lock(m_requestMutex);
+			m_stopRequest = true;
+		}
+		m_requestCondition.notify_all();
+
+		for (auto& worker : m_workers)
+		{
+			worker.join();
+		}
+		m_workers.clear();
+
+		std::lock_guard lock(m_requestMutex);
+		m_requests.clear();
+	}
+
+	// rvaBegin / rvaEnd はモジュール先頭からのオフセット
+	void request(uint64_t address, uint32_t rvaBegin, uint32_t rvaEnd)
+	{
+		{
+			std::lock_guard lock(m_requestMutex);
+			m_requests.push_back(Request{ address, rvaBegin, rvaEnd });
+		}
+		m_requestCondition.notify_one();
+	}
+
+	// 前回の呼び出し以降に解決済みになったブロックのアドレスを out に追加する
+	void takeCompleted(std::vector<uint64_t>& out)
+	{
+		std::lock_guard lock(m_completedMutex);
+		out.insert(out.end(), m_completed.begin(), m_completed.end());
+		m_completed.clear();
+	}
+
+	const BlockSymbolTable& table() const
+	{
+		return m_table;
+	}
+
+	size_t workerCount() const
+	{
+		return m_workerCount;
+	}
+
+	// PDB の読み込みに失敗したワーカーの数
+	size_t failedWorkerCount() const
+	{
+		return m_failedWorkers;
+	}
+
+private:
+
+	struct Request
+	{
+		uint64_t address = 0;
+		uint32_t rvaBegin = 0;
+		uint32_t rvaEnd = 0;
+	};
+
+	void workerMain(const std::wstring& msdiaPath, const std::wstring& exePath)
+	{
+		::CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+
+		CComPtr<IDiaDataSource> src;
+		CComPtr<IDiaSession> ses;
+		{
+			if (FAILED(CreateDiaDataSource(msdiaPath.c_str(), &src)) || !OpenDiaForExe(exePath.c_str(), src, ses))
+			{
+				// 解決できないワーカーは要求を取らない（全滅した場合だけ未解決として返す）
+				ses.Release();
+				{
+					std::lock_guard lock(m_requestMutex);
+					++m_failedWorkers;
+				}
+				m_requestCondition.notify_all();
+			}
+		}
+
+		for (;;)
+		{
+			Request request;
+			{
+				std::unique_lock lock(m_requestMutex);
+				m_requestCondition.wait(lock, [&]() { return m_stopRequest || (!m_requests.empty() && (ses || m_failedWorkers == m_workerCount)); });
+				if (m_stopRequest)
+				{
+					break;
+				}
+
+				request = m_requests.front();
+				m_requests.pop_front();
+			}
+
+			SymbolizedBlock block;
+			SrcPos srcPosBegin = {};
+			SrcPos srcPosEnd = {};
+			if (ses &&
+				RvaToLine(ses, request.rvaBegin, srcPosBegin) &&
+				RvaToLine(ses, request.rvaEnd, srcPosEnd) &&
+				0 < srcPosBegin.line)
+			{
+				block.found = true;
+				block.beginLine = srcPosBegin.line - 1;
+				// 終端が別のファイルに解決された場合は開始行だけのブロックとして扱う
+				block.endLine = (srcPosEnd.file == srcPosBegin.file && 0 < srcPosEnd.line) ? (srcPosEnd.line - 1) : block.beginLine;
+				block.file = std::move(srcPosBegin.file);
+			}
+
+			if (ses)
+			{
+				RvaToFunction(ses, request.rvaBegin, block.function);
+			}
+
+			m_table.insert(request.address, std::move(block));
+
+			std::lock_guard lock(m_completedMutex);
+			m_completed.push_back(request.address);
+		}
+
+		ses.Release();
+		src.Release();
+		::CoUninitialize();
+	}
+
+	std::vector<std::thread> m_workers;
+	size_t m_workerCount = 0;
+	std::atomic<size_t> m_failedWorkers = 0;
+
+	std::mutex m_requestMutex;
+	std::condition_variable m_requestCondition;
+	std::deque<Request> m_requests;
+	bool m_stopRequest = false;
+
+	std::mutex m_completedMutex;
+	std::vector<uint64_t> m_completed;
+
+	BlockSymbolTable m_table;
+};
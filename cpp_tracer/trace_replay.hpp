@@ -0,0 +1,182 @@
+﻿#pragma once
+#include <future>
+#include <optional>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include "../trace_file.hpp"
+
+// 記録済みトレースのイベントをファイルの順に取り出す
+// seek() ではその時刻以前の最後のキーフレームに移動し、残りはそこから続くイベントで追いつく
+// 次のチャンクは取り出している間に裏で展開しておく
+// 読めないチャンクは飛ばして readErrors() に数える
+class TraceReplayer
+{
+public:
+
+	bool open(const std::filesystem::path& path)
+	{
+		dropPrefetch();
+		m_chunk = {};
+		m_position = 0;
+		m_nextChunk = 0;
+		m_readErrors = 0;
+		return m_reader.open(path);
+	}
+
+	TraceReader& reader()
+	{
+		return m_reader;
+	}
+
+	// keyframe にキーフレームの累計を入れる（timestamp 以前のキーフレームが無ければ空で、先頭から流す）
+	void seek(uint64_t timestamp, std::vector<TraceKeyframeEntry>& keyframe)
+	{
+		keyframe.clear();
+		m_nextChunk = 0;
+
+		const size_t keyframeIndex = m_reader.findKeyframe(timestamp);
+		if (keyframeIndex != SIZE_MAX)
+		{
+			if (m_reader.readKeyframe(keyframeIndex, keyframe))
+			{
+				m_nextChunk = m_reader.keyframeHeader(keyframeIndex).sequence;
+			}
+			else
+			{
+				keyframe.clear();
+				++m_readErrors;
+			}
+		}
+
+		m_chunk.events.clear();
+		m_position = 0;
+	}
+
+	// chunkIndex 番目のチャンクの先頭に移動する
+	void seekChunk(size_t chunkIndex)
+	{
+		m_nextChunk = chunkIndex;
+		m_chunk.events.clear();
+		m_position = 0;
+	}
+
+	// 今のチャンクを取り出し終えていれば次に読むチャンクの番号、途中なら SIZE_MAX
+	size_t nextChunkAtBoundary() const
+	{
+		return (m_chunk.events.size() <= m_position) ? m_nextChunk : SIZE_MAX;
+	}
+
+	// chunkIndex 番目のチャンクから続くキーフレームの番号（無ければ SIZE_MAX）
+	size_t keyframeAtChunk(size_t chunkIndex) const
+	{
+		size_t low = 0;
+		size_t high = m_reader.keyframeCount();
+		while (low < high)
+		{
+			const size_t middle = (low + high) / 2;
+			if (m_reader.keyframeHeader(middle).sequence < chunkIndex)
+			{
+				low = middle + 1;
+			}
+			else
+			{
+				high = middle;
+			}
+		}
+		return (low < m_reader.keyframeCount() && m_reader.keyframeHeader(low).sequence == chunkIndex) ? low : SIZE_MAX;
+	}
+
+	// 読めずに飛ばしたチャンクとキーフレームの数
+	uint64_t readErrors() const
+	{
+		return m_readErrors;
+	}
+
+	// 次のイベント（終端なら nullptr）
+	const EventArgs* peek()
+	{
+		while (m_chunk.events.size() <= m_position)
+		{
+			if (m_reader.chunkCount() <= m_nextChunk)
+			{
+				return nullptr;
+			}
+
+			std::optional<DecodedChunk> chunk;
+			if (m_prefetch.valid() && m_prefetchIndex == m_nextChunk)
+			{
+				chunk = m_prefetch.get();
+			}
+			else
+			{
+				dropPrefetch();
+				chunk = load(m_nextChunk);
+			}
+
+			if (chunk)
+			{
+				m_chunk = std::move(*chunk);
+			}
+			else
+			{
+				m_chunk.events.clear();
+				++m_readErrors;
+			}
+
+			++m_nextChunk;
+			m_position = 0;
+
+			if (m_nextChunk < m_reader.chunkCount())
+			{
+				m_prefetchIndex = m_nextChunk;
+				m_prefetch = std::async(std::launch::async, [this, index = m_nextChunk]() { return load(index); });
+			}
+		}
+
+		return &m_chunk.events[m_position];
+	}
+
+	void pop()
+	{
+		++m_position;
+	}
+
+	// peek() で取り出した ModuleAdd のパス
+	std::string_view modulePath(const ModEvent& mod) const
+	{
+		return m_chunk.modulePath(mod);
+	}
+
+private:
+
+	std::optional<DecodedChunk> load(size_t index)
+	{
+		std::optional<DecodedChunk> chunk{ std::in_place };
+		if (!m_reader.readChunk(index, *chunk))
+		{
+			chunk.reset();
+		}
+		return chunk;
+	}
+
+	void dropPrefetch()
+	{
+		if (m_prefetch.valid())
+		{
+			m_prefetch.wait();
+			m_prefetch = {};
+		}
+	}
+
+	TraceReader m_reader;
+
+	DecodedChunk m_chunk;
+	size_t m_position = 0;
+	size_t m_nextChunk = 0;
+
+	std::future<std::optional<DecodedChunk>> m_prefetch;
+	size_t m_prefetchIndex = 0;
+
+	uint64_t m_readErrors = 0;
+};
@@ -3,7 +3,17 @@
 #include <Siv3D.hpp> // Siv3D v0.6.16
 #include "../trace_common.hpp"
 #include "../utility.hpp"
+#include "../trace_file.hpp"
+#include "../trace_session.hpp"
 #include "dia_session.hpp"
+#include "snapshot.hpp"
+#include "line_index.hpp"
+#include "hit_timeline.hpp"
+#include "loop_folder.hpp"
+#include "source_files.hpp"
+#include "symbolizer.hpp"
+#include "trace_replay.hpp"
+#include "../trace_query.hpp"
 
 struct ModuleInfo
 {
@@ -16,21 +26,6 @@ struct ModuleInfo
 	}
 };
 
-inline bool spscPop(RingHeader* h, EventArgs* buf, EventArgs& out)
-{
-	const uint32_t r = h->readIndex, w = h->writeIndex;
-	if (r == w)
-	{
-		return false;
-	}
-
-	out = buf[r];
-	_ReadWriteBarrier();
-	h->readIndex = (r + 1) & (h->capacity - 1);
-
-	return true;
-}
-
 inline bool spscPush(RingHeader* h, Command* buf, const Command& v)
 {
 	const uint32_t w = h->writeIndex, r = h->readIndex;
@@ -48,7 +43,31 @@ inline bool spscPush(RingHeader* h, Command* buf, const Command& v)
 	return true;
 }
 
-Optional<DWORD> StartDebug(const std::wstring& exeFilePath, const std::wstring& clientArg)
+// クライアントが書き換えている最中でない、一貫した内容を写す
+inline bool readHotBlocks(const volatile HotBlockTable* table, HotBlockTable& out)
+{
+	for (int retry = 0; retry < 16; ++retry)
+	{
+		const uint32_t sequence = table->sequence;
+		if (sequence & 1)
+		{
+			continue;
+		}
+
+		_ReadWriteBarrier();
+		std::memcpy(&out, const_cast<const HotBlockTable*>(table), sizeof(out));
+		_ReadWriteBarrier();
+
+		if (table->sequence == sequence)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+Optional<DWORD> StartDebug(const std::wstring& exeFilePath, const std::wstring& clientArg, const std::vector<std::wstring>& clientOptions)
 {
 	const std::wstring drrunPath = L"../../external/DynamoRIO/bin64/drrun.exe";
 	const std::wstring clientPath = LR"(../../trace_client/build/Release/trace_client.dll)";
@@ -58,8 +77,10 @@ Optional<DWORD> StartDebug(const std::wstring& exeFilePath, const std::wstring&
 	argv.push_back(drrunPath);
 	argv.push_back(L"-c");
 	argv.push_back(clientPath);
+	// drrun は子プロセスにも同じクライアントと引数を入れるので、子プロセスも同じセッションに登録される
 	argv.push_back(L"--channel");
 	argv.push_back(clientArg);
+	argv.insert(argv.end(), clientOptions.begin(), clientOptions.end());
 	argv.push_back(L"--");
 	argv.push_back(appPath);
 
@@ -91,10 +112,222 @@ Optional<DWORD> StartDebug(const std::wstring& exeFilePath, const std::wstring&
 	return pi.dwProcessId;
 }
 
-struct LineRange
+// 記録の設定（コマンドライン引数）
+//   --no-record          記録しない
+//   --codec=zstd|lz4|none
+//   --level=N            圧縮レベル
+//   --record-threads=N   圧縮スレッド数
+struct RecordSettings
 {
-	uint32 startLine = 0;
-	uint32 endLine = 0;
+	bool enabled = true;
+	TraceRecorderOptions options;
+};
+
+RecordSettings ParseRecordSettings(const Array<String>& args)
+{
+	RecordSettings settings;
+	for (const auto& arg : args)
+	{
+		if (arg == U"--no-record")
+		{
+			settings.enabled = false;
+		}
+		else if (arg.starts_with(U"--codec="))
+		{
+			TraceCodec codec;
+			if (trace_codec::Parse(arg.substr(8).narrow(), codec))
+			{
+				settings.options.codec = codec;
+			}
+			else
+			{
+				Logger << U"unknown codec: " << arg;
+			}
+		}
+		else if (arg.starts_with(U"--level="))
+		{
+			settings.options.level = ParseOr<int32>(arg.substr(8), settings.options.level);
+		}
+		else if (arg.starts_with(U"--record-threads="))
+		{
+			settings.options.compressorThreads = ParseOr<uint32>(arg.substr(17), settings.options.compressorThreads);
+		}
+	}
+
+	if (!trace_codec::IsAvailable(settings.options.codec))
+	{
+		Logger << U"codec " << Unicode::Widen(trace_codec::Name(settings.options.codec)) << U" is not available";
+	}
+
+	return settings;
+}
+
+// 子プロセス（セッションの 1 番以降のチャンネル）は表示せず、それぞれの読み取りスレッドで pid ごとのファイルに記録する
+struct ChildProcess
+{
+	uint32 slot = 0;
+	uint32 pid = 0;
+	ShmLayout* shm = nullptr;
+
+	// exe の ModuleAdd が届いたら（記録する exe のパスが決まったら）開く
+	TraceRecorder recorder;
+	std::atomic<bool> recording = false;
+	bool exeSeen = false;
+	std::vector<std::pair<EventArgs, std::string>> pendingEvents;
+	std::atomic<uint64> droppedPendingEvents = 0;
+
+	// 先に止めるように最後に置く
+	ChannelReader reader;
+};
+
+struct IngestStats
+{
+	uint64 readCount = 0;
+	uint64 outAddressRange = 0;
+	uint64 failVaToLine = 0;
+	uint64 hit = 0;
+
+	// シンボル解決待ちのブロック数と、それらに届いて保留しているイベント数
+	uint64 pendingBlocks = 0;
+	uint64 pendingEvents = 0;
+
+	// ループの反復として既にある列に畳んだ列の数
+	uint64 foldedColumns = 0;
+
+	// --mem で受け取ったメモリアクセス（記録するだけで、解析は trace_cli mem で行う）
+	uint64 memoryAccesses = 0;
+};
+
+// タイムラインのキー：上位 32bit がファイル ID、下位 32bit が行
+inline uint64 MakeHitKey(uint32 fileId, uint32 line)
+{
+	return (static_cast<uint64>(fileId) << 32) | line;
+}
+
+// ファイルが未選択のときは一番ヒット数の多いファイルを表示する
+constexpr uint32 AutoFileId = UINT32_MAX;
+
+// 受信スレッドが持つ解決済みブロックの情報
+struct ResolvedBlock
+{
+	// 行情報が無い場合は AutoFileId
+	uint32 fileId = AutoFileId;
+	uint32 beginLine = 0;
+
+	// BlockDefine で届いたブロックの命令数（届いていなければ 0）
+	uint32 instructionCount = 0;
+};
+
+// 描画ループ -> 受信スレッド：タイムラインのどこを表示したいか
+struct TimelineViewport
+{
+	uint32 fileId = AutoFileId;
+	uint32 level = 0;
+	uint64 firstBucket = 0;
+	uint32 bucketCount = 0;
+	uint32 topLine = 0;
+	uint32 bottomLine = 0;
+
+	// 最新の列が右端に来るように firstBucket を受信側で決める
+	bool follow = true;
+
+	bool operator==(const TimelineViewport&) const = default;
+};
+
+struct TimelineCell
+{
+	uint32 xIndex = 0;
+	uint32 line = 0;
+	uint32 count = 0;
+};
+
+// ブロック（開始行）ごとの累計ヒット数と、それに命令数を掛けた実行命令数
+struct LineTotal
+{
+	uint32 line = 0;
+	uint64 count = 0;
+	uint64 instructions = 0;
+};
+
+// 描画ループ -> 受信スレッド：リプレイの操作
+struct ReplayControl
+{
+	// 変わったら seekTimestamp に移動する
+	uint64 seekSerial = 0;
+	uint64 seekTimestamp = 0;
+
+	bool playing = false;
+	double speed = 1.0;
+};
+
+// 上位 K ブロックの 1 行（解決済みなら fileId と行が入る）
+struct HotBlockView
+{
+	uint64 address = 0;
+	uint64 count = 0;
+	uint64 error = 0;
+	uint32 fileId = AutoFileId;
+	uint32 line = 0;
+};
+
+struct ReplayState
+{
+	bool active = false;
+	uint64 firstTimestamp = 0;
+	uint64 lastTimestamp = 0;
+	uint64 position = 0;
+
+	// 読めずに飛ばしたチャンクとキーフレームの数
+	uint64 readErrors = 0;
+};
+
+// リプレイでキーフレームの位置を通ったときの受信スレッドの状態
+// ファイルのキーフレームはブロックごとの累計しか持たないので、シークでここに戻ればタイムラインまで元どおりになる
+struct ReplaySnapshot
+{
+	HitTimeline timeline;
+	LoopFolder loopFolder;
+	Array<uint64> fileHits;
+	std::unordered_map<uint64, uint64> lineHits;
+	std::unordered_map<uint64, uint64> lineInstructions;
+	IngestStats stats;
+};
+
+// 覚えておく状態の数（超えたら間引く）
+constexpr size_t MaxReplaySnapshots = 16;
+
+// 受信スレッドが発行し、描画ループがロックを取らずに参照する不変の状態
+struct ViewSnapshot
+{
+	uint64 epoch = 0;
+	IngestStats stats;
+
+	// fileId -> パス / ヒット数
+	std::shared_ptr<const Array<String>> filePaths;
+	Array<uint64> fileHits;
+
+	// viewport.fileId のブロック定義
+	std::shared_ptr<const BlockLineIndex> linesDef;
+
+	// viewport の範囲だけを集約済みのセルとして持つ（描画するセル数は表示範囲で決まる）
+	TimelineViewport viewport;
+	Array<TimelineCell> cells;
+	uint32 maxCellCount = 0;
+	uint64 columnCount = 0;
+
+	// 表示範囲のバケットごとの、畳まれている列の数
+	Array<uint32> bucketRepeats;
+
+	// viewport の範囲のブロックの累計（リプレイではキーフレームからの分を含む）
+	Array<LineTotal> lineTotals;
+	uint64 maxLineTotal = 0;
+	uint64 maxLineInstructions = 0;
+
+	// クライアントのスケッチによる上位 K ブロック（回数の降順）
+	Array<HotBlockView> hotBlocks;
+	uint64 hotBlockTotal = 0;
+
+	ReplayState replay;
 };
 
 void Main()
@@ -102,194 +335,721 @@ void Main()
 	::CoInitializeEx(nullptr, COINIT_MULTITHREADED);
 
 	const wchar_t* msdiaPath = L".\\dia_sdk\\amd64\\msdia140.dll";
-	CComPtr<IDiaDataSource> src;
-	if (FAILED(CreateDiaDataSource(msdiaPath, &src)))
 	{
-		CoUninitialize();
-		throw Error{ Format(U"CreateDiaDataSource failed by error: ", GetLastError()) };
-		return;
+		CComPtr<IDiaDataSource> src;
+		if (FAILED(CreateDiaDataSource(msdiaPath, &src)))
+		{
+			CoUninitialize();
+			throw Error{ Format(U"CreateDiaDataSource failed by error: ", GetLastError()) };
+			return;
+		}
 	}
 
-	CComPtr<IDiaSession> ses;
+	Symbolizer symbolizer;
 	Optional<DWORD> processId;
 
-	uint32_t channel = 0;
-	bool running = false;
+	// 受信したイベントをそのままチャンク圧縮して保存する（受信スレッドから append する）
+	const RecordSettings recordSettings = ParseRecordSettings(System::GetCommandLineArgs());
+
+	// --topk-only : クライアントはイベントを送らず、上位 K ブロックのスケッチだけを共有する
+	std::vector<std::wstring> clientOptions;
+	if (System::GetCommandLineArgs().includes(U"--topk-only"))
+	{
+		clientOptions.push_back(L"--topk-only");
+	}
+
+	// --mem[=N] : ロード / ストアのアドレスを N バッファに 1 回の割合で送らせる
+	for (const auto& arg : System::GetCommandLineArgs())
+	{
+		if (arg == U"--mem" || arg.starts_with(U"--mem="))
+		{
+			clientOptions.push_back(arg.toWstr());
+		}
+	}
+	TraceRecorder recorder;
+	String recordBasePath;
+
+	// 0 番のチャンネル（drrun で起動した exe）は受信スレッドで表示し、子プロセスは ChildProcess ごとのスレッドで記録する
+	TraceSession session;
+	std::atomic<bool> running = false;
 	ShmLayout* shm = nullptr;
-	HANDLE hMap = nullptr;
+	Array<std::unique_ptr<ChildProcess>> childProcesses;
+	Stopwatch connectStopwatch;
 
 	Optional<ModuleInfo> exeModuleInfo;
 
-	uint64 readCount = 0;
-
-	bool loaded = false;
-	Array<String> lines;
 	Font font(12);
 	int lineMargin = 20;
-	Array<int> lineCount(300, 0);
 
 	Scene::SetBackground(Palette::White);
 
-	std::map<uint32, LineRange> basicBlockLinesDef;
-	const auto updateLinesDef = [&basicBlockLinesDef]()
-		{
-			if (basicBlockLinesDef.size() < 2)
+	SourceFileTable sourceFiles;
+	Array<BlockLineIndex> fileBlocks;
+	Array<uint64> fileHits;
+	constexpr uint32 TimelineLevelCount = 24;
+	constexpr uint32 TimelineBucketsPerLevel = 512;
+	HitTimeline timeline{ TimelineBucketsPerLevel, TimelineLevelCount };
+	// 列はスレッドごとに区切り、同じ並びの列は畳む（畳めるのはレベル 0 で保持されている列まで）
+	LoopFolder loopFolder{ TimelineBucketsPerLevel };
+	auto lastEventTime = std::chrono::steady_clock::now();
+
+	// ヒットキー -> 累計ヒット数 / 実行命令数
+	std::unordered_map<uint64, uint64> lineHits;
+	std::unordered_map<uint64, uint64> lineInstructions;
+
+	// ブロックの先頭アドレス -> 命令数（BlockDefine とキーフレームから。シークしても消さない）
+	std::unordered_map<uint64, uint32> blockInstructions;
+
+	// ブロックの先頭アドレス -> 解決結果（受信スレッド専用）
+	std::unordered_map<uint64, ResolvedBlock> resolvedBlocks;
+	// 解決を頼んで結果がまだ届いていないブロック
+	HashSet<uint64> pendingBlocks;
+	// 解決待ちのブロックのイベントと、それより後に届いたイベント（届いた順に保留し、先頭から解決済みのところまで流す）
+	// ブロックごとにまとめて流すと、スレッド内の順序が入れ替わって LoopFolder の列の区切りが変わる
+	std::deque<BBEvent> heldEvents;
+	std::vector<uint64> completedBlocks;
+	uint32 eventsSinceCompletionCheck = 0;
+
+	// リプレイ（記録済みトレースを開いたとき）
+	TraceReplayer replayer;
+	std::atomic<bool> replaying = false;
+	TripleBuffer<ReplayControl> replayControls;
+	ReplayControl replayControl;
+	ReplayState replayState;
+	std::vector<TraceKeyframeEntry> keyframe;
+	// 解決待ちのブロックのキーフレーム分のヒット数
+	std::unordered_map<uint64, uint64> pendingKeyframeHits;
+	// キーフレームの番号 -> そこを通ったときの状態（replaySnapshotStride の倍数の番号だけ残す）
+	std::map<size_t, ReplaySnapshot> replaySnapshots;
+	size_t replaySnapshotStride = 1;
+	// 先頭から流した状態か（キーフレームの累計から始めたときはタイムラインが欠けているので状態を残さない）
+	bool replayFromStart = false;
+	// 再生位置は (replayAnchorPosition, replayAnchorTime) からの経過時間 * 速度
+	uint64 replayAnchorPosition = 0;
+	auto replayAnchorTime = std::chrono::steady_clock::now();
+	ReplayControl replayRequest;
+	double replaySliderValue = 0.0;
+
+	// 描画側で開いているソースファイル（表示するときにだけマップする）
+	// UTF-8 でないファイルは以前と同じく TextReader に文字コードを判定させて全体を読む
+	MappedSourceText sourceText;
+	Array<String> decodedSourceLines;
+	uint32 sourceTextFileId = AutoFileId;
+	uint32 selectedFileId = AutoFileId;
+	bool showFileBrowser = false;
+	int32 fileBrowserTop = 0;
+
+	int32 topLine = 0;
+	uint32 timelineLevel = 0;
+	uint64 timelineFirstBucket = 0;
+	bool timelineFollow = true;
+	Console << U"console";
+
+	Window::Resize(1280, 720);
+
+	IngestStats stats;
+
+	Array<HotBlockView> hotBlocks;
+	uint64 hotBlockTotal = 0;
+	auto lastHotBlocksTime = std::chrono::steady_clock::now();
+	bool showHotBlocks = false;
+
+	// 行番号の後ろの棒をヒット数ではなく実行命令数で描く
+	bool showInstructions = false;
+
+	// 描画ループ -> 受信スレッド
+	TripleBuffer<TimelineViewport> viewportRequests;
+	TimelineViewport viewport;
+	TimelineViewport requestedViewport;
+
+	// 受信スレッド -> 描画ループ
+	TripleBuffer<ViewSnapshot> snapshots;
+	uint64 epoch = 0;
+	bool filePathsChanged = false;
+	std::shared_ptr<const Array<String>> publishedFilePaths;
+	Array<std::shared_ptr<const BlockLineIndex>> publishedFileBlocks;
+	auto lastPublishTime = std::chrono::steady_clock::now();
+	bool dirty = false;
+
+	// 現在の再生位置（タイムスタンプ）
+	const auto replayPosition = [&]()
+		{
+			if (!replayControl.playing)
+			{
+				return replayAnchorPosition;
+			}
+
+			const double elapsedUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - replayAnchorTime).count();
+			return Min(replayState.lastTimestamp, replayAnchorPosition + static_cast<uint64>(elapsedUs * replayControl.speed));
+		};
+
+	const auto publishSnapshot = [&]()
+		{
+			if (filePathsChanged || !publishedFilePaths)
+			{
+				Array<String> paths(Arg::reserve = sourceFiles.size());
+				for (uint32 fileId = 0; fileId < sourceFiles.size(); ++fileId)
+				{
+					paths << Unicode::FromWstring(sourceFiles.path(fileId));
+				}
+				publishedFilePaths = std::make_shared<const Array<String>>(std::move(paths));
+				filePathsChanged = false;
+			}
+
+			auto& snapshot = snapshots.back();
+			snapshot.epoch = ++epoch;
+			snapshot.stats = stats;
+			snapshot.filePaths = publishedFilePaths;
+			snapshot.fileHits = fileHits;
+			snapshot.hotBlocks = hotBlocks;
+			snapshot.hotBlockTotal = hotBlockTotal;
+
+			TimelineViewport vp = viewport;
+			if (fileBlocks.size() <= vp.fileId)
+			{
+				vp.fileId = AutoFileId;
+				if (!fileHits.isEmpty())
+				{
+					vp.fileId = static_cast<uint32>(std::max_element(fileHits.begin(), fileHits.end()) - fileHits.begin());
+				}
+			}
+
+			if (vp.follow)
+			{
+				const uint64 lastBucket = (timeline.columnCount() == 0) ? 0 : ((timeline.columnCount() - 1) >> vp.level);
+				vp.firstBucket = (vp.bucketCount <= lastBucket) ? (lastBucket + 1 - vp.bucketCount) : 0;
+			}
+
+			snapshot.viewport = vp;
+			snapshot.cells.clear();
+			snapshot.maxCellCount = 0;
+			snapshot.columnCount = timeline.columnCount();
+			snapshot.bucketRepeats.assign(vp.bucketCount, 0);
+			for (uint32 xi = 0; xi < vp.bucketCount; ++xi)
+			{
+				snapshot.bucketRepeats[xi] = timeline.repeatCount(vp.level, vp.firstBucket + xi);
+			}
+			snapshot.linesDef.reset();
+			snapshot.lineTotals.clear();
+			snapshot.maxLineTotal = 0;
+			snapshot.maxLineInstructions = 0;
+			snapshot.replay = replayState;
+			if (replaying)
+			{
+				snapshot.replay.position = replayPosition();
+				snapshot.replay.readErrors = replayer.readErrors();
+			}
+
+			if (vp.fileId != AutoFileId)
+			{
+				// チャンクは共有されるので、コピーされるのはチャンクへのポインタ列だけ
+				auto& publishedLinesDef = publishedFileBlocks[vp.fileId];
+				if (!publishedLinesDef)
+				{
+					publishedLinesDef = std::make_shared<const BlockLineIndex>(fileBlocks[vp.fileId]);
+				}
+				snapshot.linesDef = publishedLinesDef;
+
+				// 表示範囲の上端に掛かっているブロックはそれより前の行から始まる
+				uint32 firstLine = vp.topLine;
+				fileBlocks[vp.fileId].forEachOverlapping(vp.topLine, vp.bottomLine, [&](const LineRange& range)
+				{
+					firstLine = Min(firstLine, range.startLine);
+				});
+
+				for (uint32 line = firstLine; line < vp.bottomLine; ++line)
+				{
+					const uint64 key = MakeHitKey(vp.fileId, line);
+					if (const auto it = lineHits.find(key); it != lineHits.end())
+					{
+						const auto instructions = lineInstructions.find(key);
+						LineTotal total{ line, it->second, (instructions != lineInstructions.end()) ? instructions->second : 0 };
+						snapshot.lineTotals.push_back(total);
+						snapshot.maxLineTotal = Max(snapshot.maxLineTotal, total.count);
+						snapshot.maxLineInstructions = Max(snapshot.maxLineInstructions, total.instructions);
+					}
+				}
+
+				const uint64 firstKey = MakeHitKey(vp.fileId, firstLine);
+				const uint64 lastKey = MakeHitKey(vp.fileId, vp.bottomLine);
+				for (uint32 xi = 0; xi < vp.bucketCount; ++xi)
+				{
+					timeline.forEachCell(vp.level, vp.firstBucket + xi, firstKey, lastKey, [&](const HitTimeline::Cell& cell)
+					{
+						snapshot.cells.push_back(TimelineCell{ xi, static_cast<uint32>(cell.key), cell.count });
+						snapshot.maxCellCount = Max(snapshot.maxCellCount, cell.count);
+					});
+				}
+			}
+
+			snapshots.publish();
+
+			lastPublishTime = std::chrono::steady_clock::now();
+			dirty = false;
+		};
+
+	// 累計だけに加える（タイムラインには載せない）
+	const auto addHits = [&](const ResolvedBlock& block, uint64 count)
+		{
+			if (block.fileId == AutoFileId)
+			{
+				stats.failVaToLine += count;
+				return;
+			}
+
+			fileHits[block.fileId] += count;
+			lineHits[MakeHitKey(block.fileId, block.beginLine)] += count;
+			if (block.instructionCount != 0)
+			{
+				lineInstructions[MakeHitKey(block.fileId, block.beginLine)] += count * block.instructionCount;
+			}
+			stats.hit += count;
+		};
+
+	// LoopFolder が閉じた列をタイムラインに載せる
+	const auto emitColumn = [&](uint64 column, const std::vector<uint64>& keys, bool folded)
+		{
+			for (const uint64 key : keys)
+			{
+				timeline.add(column, key);
+			}
+
+			if (folded)
+			{
+				timeline.addRepeat(column);
+				++stats.foldedColumns;
+			}
+		};
+
+	const auto ingestHit = [&](const ResolvedBlock& block, uint32 threadId)
+		{
+			if (block.fileId == AutoFileId)
+			{
+				++stats.failVaToLine;
+				return;
+			}
+
+			// 行が戻ったら次の列へ（列はスレッドごとに作り、閉じたときにタイムラインに載る）
+			loopFolder.add(threadId, MakeHitKey(block.fileId, block.beginLine), emitColumn);
+			addHits(block, 1);
+		};
+
+	// ワーカーが解決したブロックを取り込んで、保留していたイベントを流す
+	const auto applyCompletedBlocks = [&]()
+		{
+			completedBlocks.clear();
+			symbolizer.takeCompleted(completedBlocks);
+
+			for (const uint64 address : completedBlocks)
+			{
+				SymbolizedBlock symbolized;
+				if (!symbolizer.table().find(address, symbolized))
+				{
+					continue;
+				}
+
+				ResolvedBlock block;
+				if (symbolized.found)
+				{
+					const uint32 fileId = sourceFiles.intern(symbolized.file);
+					if (fileBlocks.size() <= fileId)
+					{
+						fileBlocks.emplace_back();
+						fileHits.push_back(0);
+						publishedFileBlocks.emplace_back();
+						filePathsChanged = true;
+					}
+
+					if (fileBlocks[fileId].insert(symbolized.beginLine, symbolized.endLine))
+					{
+						publishedFileBlocks[fileId].reset();
+					}
+
+					block.fileId = fileId;
+					block.beginLine = symbolized.beginLine;
+				}
+
+				if (const auto it = blockInstructions.find(address); it != blockInstructions.end())
+				{
+					block.instructionCount = it->second;
+				}
+
+				resolvedBlocks.emplace(address, block);
+				if (pendingBlocks.erase(address))
+				{
+					--stats.pendingBlocks;
+				}
+
+				if (auto it = pendingKeyframeHits.find(address); it != pendingKeyframeHits.end())
+				{
+					addHits(block, it->second);
+					pendingKeyframeHits.erase(it);
+				}
+
+				dirty = true;
+			}
+
+			// 届いた順に、まだ解決していないブロックのイベントに当たるまで流す
+			while (!heldEvents.empty())
+			{
+				const auto it = resolvedBlocks.find(heldEvents.front().app_pc);
+				if (it == resolvedBlocks.end())
+				{
+					break;
+				}
+
+				ingestHit(it->second, heldEvents.front().tid);
+				heldEvents.pop_front();
+				--stats.pendingEvents;
+			}
+		};
+
+	// 初めて見たブロックはワーカーに解決を頼む
+	const auto requestBlock = [&](uint64 address, uint64 endAddress)
+		{
+			if (pendingBlocks.insert(address).second)
+			{
+				const uint64 base = exeModuleInfo.value().baseAddr;
+				symbolizer.request(address, static_cast<uint32>(address - base), static_cast<uint32>(endAddress - base));
+				++stats.pendingBlocks;
+			}
+		};
+
+	// 共有メモリの上位 K ブロックを取り込み、未解決のブロックは解決を頼む
+	const auto updateHotBlocks = [&]()
+		{
+			HotBlockTable table;
+			if (!readHotBlocks(&shm->hotBlocks, table))
+			{
+				return;
+			}
+
+			hotBlocks.clear();
+			hotBlockTotal = table.totalHits;
+			for (uint32 i = 0; i < Min(table.count, static_cast<uint32>(std::size(table.entries))); ++i)
+			{
+				const HotBlockEntry& entry = table.entries[i];
+				HotBlockView hot{ .address = entry.address, .count = entry.count, .error = entry.error };
+				if (const auto it = resolvedBlocks.find(entry.address); it != resolvedBlocks.end())
+				{
+					hot.fileId = it->second.fileId;
+					hot.line = it->second.beginLine;
+				}
+				else if (exeModuleInfo &&
+					exeModuleInfo.value().inRange(entry.address) &&
+					exeModuleInfo.value().inRange(entry.endAddress))
+				{
+					requestBlock(entry.address, entry.endAddress);
+				}
+				hotBlocks.push_back(hot);
+			}
+
+			dirty = true;
+		};
+
+	// ブロックの命令数を覚える（解決済みのブロックにはこれからのヒットから反映する）
+	const auto defineBlock = [&](uint64 address, uint32 instructionCount)
+		{
+			blockInstructions[address] = instructionCount;
+			if (const auto it = resolvedBlocks.find(address); it != resolvedBlocks.end())
+			{
+				it->second.instructionCount = instructionCount;
+			}
+		};
+
+	// キーフレームの累計を取り込む（解決待ちのブロックの分は解決したときに加える）
+	const auto applyKeyframeHits = [&](const TraceKeyframeEntry& entry)
+		{
+			if (entry.instructionCount != 0)
+			{
+				defineBlock(entry.address, entry.instructionCount);
+			}
+
+			// 定義だけが届いていて、まだ実行されていないブロック
+			if (entry.hitCount == 0)
+			{
+				return;
+			}
+
+			if (!exeModuleInfo ||
+				!exeModuleInfo.value().inRange(entry.address) ||
+				!exeModuleInfo.value().inRange(entry.endAddress))
+			{
+				stats.outAddressRange += entry.hitCount;
+				return;
+			}
+
+			if (const auto it = resolvedBlocks.find(entry.address); it != resolvedBlocks.end())
+			{
+				addHits(it->second, entry.hitCount);
+				return;
+			}
+
+			requestBlock(entry.address, entry.endAddress);
+			pendingKeyframeHits[entry.address] += entry.hitCount;
+		};
+
+	// キーフレームの位置にいて、先頭から流した状態で、保留も無ければ覚えておく
+	const auto saveReplaySnapshot = [&]()
+		{
+			const size_t chunkIndex = replayer.nextChunkAtBoundary();
+			if (chunkIndex == SIZE_MAX || !replayFromStart || !heldEvents.empty())
+			{
+				return;
+			}
+
+			const size_t keyframeIndex = replayer.keyframeAtChunk(chunkIndex);
+			if (keyframeIndex == SIZE_MAX || keyframeIndex % replaySnapshotStride != 0 || replaySnapshots.contains(keyframeIndex))
+			{
+				return;
+			}
+
+			replaySnapshots.emplace(keyframeIndex, ReplaySnapshot{ timeline, loopFolder, fileHits, lineHits, lineInstructions, stats });
+			if (MaxReplaySnapshots < replaySnapshots.size())
+			{
+				replaySnapshotStride *= 2;
+				std::erase_if(replaySnapshots, [&](const auto& snapshot) { return snapshot.first % replaySnapshotStride != 0; });
+			}
+		};
+
+	// target 以前の最後のキーフレームから状態を作り直す
+	// そこより前で覚えている状態があればそこから流し直し、無ければキーフレームの累計から始める（タイムラインはキーフレーム以降の分だけになる）
+	const auto seekReplay = [&](uint64 target)
+		{
+			pendingKeyframeHits.clear();
+
+			// 解決の依頼はそのまま残し、保留していたイベントだけ捨てる
+			stats.pendingEvents -= heldEvents.size();
+			heldEvents.clear();
+
+			// target 以前の最後のキーフレームか、それより前で一番近い覚えている状態
+			const size_t keyframeIndex = replayer.reader().findKeyframe(target);
+			auto snapshot = replaySnapshots.end();
+			if (keyframeIndex != SIZE_MAX)
+			{
+				snapshot = replaySnapshots.upper_bound(keyframeIndex);
+				snapshot = (snapshot == replaySnapshots.begin()) ? replaySnapshots.end() : std::prev(snapshot);
+			}
+
+			if (snapshot != replaySnapshots.end())
+			{
+				const ReplaySnapshot& saved = snapshot->second;
+				timeline = saved.timeline;
+				loopFolder = saved.loopFolder;
+				fileHits = saved.fileHits;
+				fileHits.resize(fileBlocks.size(), 0);
+				lineHits = saved.lineHits;
+				lineInstructions = saved.lineInstructions;
+
+				// 解決待ちの数は今のまま
+				const IngestStats current = stats;
+				stats = saved.stats;
+				stats.pendingBlocks = current.pendingBlocks;
+				stats.pendingEvents = current.pendingEvents;
+
+				replayer.seekChunk(replayer.reader().keyframeHeader(snapshot->first).sequence);
+				replayFromStart = true;
+			}
+			else
+			{
+				timeline.clear();
+				loopFolder.clear();
+				std::fill(fileHits.begin(), fileHits.end(), 0);
+				lineHits.clear();
+				lineInstructions.clear();
+
+				stats.readCount = 0;
+				stats.outAddressRange = 0;
+				stats.failVaToLine = 0;
+				stats.hit = 0;
+				stats.foldedColumns = 0;
+				stats.memoryAccesses = 0;
+
+				replayer.seek(target, keyframe);
+				for (const auto& entry : keyframe)
+				{
+					applyKeyframeHits(entry);
+				}
+				replayFromStart = keyframe.empty();
+			}
+
+			replayAnchorPosition = target;
+			replayAnchorTime = std::chrono::steady_clock::now();
+			dirty = true;
+		};
+
+	// 再生位置までのイベントを 1 つ取り出す
+	const auto nextReplayEvent = [&](EventArgs& ev, std::string& modulePath)
+		{
+			if (replayControls.update())
+			{
+				const ReplayControl& control = replayControls.front();
+				const bool seek = (control.seekSerial != replayControl.seekSerial);
+
+				// 速度や再生 / 一時停止が変わったら、今の位置から測り直す
+				replayAnchorPosition = replayPosition();
+				replayAnchorTime = std::chrono::steady_clock::now();
+				replayControl = control;
+
+				if (seek)
+				{
+					seekReplay(Clamp(control.seekTimestamp, replayState.firstTimestamp, replayState.lastTimestamp));
+				}
+				dirty = true;
+			}
+
+			saveReplaySnapshot();
+
+			const EventArgs* next = replayer.peek();
+			if (!next || (next->type == EventType::BasicBlockHit && replayPosition() < next->bb.timestamp_us))
 			{
-				return;
+				return false;
 			}
 
-			auto it = basicBlockLinesDef.begin();
-			while (true)
+			ev = *next;
+			modulePath.assign((ev.type == EventType::ModuleAdd) ? replayer.modulePath(ev.mod) : std::string_view{});
+			replayer.pop();
+			return true;
+		};
+
+	// イベントを 1 つ取り込む（modulePath は ModuleAdd のときのパス）
+	const auto ingestEvent = [&](EventArgs& ev, std::string_view modulePath)
+		{
+			dirty = true;
+
+			switch (ev.type)
 			{
-				auto nextIt = std::next(it);
-				if (nextIt == basicBlockLinesDef.end())
-				{
-					break;
-				}
+			case EventType::BasicBlockHit:
+			{
+				recorder.append(ev);
 
-				// ブロックの終端が次のブロックと被る場合は、ブロックの開始行の方を優先して、前の要素の範囲を切り詰める
-				it->second.endLine = Min(it->second.endLine, nextIt->second.startLine - 1);
+				BBEvent& data = ev.bb;
+				++stats.readCount;
 
-				it = nextIt;
+				/*Logger << U"BB pc=0x" << std::hex << ev.bb.app_pc
+					<< U" tid=" << std::dec << ev.bb.tid
+					<< U" ts(us)=" << ev.bb.timestamp_us;*/
+
+				if (exeModuleInfo &&
+					exeModuleInfo.value().inRange(data.app_pc) &&
+					exeModuleInfo.value().inRange(data.app_pc_end))
+				{
+					const auto it = resolvedBlocks.find(data.app_pc);
+					if (it != resolvedBlocks.end() && heldEvents.empty())
+					{
+						ingestHit(it->second, data.tid);
+					}
+					else
+					{
+						// 解決するまで（先に保留したイベントがあればそれが流れるまで）届いた順に保留する
+						if (it == resolvedBlocks.end())
+						{
+							requestBlock(data.app_pc, data.app_pc_end);
+						}
+						heldEvents.push_back(data);
+						++stats.pendingEvents;
+					}
+				}
+				else
+				{
+					++stats.outAddressRange;
+				}
 			}
-		};
-	;
-	Array<uint32> lineHits;
+			break;
+			case EventType::ModuleAdd:
+			{
+				ModEvent& data = ev.mod;
 
-	int32 topLine = 0;
-	Console << U"console";
+				recorder.append(ev, modulePath);
+				//Logger << U"module add data.pathIndex: " << data.pathIndex << U", data.path_len: " << data.path_len;
+				//Logger << U"module path: " << Unicode::FromUTF8(modulePath) << U", base: " << data.base;
 
-	Window::Resize(1280, 720);
+				if (modulePath.ends_with(".exe"))
+				{
+					exeModuleInfo = ModuleInfo
+					{
+						.baseAddr = data.base,
+						.imageSize = data.size,
+					};
 
-	std::mutex mutex;
+				}
+			}
+			break;
+			case EventType::ModuleDelete:
+				recorder.append(ev);
+				break;
+			case EventType::MemoryAccess:
+				recorder.append(ev);
+				++stats.memoryAccesses;
+				break;
+			case EventType::BlockDefine:
+				recorder.append(ev);
+				defineBlock(ev.block.app_pc, ev.block.instructionCount);
+				break;
 
-	uint64_t outAddressRange = 0;
-	uint64_t failVaToLine = 0;
-	uint64_t outMainCpp = 0;
-	uint64_t hit = 0;
+			default:
+				break;
+			};
+		};
 
-	bool terminateRequest = false;
+	std::atomic<bool> terminateRequest = false;
 	auto readMessage = [&]()
 		{
 			EventArgs ev;
+			std::string replayModulePath;
 			while (!terminateRequest)
 			{
 				if (running)
 				{
-					if (spscPop(&shm->eventHeader, shm->eventBuffer, ev))
+					if (viewportRequests.update())
 					{
-						switch (ev.type)
-						{
-						case EventType::BasicBlockHit:
-						{
-							BBEvent& data = ev.bb;
-							++readCount;
-
-							/*Logger << U"BB pc=0x" << std::hex << ev.bb.app_pc
-								<< U" tid=" << std::dec << ev.bb.tid
-								<< U" ts(us)=" << ev.bb.timestamp_us;*/
-
-							SrcPos srcPosBegin = {};
-							SrcPos srcPosEnd = {};
+						viewport = viewportRequests.front();
+						dirty = true;
+					}
 
-							if (exeModuleInfo &&
-								exeModuleInfo.value().inRange(data.app_pc) &&
-								exeModuleInfo.value().inRange(data.app_pc_end))
-							{
-								if (VaToLine(ses, data.app_pc, srcPosBegin) &&
-									VaToLine(ses, data.app_pc_end, srcPosEnd))
-								{
-									if (Unicode::FromWstring(srcPosBegin.file).ends_with(U"\\main.cpp"))
-									{
-										mutex.lock();
-
-										if (!loaded)
-										{
-											const auto filepath = Unicode::FromWstring(srcPosBegin.file);
-											if (FileSystem::Exists(filepath))
-											{
-												TextReader reader(filepath);
-												reader.readLines(lines);
-												loaded = true;
-											}
-										}
-
-										if (srcPosBegin.line < lineCount.size())
-										{
-											//lineCount[srcPosBegin.line-1]++;
-
-											const auto beginLine = srcPosBegin.line - 1;
-											const auto endLine = srcPosEnd.line - 1;
-											//const auto key = beginLine << 16 + endLine;
-
-											auto& range = basicBlockLinesDef[beginLine];
-											//if (range.startLine != beginLine || range.endLine != endLine)
-											if (range.startLine == 0 || range.endLine == 0)
-											{
-												range.startLine = beginLine;
-												range.endLine = endLine;
-												updateLinesDef();
-
-												//topLine = static_cast<int>(beginLine) - 20;
-											}
-
-											lineHits.push_back(beginLine);
-											/*auto& blockData = blockHit[key];
-
-											blockData.startLine = beginLine;
-											blockData.endLine = endLine;
-											++blockData.hitCount;*/
-										}
-
-										mutex.unlock();
-
-										++hit;
-										//Logger << U"SrcPos: " << Unicode::FromWstring(srcPosBegin.file) << U", [" << srcPosBegin.line << U", " << srcPosEnd.line << U"]";
-									}
-									else
-									{
-										++outMainCpp;
-										Logger << U"SrcPos: " << Unicode::FromWstring(srcPosBegin.file) << U", [" << srcPosBegin.line << U", " << srcPosEnd.line << U"]";
-									}
-								}
-								else
-								{
-									++failVaToLine;
-								}
-							}
-							else
-							{
-								++outAddressRange;
-							}
-						}
-						break;
-						case EventType::ModuleAdd:
+					bool received = false;
+					std::string_view modulePath;
+					if (replaying)
+					{
+						received = nextReplayEvent(ev, replayModulePath);
+						modulePath = replayModulePath;
+					}
+					else if (spscPop(&shm->eventHeader, shm->eventBuffer, ev))
+					{
+						received = true;
+						if (ev.type == EventType::ModuleAdd)
 						{
-							ModEvent& data = ev.mod;
+							modulePath = std::string_view(&shm->strBuffer[ev.mod.pathIndex], ev.mod.path_len);
+						}
+					}
 
-							//const std::string str(&shm->strBuffer[data.pathIndex], shm->strBuffer + data.pathIndex + data.path_len);
-							const std::string str(&shm->strBuffer[data.pathIndex], data.path_len);
-							//Logger << U"module add data.pathIndex: " << data.pathIndex << U", data.path_len: " << data.path_len;
-							//Logger << U"module path: " << Unicode::FromUTF8(str) << U", base: " << data.base;
+					if (received)
+					{
+						ingestEvent(ev, modulePath);
+						lastEventTime = std::chrono::steady_clock::now();
+					}
+					else
+					{
+						applyCompletedBlocks();
+						eventsSinceCompletionCheck = 0;
 
-							if (str.ends_with(std::string(".exe")))
-							{
-								exeModuleInfo = ModuleInfo
-								{
-									.baseAddr = data.base,
-									.imageSize = data.size,
-								};
+						// しばらく途切れたら閉じていない列も表示する
+						if (std::chrono::milliseconds(100) <= std::chrono::steady_clock::now() - lastEventTime && loopFolder.flush(emitColumn))
+						{
+							dirty = true;
+						}
 
-								ses->put_loadAddress(data.base);
-							}
+						if (dirty)
+						{
+							// リングが空になったら溜まった分を発行する
+							publishSnapshot();
 						}
-						break;
-						case EventType::ModuleDelete:
-							break;
+					}
 
-						default:
-							break;
-						};
+					if (1024 <= ++eventsSinceCompletionCheck)
+					{
+						applyCompletedBlocks();
+						eventsSinceCompletionCheck = 0;
 					}
 
 					/*
@@ -343,6 +1103,20 @@ void Main()
 						}
 					}
 					*/
+
+					// 上位 K ブロックはイベントの流れと関係なく一定間隔で取り込む
+					if (shm && !replaying && std::chrono::milliseconds(100) <= std::chrono::steady_clock::now() - lastHotBlocksTime)
+					{
+						updateHotBlocks();
+						lastHotBlocksTime = std::chrono::steady_clock::now();
+					}
+
+					// 大量に流れてくる間も一定間隔で発行して描画を止めない
+					// 再生中は位置を進めるために発行し続ける
+					if ((dirty || (replaying && replayControl.playing)) && std::chrono::milliseconds(8) <= std::chrono::steady_clock::now() - lastPublishTime)
+					{
+						publishSnapshot();
+					}
 				}
 
 				std::this_thread::sleep_for(std::chrono::milliseconds(0));
@@ -356,73 +1130,216 @@ void Main()
 
 	while (System::Update())
 	{
+		snapshots.update();
+		const ViewSnapshot& view = snapshots.front();
+
 		if (DragDrop::HasNewFilePaths())
 		{
 			const auto items = DragDrop::GetDroppedFilePaths();
 			const auto filepath = items[0].path;
-			if (FileSystem::Exists(filepath) && FileSystem::Extension(filepath) == U"exe")
+			if (FileSystem::Exists(filepath) && FileSystem::Extension(filepath) == U"cbtrace" && !running)
+			{
+				// 記録済みトレースのリプレイ
+				if (!replayer.open(Unicode::ToWstring(filepath)))
+				{
+					Logger << U"failed to open " << filepath;
+					continue;
+				}
+
+				// ModuleAdd はキーフレームより前にあるので、先に exe の範囲を調べておく
+				TraceQueryEngine query(replayer.reader());
+				if (const auto exe = query.exeModule())
+				{
+					exeModuleInfo = ModuleInfo
+					{
+						.baseAddr = exe->base,
+						.imageSize = exe->size,
+					};
+				}
+
+				replayState.active = true;
+				replayState.firstTimestamp = query.firstTimestamp();
+				replayState.lastTimestamp = query.lastTimestamp();
+
+				// 記録したときの exe のパスから PDB を探す
+				symbolizer.start(msdiaPath, Unicode::FromUTF8(replayer.reader().exePath()).toWstring());
+
+				replayRequest = ReplayControl{ .seekSerial = 1, .seekTimestamp = replayState.firstTimestamp, .playing = true, .speed = 1.0 };
+				replayControls.back() = replayRequest;
+				replayControls.publish();
+
+				Logger << U"replay: " << filepath << U" chunks=" << replayer.reader().chunkCount() << U" keyframes=" << replayer.reader().keyframeCount();
+				replaying = true;
+				running = true;
+			}
+			else if (FileSystem::Exists(filepath) && FileSystem::Extension(filepath) == U"exe" && !running)
 			{
 				auto targetAppPath = Unicode::ToWstring(filepath);
 
 				const auto uuidStr = CreateUUID();
 				wchar_t shmName[128];
 				swprintf_s(shmName, L"Local\\bbtrace_shm_%ls", uuidStr.c_str());
-				channel = (shmName[0] << 16) + shmName[1];
+
+				// セッションとプロセスごとのチャンネル、接続完了のイベントは起動前に作っておき、クライアントは dr_client_main で開くだけにする
+				if (!session.create(shmName))
+				{
+					Logger << U"failed to create the session: " << GetLastError();
+					continue;
+				}
+				shm = session.channel(0);
+
+				// PDB はワーカーがそれぞれのスレッドで読み込む（読み込み中に届いたイベントは届いた順に保留される）
+				symbolizer.start(msdiaPath, targetAppPath);
 
 				Console << U"start debug " << Unicode::FromWstring(targetAppPath);
-				processId = StartDebug(targetAppPath, shmName);
+				connectStopwatch.restart();
+				processId = StartDebug(targetAppPath, shmName, clientOptions);
 
 				if (processId)
 				{
-					// DynamoRIOの起動待機
-					for (int i = 0; i < 300; ++i)
-					{
-						hMap = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, shmName);
-						if (hMap) break;
-						Sleep(100);
-					}
-					if (!hMap)
+					if (recordSettings.enabled)
 					{
-						Logger << U"OpenFileMapping failed (name not found)";
-						continue;
+						FileSystem::CreateDirectories(U"Trace/");
+						recordBasePath = U"Trace/{}_{}"_fmt(FileSystem::BaseName(filepath), DateTime::Now().format(U"yyyyMMdd_HHmmss"));
+						const String recordPath = recordBasePath + U".cbtrace";
+						if (recorder.open(Unicode::ToWstring(recordPath), filepath.toUTF8(), recordSettings.options))
+						{
+							Logger << U"record: " << recordPath << U" (" << Unicode::Widen(trace_codec::Name(recorder.options().codec)) << U")";
+						}
+						else
+						{
+							Logger << U"failed to open " << recordPath;
+						}
 					}
 
-					if (!OpenDiaForExe(targetAppPath.c_str(), src, ses))
-					{
-						Logger << U"OpenDiaForExe failed: " << GetLastError();
-						continue;
-					}
+					// クライアントの接続を待たずに受信を始める
+					running = true;
+				}
+			}
+		}
+
+		if (session.isOpen() && WaitForSingleObject(session.readyEvent(), 0) == WAIT_OBJECT_0)
+		{
+			session.pollProcesses([&](uint32 slot, uint32 pid, ShmLayout* channel)
+			{
+				if (slot == 0)
+				{
+					Logger << U"connected in {} ms. pid={} cap_evt={} cap_cmd={}"_fmt(connectStopwatch.ms(), pid, channel->header.eventsCapacity, channel->header.commandsCapacity);
+					return;
+				}
 
-					shm = (ShmLayout*)MapViewOfFile(hMap, FILE_MAP_ALL_ACCESS, 0, 0, 0);
-					if (!shm)
+				auto child = std::make_unique<ChildProcess>();
+				child->slot = slot;
+				child->pid = pid;
+				child->shm = channel;
+
+				// 記録は（トレースに入っている pid とは別に）ファイル名にも pid を付けて分ける
+				const bool record = recordSettings.enabled && !recordBasePath.isEmpty();
+				const std::wstring recordPath = Unicode::ToWstring(U"{}_pid{}.cbtrace"_fmt(recordBasePath, pid));
+				child->reader.start(channel, [&recordSettings, process = child.get(), record, recordPath](const EventArgs& ev, std::string_view modulePath)
+				{
+					if (!record)
 					{
-						Logger << U"MapViewOfFile failed: " << GetLastError();
-						continue;
+						return;
 					}
 
-					if (shm->header.magic != 0x52544252 || shm->header.channel != channel)
+					if (!process->exeSeen)
 					{
-						Logger << U"shm header mismatch (magic/pid)";
-						continue;
+						if (ev.type != EventType::ModuleAdd || !modulePath.ends_with(".exe"))
+						{
+							if (process->pendingEvents.size() < TraceMaxPendingEvents)
+							{
+								process->pendingEvents.emplace_back(ev, std::string(modulePath));
+							}
+							else
+							{
+								++process->droppedPendingEvents;
+							}
+							return;
+						}
+
+						process->exeSeen = true;
+						if (process->recorder.open(recordPath, std::string(modulePath), recordSettings.options))
+						{
+							process->recording = true;
+							for (const auto& [pendingEvent, pendingPath] : process->pendingEvents)
+							{
+								process->recorder.append(pendingEvent, pendingPath);
+							}
+						}
+						process->pendingEvents.clear();
+						process->pendingEvents.shrink_to_fit();
 					}
 
-					Logger << U"connected. cap_evt=" << shm->header.eventsCapacity << U" cap_cmd=" << shm->header.commandsCapacity;
+					process->recorder.append(ev, modulePath);
+				});
 
-					Logger << U"commands: add <base hex> <begin_rva hex> <end_rva hex> | clear | quit";
-					running = true;
-				}
+				Logger << U"child process: pid={} channel={}"_fmt(pid, slot);
+				childProcesses.push_back(std::move(child));
+			});
+
+			if (const uint32 overflow = session.overflowCount(); 0 < overflow)
+			{
+				Logger << U"{} processes exceeded the session limit ({}) and are not traced"_fmt(overflow, TraceSession::MaxProcesses);
 			}
 		}
 
-		if (KeyD.down())
+		if (KeyD.down() && shm)
 		{
 			Logger << U"eventHeader dropped : " << shm->eventHeader.droppedCount;
 			Logger << U"commandHeader dropped: " << shm->commandHeader.droppedCount;
-			Logger << U"readCount: " << readCount;
+			Logger << U"readCount: " << view.stats.readCount;
+		}
+
+		if (KeyTab.down())
+		{
+			showFileBrowser = !showFileBrowser;
+		}
+
+		if (KeyH.down())
+		{
+			showHotBlocks = !showHotBlocks;
+		}
+
+		if (KeyI.down())
+		{
+			showInstructions = !showInstructions;
+		}
+
+		const Rect fileBrowserRect{ Scene::Width() - 420, 0, 420, Scene::Height() };
+		const bool onFileBrowser = showFileBrowser && fileBrowserRect.mouseOver();
+
+		const int32 wheel = static_cast<int32>(Mouse::Wheel());
+		if (onFileBrowser)
+		{
+			fileBrowserTop = Max(0, fileBrowserTop + wheel);
+		}
+		else if (KeyControl.pressed())
+		{
+			// 時間方向のズーム：表示中の先頭の列を保ったままレベルを変える
+			const uint64 firstColumn = view.viewport.firstBucket << view.viewport.level;
+			timelineLevel = static_cast<uint32>(Clamp(static_cast<int32>(timelineLevel) + wheel, 0, static_cast<int32>(TimelineLevelCount) - 1));
+			timelineFirstBucket = firstColumn >> timelineLevel;
+		}
+		else if (KeyShift.pressed())
+		{
+			// 時間方向のスクロール
+			if (wheel != 0)
+			{
+				timelineFollow = false;
+				timelineFirstBucket = static_cast<uint64>(Max<int64>(0, static_cast<int64>(view.viewport.firstBucket) + wheel * 10));
+			}
+		}
+		else
+		{
+			topLine += wheel;
+			topLine = Max(0, topLine);
 		}
 
-		topLine += Mouse::Wheel();
-		topLine = Max(0, topLine);
+		if (KeyF.down())
+		{
+			timelineFollow = true;
+		}
 
 		const auto bottomLine = topLine + 50;
 
@@ -446,14 +1363,29 @@ void Main()
 		int cellStartX = leftMargin + 0;
 		int cellCountX = (Scene::Width() - cellStartX) / cellWidth;
 
-		mutex.lock();
-		for (const auto& [key, val] : basicBlockLinesDef)
 		{
-			if (bottomLine <= val.startLine || val.endLine < topLine)
+			TimelineViewport request;
+			request.fileId = selectedFileId;
+			request.level = timelineLevel;
+			request.firstBucket = timelineFirstBucket;
+			request.bucketCount = static_cast<uint32>(cellCountX);
+			request.topLine = static_cast<uint32>(topLine);
+			request.bottomLine = static_cast<uint32>(bottomLine);
+			request.follow = timelineFollow;
+
+			if (!(request == requestedViewport))
 			{
-				continue;
+				requestedViewport = request;
+				viewportRequests.back() = request;
+				viewportRequests.publish();
 			}
+		}
 
+		static const BlockLineIndex EmptyLinesDef;
+		const auto& linesDef = view.linesDef ? *view.linesDef : EmptyLinesDef;
+
+		linesDef.forEachOverlapping(static_cast<uint32>(topLine), static_cast<uint32>(bottomLine), [&](const LineRange& val)
+		{
 			const auto yBegin = (val.startLine - topLine) * lineMargin;
 			const auto yEnd = ((val.endLine + 1) - topLine) * lineMargin;
 
@@ -462,7 +1394,7 @@ void Main()
 				const auto x = cellStartX + cellWidth * xi;
 				Rect(x, yBegin, cellWidth, yEnd - yBegin).stretched(-1).drawFrame(0.5, Color(200));
 			}
-		}
+		});
 
 		int rulerWidth = cellWidth * 10;
 		int rulerCountX = 1 + (Scene::Width() - cellStartX) / rulerWidth;
@@ -472,42 +1404,94 @@ void Main()
 			Line(x, 0, x, Scene::Height()).draw(1.0, Color(160));
 		}
 
-		uint32 currentXIndex = 0;
-		uint32 lastHitLine = 0;
-		for (const auto hitLine : lineHits)
+		// セルの濃さはヒット数の対数で表す
+		const double logMaxCount = Math::Log(1.0 + view.maxCellCount);
+		for (const auto& cell : view.cells)
 		{
-			if (hitLine < lastHitLine)
+			const LineRange* range = linesDef.find(cell.line);
+			if (!range)
 			{
-				++currentXIndex;
+				continue;
 			}
 
-			lastHitLine = hitLine;
-
-			const auto& val = basicBlockLinesDef[hitLine];
-			if (bottomLine <= val.startLine || val.endLine < topLine)
+			const auto& val = *range;
+			if (static_cast<uint32>(bottomLine) <= val.startLine || val.endLine < static_cast<uint32>(topLine))
 			{
 				continue;
 			}
 
-			const auto yBegin = (val.startLine - topLine) * lineMargin;
-			const auto yEnd = ((val.endLine + 1) - topLine) * lineMargin;
+			const auto yBegin = (static_cast<int32>(val.startLine) - topLine) * lineMargin;
+			const auto yEnd = (static_cast<int32>(val.endLine + 1) - topLine) * lineMargin;
 
-			const int xi = currentXIndex;
+			const double t = (0.0 < logMaxCount) ? Math::Log(1.0 + cell.count) / logMaxCount : 0.0;
+			const int xi = static_cast<int>(cell.xIndex);
 			{
 				const auto x = cellStartX + cellWidth * xi;
-				Rect(x, yBegin, cellWidth, yEnd - yBegin).stretched(-1).draw(HSV(104, 0.27, 1.0));
+				Rect(x, yBegin, cellWidth, yEnd - yBegin).stretched(-1).draw(HSV(104, 0.15 + 0.6 * t, 1.0));
 			}
 		}
 
+		// 畳まれた列（ループの反復）は上端に印を付け、マウスを重ねると反復の数を出す
+		for (int xi = 0; xi < Min(cellCountX, static_cast<int>(view.bucketRepeats.size())); ++xi)
+		{
+			const uint32 repeats = view.bucketRepeats[xi];
+			if (repeats == 0)
+			{
+				continue;
+			}
+
+			const auto x = cellStartX + cellWidth * xi;
+			Rect(x, 20, cellWidth, 6).stretched(-1, 0).draw(HSV(30, 0.8, 1.0));
+
+			if (Rect(x, 0, cellWidth, Scene::Height()).mouseOver())
+			{
+				const String label = (view.viewport.level == 0) ? U"×{}"_fmt(repeats + 1) : U"+{} folded"_fmt(repeats);
+				font2(label).draw(x + cellWidth + 2, 20, Palette::Black);
+			}
+		}
+
+		// 表示するファイルが変わったときだけ開き直す
+		if (sourceTextFileId != view.viewport.fileId)
+		{
+			sourceText.close();
+			decodedSourceLines.clear();
+			sourceTextFileId = view.viewport.fileId;
+			if (view.filePaths && sourceTextFileId < view.filePaths->size())
+			{
+				const auto& filepath = (*view.filePaths)[sourceTextFileId];
+				if (sourceText.open(Unicode::ToWstring(filepath)) && !sourceText.isUtf8())
+				{
+					sourceText.close();
+					TextReader reader(filepath);
+					reader.readLines(decodedSourceLines);
+				}
+			}
+		}
+
+		// 行番号の後ろに、ブロックの累計ヒット数（I キーで実行命令数）を対数の長さの棒で表す
+		const double logMaxLineTotal = Math::Log(1.0 + (showInstructions ? view.maxLineInstructions : view.maxLineTotal));
+		for (const auto& total : view.lineTotals)
+		{
+			if (total.line < static_cast<uint32>(topLine) || 0.0 == logMaxLineTotal)
+			{
+				continue;
+			}
+
+			const auto y = (static_cast<int32>(total.line) - topLine) * lineMargin;
+			const uint64 value = showInstructions ? total.instructions : total.count;
+			RectF(0, y, (leftMargin - 4) * Math::Log(1.0 + value) / logMaxLineTotal, lineMargin).draw(showInstructions ? HSV(200, 0.4, 1.0) : HSV(20, 0.4, 1.0));
+		}
+
+		const size_t sourceLineCount = sourceText.isOpen() ? sourceText.lineCount() : decodedSourceLines.size();
 		for (int32 i = 0; i < 50; ++i)
 		{
 			const auto lineIndex = topLine + i;
-			if (static_cast<int32>(lines.size()) <= lineIndex)
+			if (static_cast<int32>(sourceLineCount) <= lineIndex)
 			{
 				break;
 			}
 
-			const auto& currentLineStr = lines[lineIndex];
+			const String currentLineStr = sourceText.isOpen() ? Unicode::FromUTF8(sourceText.line(lineIndex)) : decodedSourceLines[lineIndex];
 			const auto y = lineMargin * i;
 			/*
 			const float b = Saturate(lineCount[lineIndex] / 1000.0f);
@@ -517,40 +1501,202 @@ void Main()
 			font(U"{:0>4}"_fmt(lineIndex)).draw(5, y, Palette::Gray);
 		}
 
-		mutex.unlock();
 		for (int xi = 0; xi < rulerCountX; ++xi)
 		{
 			const auto x = cellStartX + rulerWidth * xi;
 
 			Rect(20, 20).setCenter(x, 10).draw(Color(230));
-			font(xi * 10).drawAt(x, 10, Palette::Black);
+			font((view.viewport.firstBucket + xi * 10) << view.viewport.level).drawAt(x, 10, Palette::Black);
+		}
+
+		if (showFileBrowser)
+		{
+			// ヒット数の多い順のファイル一覧
+			fileBrowserRect.draw(ColorF(0.97, 0.95));
+			fileBrowserRect.drawFrame(1, Color(160));
+
+			Array<uint32> fileOrder(Arg::reserve = view.fileHits.size());
+			for (uint32 fileId = 0; fileId < view.fileHits.size(); ++fileId)
+			{
+				fileOrder << fileId;
+			}
+			fileOrder.stable_sort_by([&](uint32 a, uint32 b) { return view.fileHits[a] > view.fileHits[b]; });
+
+			const int32 rowHeight = 20;
+			const int32 rowCount = fileBrowserRect.h / rowHeight - 1;
+			fileBrowserTop = Min(fileBrowserTop, Max(0, static_cast<int32>(fileOrder.size()) - rowCount));
+
+			font2(U"files: {} (Tab: close, A: auto)"_fmt(fileOrder.size())).draw(fileBrowserRect.x + 5, 0, Palette::Black);
+			for (int32 row = 0; row < rowCount; ++row)
+			{
+				const int32 index = fileBrowserTop + row;
+				if (static_cast<int32>(fileOrder.size()) <= index)
+				{
+					break;
+				}
+
+				const uint32 fileId = fileOrder[index];
+				const Rect rowRect{ fileBrowserRect.x, rowHeight * (row + 1), fileBrowserRect.w, rowHeight };
+				if (fileId == view.viewport.fileId)
+				{
+					rowRect.draw(HSV(104, 0.27, 1.0));
+				}
+				else if (rowRect.mouseOver())
+				{
+					rowRect.draw(Color(230));
+				}
+
+				if (rowRect.leftClicked())
+				{
+					selectedFileId = fileId;
+					topLine = 0;
+				}
+
+				const String& path = (*view.filePaths)[fileId];
+				font2(U"{:>10} {}"_fmt(view.fileHits[fileId], FileSystem::FileName(path))).draw(rowRect.x + 5, rowRect.y, Palette::Black);
+			}
+		}
+
+		if (showHotBlocks)
+		{
+			// 上位 K ブロック（クリックでその行へ移動）
+			const Rect hotRect{ Scene::Width() - 420 * (showFileBrowser ? 2 : 1), 0, 420, Scene::Height() };
+			hotRect.draw(ColorF(0.97, 0.95));
+			hotRect.drawFrame(1, Color(160));
+
+			const int32 rowHeight = 20;
+			const int32 rowCount = Min(static_cast<int32>(view.hotBlocks.size()), hotRect.h / rowHeight - 1);
+			font2(U"hot blocks: {} / {} hits (H: close)"_fmt(view.hotBlocks.size(), view.hotBlockTotal)).draw(hotRect.x + 5, 0, Palette::Black);
+			for (int32 row = 0; row < rowCount; ++row)
+			{
+				const HotBlockView& hot = view.hotBlocks[row];
+				const Rect rowRect{ hotRect.x, rowHeight * (row + 1), hotRect.w, rowHeight };
+				const double share = (0 < view.hotBlockTotal) ? (static_cast<double>(hot.count) / view.hotBlockTotal) : 0.0;
+				Rect(rowRect.x, rowRect.y + 2, static_cast<int32>(rowRect.w * share), rowHeight - 4).draw(HSV(30, 0.3, 1.0));
+
+				const bool resolved = (hot.fileId != AutoFileId) && view.filePaths && (hot.fileId < view.filePaths->size());
+				if (resolved && rowRect.mouseOver())
+				{
+					rowRect.drawFrame(1, Color(120));
+				}
+
+				if (resolved && rowRect.leftClicked())
+				{
+					selectedFileId = hot.fileId;
+					topLine = Max(0, static_cast<int32>(hot.line) - 10);
+				}
+
+				const String location = resolved ? U"{}:{}"_fmt(FileSystem::FileName((*view.filePaths)[hot.fileId]), hot.line) : U"0x{:X}"_fmt(hot.address);
+				font2(U"{:>10} {:>5.1f}% {}"_fmt(hot.count, share * 100.0, location)).draw(rowRect.x + 5, rowRect.y, Palette::Black);
+			}
+		}
+
+		if (KeyA.down())
+		{
+			selectedFileId = AutoFileId;
+		}
+
+		if (view.replay.active)
+		{
+			// スライダーで移動、P / ボタンで再生と一時停止、- / + で速度を半分 / 倍にする
+			const Rect barRect{ 0, Scene::Height() - 40, Scene::Width(), 40 };
+			barRect.draw(ColorF(0.97, 0.95));
+
+			const uint64 first = view.replay.firstTimestamp;
+			const uint64 duration = Max<uint64>(1, view.replay.lastTimestamp - first);
+			const uint64 elapsed = Min(duration, view.replay.position - Min(view.replay.position, first));
+			if (!MouseL.pressed())
+			{
+				replaySliderValue = static_cast<double>(elapsed) / duration;
+			}
+
+			bool changed = false;
+			const double controlsX = Scene::Width() - 380;
+			if (SimpleGUI::Slider(replaySliderValue, Vec2{ 10, barRect.y + 2 }, controlsX - 20))
+			{
+				replayRequest.seekTimestamp = first + static_cast<uint64>(replaySliderValue * duration);
+				++replayRequest.seekSerial;
+				changed = true;
+			}
+
+			if (SimpleGUI::Button(replayRequest.playing ? U"Pause" : U"Play", Vec2{ controlsX, barRect.y + 2 }, 80) || KeyP.down())
+			{
+				replayRequest.playing = !replayRequest.playing;
+				changed = true;
+			}
+
+			if (SimpleGUI::Button(U"-", Vec2{ controlsX + 85, barRect.y + 2 }, 40))
+			{
+				replayRequest.speed = Max(1.0 / 64, replayRequest.speed / 2);
+				changed = true;
+			}
+
+			if (SimpleGUI::Button(U"+", Vec2{ controlsX + 130, barRect.y + 2 }, 40))
+			{
+				replayRequest.speed = Min(1024.0, replayRequest.speed * 2);
+				changed = true;
+			}
+
+			font2(U"x{} {:.3f} / {:.3f} s"_fmt(replayRequest.speed, elapsed / 1e6, duration / 1e6)).draw(controlsX + 180, barRect.y + 10, Palette::Black);
+			if (0 < view.replay.readErrors)
+			{
+				font2(U"{} chunks or keyframes could not be read (skipped)"_fmt(view.replay.readErrors)).draw(10, barRect.y - 20, Palette::Red);
+			}
+
+			if (changed)
+			{
+				replayControls.back() = replayRequest;
+				replayControls.publish();
+			}
 		}
 
 		if (KeySpace.pressed())
 		{
 			int y = 0;
-			font2(U"readCount       : {}"_fmt(readCount)).draw(0, 20 * y++, Palette::Black);
-			font2(U"outAddressRange : {}"_fmt(outAddressRange)).draw(0, 20 * y++, Palette::Black);
-			font2(U"failVaToLine    : {}"_fmt(failVaToLine)).draw(0, 20 * y++, Palette::Black);
-			font2(U"outMainCpp      : {}"_fmt(outMainCpp)).draw(0, 20 * y++, Palette::Black);
-			font2(U"hit             : {}"_fmt(hit)).draw(0, 20 * y++, Palette::Black);
+			font2(U"readCount       : {}"_fmt(view.stats.readCount)).draw(0, 20 * y++, Palette::Black);
+			font2(U"outAddressRange : {}"_fmt(view.stats.outAddressRange)).draw(0, 20 * y++, Palette::Black);
+			font2(U"failVaToLine    : {}"_fmt(view.stats.failVaToLine)).draw(0, 20 * y++, Palette::Black);
+			font2(U"files           : {}"_fmt(view.fileHits.size())).draw(0, 20 * y++, Palette::Black);
+			font2(U"pendingBlocks   : {}"_fmt(view.stats.pendingBlocks)).draw(0, 20 * y++, Palette::Black);
+			font2(U"pendingEvents   : {}"_fmt(view.stats.pendingEvents)).draw(0, 20 * y++, Palette::Black);
+			font2(U"hit             : {}"_fmt(view.stats.hit)).draw(0, 20 * y++, Palette::Black);
+			font2(U"columns         : {} (+{} folded)"_fmt(view.columnCount, view.stats.foldedColumns)).draw(0, 20 * y++, Palette::Black);
+			if (0 < view.stats.memoryAccesses)
+			{
+				font2(U"memoryAccesses  : {}"_fmt(view.stats.memoryAccesses)).draw(0, 20 * y++, Palette::Black);
+			}
 
 			if (shm)
 			{
 				font2(U"droppedCount    : {}"_fmt(shm->eventHeader.droppedCount)).draw(0, 20 * y++, Palette::Black);
 			}
+
+			for (const auto& child : childProcesses)
+			{
+				font2(U"child pid={:<6}: {} events, {} dropped, {} not recorded before the exe module{}"_fmt(child->pid, child->reader.eventCount(), child->shm->eventHeader.droppedCount,
+					child->droppedPendingEvents.load(), child->recording ? U"" : U" (not recorded)")).draw(0, 20 * y++, Palette::Black);
+			}
+
+			if (0 < recorder.storedBytes())
+			{
+				font2(U"recorded        : {} -> {} bytes (x{:.1f})"_fmt(recorder.rawBytes(), recorder.storedBytes(), static_cast<double>(recorder.rawBytes()) / recorder.storedBytes())).draw(0, 20 * y++, Palette::Black);
+			}
 		}
 	}
 
 	terminateRequest = true;
 	readMessageThread.join();
 
-	if (shm)
-	{
-		UnmapViewOfFile(shm);
-	}
-	if (hMap)
+	// 残りのチャンクとインデックスを書き出す
+	recorder.close();
+
+	for (auto& child : childProcesses)
 	{
-		CloseHandle(hMap);
+		child->reader.stop();
+		child->recorder.close();
 	}
+	childProcesses.clear();
+
+	shm = nullptr;
+	session.close();
 }
@@ -0,0 +1,521 @@
+﻿#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+#include "trace_file.hpp"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#  define EVENT_COLUMNS_X86 1
+#  include <immintrin.h>
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#    define EVENT_COLUMNS_AVX2
+#  else
+#    define EVENT_COLUMNS_AVX2 __attribute__((target("avx2")))
+#  endif
+#endif
+
+/////////////////////////////////////
+// 列指向のイベントストア（オフライン解析用）
+//
+// BB イベントをブロック ID / スレッド ID / タイムスタンプの列に分けて固定長のバッチに詰める
+// ブロックは出てきた順に 0 から ID を振り、タイムスタンプはバッチの基準時刻からの 32 ビットの差で持つ
+// 絞り込みとデコードは SIMD（SSE2 / 実行時に使えれば AVX2）で 1 度に 4 / 8 イベントずつ処理する
+
+namespace event_columns
+{
+	// 選択ビットマップは 64 イベントで 1 ワード（バッチの末尾を超えたビットは 0）
+	constexpr size_t MaskWordCount(size_t count)
+	{
+		return (count + 63) / 64;
+	}
+
+	inline bool HasAvx2()
+	{
+#ifdef EVENT_COLUMNS_X86
+		static const bool supported = []()
+			{
+#  ifdef _MSC_VER
+				int info[4];
+				__cpuid(info, 1);
+				// OS が YMM レジスタを保存するか（OSXSAVE, AVX と XCR0 の SSE / AVX ビット）
+				if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+				{
+					return false;
+				}
+				__cpuidex(info, 7, 0);
+				return (info[1] & (1 << 5)) != 0;
+#  else
+				return __builtin_cpu_supports("avx2") != 0;
+#  endif
+			}();
+		return supported;
+#else
+		return false;
+#endif
+	}
+
+	namespace detail
+	{
+		inline void SelectRangeScalar(const uint32_t* values, size_t begin, size_t count, uint32_t low, uint32_t width, uint64_t* mask)
+		{
+			for (size_t i = begin; i < count; ++i)
+			{
+				if (values[i] - low < width)
+				{
+					mask[i / 64] |= 1ull << (i % 64);
+				}
+			}
+		}
+
+		inline void AndEqualScalar(const uint32_t* values, size_t begin, size_t count, uint32_t value, uint64_t* mask)
+		{
+			for (size_t i = begin; i < count; ++i)
+			{
+				if (values[i] != value)
+				{
+					mask[i / 64] &= ~(1ull << (i % 64));
+				}
+			}
+		}
+
+		inline void DecodeScalar(const uint32_t* deltas, size_t begin, size_t count, uint64_t base, uint64_t* out)
+		{
+			for (size_t i = begin; i < count; ++i)
+			{
+				out[i] = base + deltas[i];
+			}
+		}
+
+#ifdef EVENT_COLUMNS_X86
+		// 符号なしの比較は、符号ビットを反転して符号付きの比較にする
+		inline size_t SelectRangeSse2(const uint32_t* values, size_t count, uint32_t low, uint32_t width, uint64_t* mask)
+		{
+			const __m128i bias = _mm_set1_epi32(static_cast<int>(0x80000000u));
+			const __m128i lowVec = _mm_set1_epi32(static_cast<int>(low));
+			const __m128i widthVec = _mm_xor_si128(_mm_set1_epi32(static_cast<int>(width)), bias);
+
+			const size_t full = count / 64 * 64;
+			for (size_t i = 0; i < full; i += 64)
+			{
+				uint64_t word = 0;
+				for (size_t j = 0; j < 64; j += 4)
+				{
+					const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i + j));
+					const __m128i offset = _mm_xor_si128(_mm_sub_epi32(v, lowVec), bias);
+					const int bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(widthVec, offset)));
+					word |= static_cast<uint64_t>(bits) << j;
+				}
+				mask[i / 64] = word;
+			}
+			return full;
+		}
+
+		inline size_t AndEqualSse2(const uint32_t* values, size_t count, uint32_t value, uint64_t* mask)
+		{
+			const __m128i valueVec = _mm_set1_epi32(static_cast<int>(value));
+
+			const size_t full = count / 64 * 64;
+			for (size_t i = 0; i < full; i += 64)
+			{
+				uint64_t word = 0;
+				for (size_t j = 0; j < 64; j += 4)
+				{
+					const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i + j));
+					const int bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, valueVec)));
+					word |= static_cast<uint64_t>(bits) << j;
+				}
+				mask[i / 64] &= word;
+			}
+			return full;
+		}
+
+		inline size_t DecodeSse2(const uint32_t* deltas, size_t count, uint64_t base, uint64_t* out)
+		{
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i baseVec = _mm_set1_epi64x(static_cast<long long>(base));
+
+			const size_t full = count / 4 * 4;
+			for (size_t i = 0; i < full; i += 4)
+			{
+				const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(deltas + i));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_add_epi64(_mm_unpacklo_epi32(v, zero), baseVec));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 2), _mm_add_epi64(_mm_unpackhi_epi32(v, zero), baseVec));
+			}
+			return full;
+		}
+
+		EVENT_COLUMNS_AVX2 inline size_t SelectRangeAvx2(const uint32_t* values, size_t count, uint32_t low, uint32_t width, uint64_t* mask)
+		{
+			const __m256i bias = _mm256_set1_epi32(static_cast<int>(0x80000000u));
+			const __m256i lowVec = _mm256_set1_epi32(static_cast<int>(low));
+			const __m256i widthVec = _mm256_xor_si256(_mm256_set1_epi32(static_cast<int>(width)), bias);
+
+			const size_t full = count / 64 * 64;
+			for (size_t i = 0; i < full; i += 64)
+			{
+				uint64_t word = 0;
+				for (size_t j = 0; j < 64; j += 8)
+				{
+					const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i + j));
+					const __m256i offset = _mm256_xor_si256(_mm256_sub_epi32(v, lowVec), bias);
+					const int bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(widthVec, offset)));
+					word |= static_cast<uint64_t>(static_cast<uint32_t>(bits)) << j;
+				}
+				mask[i / 64] = word;
+			}
+			return full;
+		}
+
+		EVENT_COLUMNS_AVX2 inline size_t AndEqualAvx2(const uint32_t* values, size_t count, uint32_t value, uint64_t* mask)
+		{
+			const __m256i valueVec = _mm256_set1_epi32(static_cast<int>(value));
+
+			const size_t full = count / 64 * 64;
+			for (size_t i = 0; i < full; i += 64)
+			{
+				uint64_t word = 0;
+				for (size_t j = 0; j < 64; j += 8)
+				{
+					const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i + j));
+					const int bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, valueVec)));
+					word |= static_cast<uint64_t>(static_cast<uint32_t>(bits)) << j;
+				}
+				mask[i / 64] &= word;
+			}
+			return full;
+		}
+
+		EVENT_COLUMNS_AVX2 inline size_t DecodeAvx2(const uint32_t* deltas, size_t count, uint64_t base, uint64_t* out)
+		{
+			const __m256i baseVec = _mm256_set1_epi64x(static_cast<long long>(base));
+
+			const size_t full = count / 8 * 8;
+			for (size_t i = 0; i < full; i += 8)
+			{
+				const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(deltas + i));
+				const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(deltas + i + 4));
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_add_epi64(_mm256_cvtepu32_epi64(lo), baseVec));
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + 4), _mm256_add_epi64(_mm256_cvtepu32_epi64(hi), baseVec));
+			}
+			return full;
+		}
+#endif
+	}
+
+	// mask に low <= values[i] < low + width のイベントのビットを立てる（mask は MaskWordCount(count) ワード、上書きする）
+	inline void SelectRange(const uint32_t* values, size_t count, uint32_t low, uint32_t width, uint64_t* mask)
+	{
+		std::fill_n(mask, MaskWordCount(count), 0);
+
+		size_t done = 0;
+#ifdef EVENT_COLUMNS_X86
+		done = HasAvx2() ? detail::SelectRangeAvx2(values, count, low, width, mask) : detail::SelectRangeSse2(values, count, low, width, mask);
+#endif
+		detail::SelectRangeScalar(values, done, count, low, width, mask);
+	}
+
+	// values[i] != value のイベントのビットを mask から落とす
+	inline void AndEqual(const uint32_t* values, size_t count, uint32_t value, uint64_t* mask)
+	{
+		size_t done = 0;
+#ifdef EVENT_COLUMNS_X86
+		done = HasAvx2() ? detail::AndEqualAvx2(values, count, value, mask) : detail::AndEqualSse2(values, count, value, mask);
+#endif
+		detail::AndEqualScalar(values, done, count, value, mask);
+	}
+
+	// out[i] = base + deltas[i]
+	inline void DecodeTimestamps(const uint32_t* deltas, size_t count, uint64_t base, uint64_t* out)
+	{
+		size_t done = 0;
+#ifdef EVENT_COLUMNS_X86
+		done = HasAvx2() ? detail::DecodeAvx2(deltas, count, base, out) : detail::DecodeSse2(deltas, count, base, out);
+#endif
+		detail::DecodeScalar(deltas, done, count, base, out);
+	}
+
+	// ブロック ID ごとのヒット数を counts に足す
+	// 散らばった加算は SIMD にならないので、独立した 4 本の加算を並べて依存の連鎖だけを切る
+	inline void AccumulateHits(const uint32_t* blockIds, size_t count, uint64_t* counts)
+	{
+		const size_t full = count / 4 * 4;
+		for (size_t i = 0; i < full; i += 4)
+		{
+			const uint32_t a = blockIds[i], b = blockIds[i + 1], c = blockIds[i + 2], d = blockIds[i + 3];
+			++counts[a];
+			++counts[b];
+			++counts[c];
+			++counts[d];
+		}
+		for (size_t i = full; i < count; ++i)
+		{
+			++counts[blockIds[i]];
+		}
+	}
+
+	// mask でビットの立っているイベントだけを数える（すべて立っているワードは 64 個まとめて数える）
+	inline uint64_t AccumulateSelectedHits(const uint32_t* blockIds, size_t count, const uint64_t* mask, uint64_t* counts)
+	{
+		uint64_t selected = 0;
+		for (size_t w = 0; w < MaskWordCount(count); ++w)
+		{
+			uint64_t word = mask[w];
+			if (word == UINT64_MAX)
+			{
+				AccumulateHits(blockIds + w * 64, 64, counts);
+				selected += 64;
+				continue;
+			}
+
+			selected += std::popcount(word);
+			while (word)
+			{
+				++counts[blockIds[w * 64 + std::countr_zero(word)]];
+				word &= word - 1;
+			}
+		}
+		return selected;
+	}
+}
+
+struct EventBatch
+{
+	static constexpr size_t Capacity = 4096;
+
+	// timestamp = baseTimestamp + timestampDeltas[i]
+	uint64_t baseTimestamp = 0;
+
+	// バッチ内の差の範囲（時間で絞り込むときにバッチごと飛ばす / まとめて通すのに使う）
+	uint32_t minDelta = UINT32_MAX;
+	uint32_t maxDelta = 0;
+
+	uint32_t count = 0;
+
+	alignas(32) uint32_t blockIds[Capacity];
+	alignas(32) uint32_t threadIds[Capacity];
+	alignas(32) uint32_t timestampDeltas[Capacity];
+
+	uint64_t firstTimestamp() const
+	{
+		return baseTimestamp + minDelta;
+	}
+
+	uint64_t lastTimestamp() const
+	{
+		return baseTimestamp + maxDelta;
+	}
+
+	void decodeTimestamps(uint64_t* out) const
+	{
+		event_columns::DecodeTimestamps(timestampDeltas, count, baseTimestamp, out);
+	}
+};
+
+class EventColumnStore
+{
+public:
+
+	// バッチの基準時刻は最初のイベントより少し前に置き、スレッド間で前後したタイムスタンプも同じバッチに入れる
+	static constexpr uint64_t TimestampSlack = 1ull << 20;
+
+	void append(const BBEvent& bb)
+	{
+		if (m_batches.empty() || m_batches.back().count == EventBatch::Capacity || !fits(m_batches.back(), bb.timestamp_us))
+		{
+			EventBatch& batch = m_batches.emplace_back();
+			batch.baseTimestamp = (TimestampSlack < bb.timestamp_us) ? (bb.timestamp_us - TimestampSlack) : 0;
+		}
+
+		EventBatch& batch = m_batches.back();
+		const uint32_t delta = static_cast<uint32_t>(bb.timestamp_us - batch.baseTimestamp);
+		batch.blockIds[batch.count] = blockId(bb.app_pc, bb.app_pc_end);
+		batch.threadIds[batch.count] = bb.tid;
+		batch.timestampDeltas[batch.count] = delta;
+		batch.minDelta = std::min(batch.minDelta, delta);
+		batch.maxDelta = std::max(batch.maxDelta, delta);
+		++batch.count;
+		++m_eventCount;
+	}
+
+	// チャンク内の BB イベントだけを取り込む
+	void append(const DecodedChunk& chunk)
+	{
+		for (const auto& ev : chunk.events)
+		{
+			if (ev.type == EventType::BasicBlockHit)
+			{
+				append(ev.bb);
+			}
+		}
+	}
+
+	const std::vector<EventBatch>& batches() const
+	{
+		return m_batches;
+	}
+
+	uint64_t eventCount() const
+	{
+		return m_eventCount;
+	}
+
+	size_t blockCount() const
+	{
+		return m_blockAddresses.size();
+	}
+
+	uint64_t blockAddress(uint32_t id) const
+	{
+		return m_blockAddresses[id];
+	}
+
+	uint64_t blockEndAddress(uint32_t id) const
+	{
+		return m_blockEndAddresses[id];
+	}
+
+	// BB イベントの最初と最後のタイムスタンプ（BB イベントが無ければ 0）
+	uint64_t firstTimestamp() const
+	{
+		uint64_t result = UINT64_MAX;
+		for (const auto& batch : m_batches)
+		{
+			result = std::min(result, batch.firstTimestamp());
+		}
+		return m_batches.empty() ? 0 : result;
+	}
+
+	uint64_t lastTimestamp() const
+	{
+		uint64_t result = 0;
+		for (const auto& batch : m_batches)
+		{
+			result = std::max(result, batch.lastTimestamp());
+		}
+		return result;
+	}
+
+private:
+
+	// 差は UINT32_MAX 未満に収める（maxDelta + 1 を時間の幅に使うため）
+	static bool fits(const EventBatch& batch, uint64_t timestamp)
+	{
+		return batch.baseTimestamp <= timestamp && timestamp - batch.baseTimestamp < UINT32_MAX;
+	}
+
+	uint32_t blockId(uint64_t address, uint64_t endAddress)
+	{
+		// ループでは同じブロックが続くので、直前のブロックなら表を引かない
+		if (m_lastAddress == address && !m_blockAddresses.empty())
+		{
+			m_blockEndAddresses[m_lastId] = std::max(m_blockEndAddresses[m_lastId], endAddress);
+			return m_lastId;
+		}
+
+		const auto [it, inserted] = m_blockIds.try_emplace(address, static_cast<uint32_t>(m_blockAddresses.size()));
+		if (inserted)
+		{
+			m_blockAddresses.push_back(address);
+			m_blockEndAddresses.push_back(endAddress);
+		}
+		else
+		{
+			m_blockEndAddresses[it->second] = std::max(m_blockEndAddresses[it->second], endAddress);
+		}
+
+		m_lastAddress = address;
+		m_lastId = it->second;
+		return it->second;
+	}
+
+	std::vector<EventBatch> m_batches;
+	uint64_t m_eventCount = 0;
+
+	// ブロック ID -> アドレス
+	std::vector<uint64_t> m_blockAddresses;
+	std::vector<uint64_t> m_blockEndAddresses;
+	std::unordered_map<uint64_t, uint32_t> m_blockIds;
+
+	uint64_t m_lastAddress = 0;
+	uint32_t m_lastId = 0;
+};
+
+// トレースの BB イベントをすべて列に読み込む（次のチャンクの展開は取り込みと並行して行う）
+// 読めないチャンクがあれば false を返す
+inline bool LoadEventColumns(TraceReader& reader, EventColumnStore& store)
+{
+	return reader.forEachChunk([&](size_t, const DecodedChunk& chunk)
+	{
+		store.append(chunk);
+	});
+}
+
+struct ColumnHitQuery
+{
+	// タイムスタンプ [beginTimestamp, endTimestamp)
+	uint64_t beginTimestamp = 0;
+	uint64_t endTimestamp = UINT64_MAX;
+
+	std::optional<uint32_t> threadId;
+};
+
+struct ColumnHitResult
+{
+	// ブロック ID -> ヒット数
+	std::vector<uint64_t> hitCounts;
+
+	uint64_t matchedEvents = 0;
+
+	size_t totalBatches = 0;
+	size_t scannedBatches = 0;
+};
+
+// 時間 / スレッドで絞り込んでブロック ID ごとのヒットを数える
+// 時間の範囲にすっぽり入るバッチは絞り込みを飛ばし、掛からないバッチは読まない
+// 空の範囲（beginTimestamp >= endTimestamp）には何も数えない
+inline ColumnHitResult CountBlockHits(const EventColumnStore& store, const ColumnHitQuery& query)
+{
+	ColumnHitResult result;
+	result.hitCounts.assign(store.blockCount(), 0);
+	result.totalBatches = store.batches().size();
+	if (query.endTimestamp <= query.beginTimestamp)
+	{
+		return result;
+	}
+
+	uint64_t mask[event_columns::MaskWordCount(EventBatch::Capacity)];
+	for (const auto& batch : store.batches())
+	{
+		if (batch.count == 0 || query.endTimestamp <= batch.firstTimestamp() || batch.lastTimestamp() < query.beginTimestamp)
+		{
+			continue;
+		}
+		++result.scannedBatches;
+
+		const bool wholeTime = query.beginTimestamp <= batch.firstTimestamp() && batch.lastTimestamp() < query.endTimestamp;
+		if (wholeTime && !query.threadId)
+		{
+			event_columns::AccumulateHits(batch.blockIds, batch.count, result.hitCounts.data());
+			result.matchedEvents += batch.count;
+			continue;
+		}
+
+		// バッチと重なる部分だけを差に直す（maxDelta < UINT32_MAX なので幅は 32 ビットに収まる）
+		const uint32_t low = (batch.baseTimestamp < query.beginTimestamp) ? static_cast<uint32_t>(query.beginTimestamp - batch.baseTimestamp) : 0;
+		const uint64_t high = std::min<uint64_t>(query.endTimestamp - batch.baseTimestamp, uint64_t{ batch.maxDelta } + 1);
+		event_columns::SelectRange(batch.timestampDeltas, batch.count, low, static_cast<uint32_t>(high - low), mask);
+
+		if (query.threadId)
+		{
+			event_columns::AndEqual(batch.threadIds, batch.count, *query.threadId, mask);
+		}
+
+		result.matchedEvents += event_columns::AccumulateSelectedHits(batch.blockIds, batch.count, mask, result.hitCounts.data());
+	}
+
+	return result;
+}
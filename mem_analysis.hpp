@@ -0,0 +1,241 @@
+﻿#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "trace_file.hpp"
+
+/////////////////////////////////////
+// メモリアクセスの解析
+//
+// クライアントはアクセスをバッファ単位でまとめて間引くので、短い距離の再利用とキャッシュの挙動は連続した区間の中で正しく測れる
+// 区間の間で捨てた分だけ、長い距離の再利用は短めに、ミスは少なめに出る
+
+struct CacheConfig
+{
+	uint32_t lineSize = 64;
+	uint32_t sets = 64;
+	uint32_t ways = 8;
+};
+
+// 再利用距離（同じキャッシュラインに再び触れるまでに触れた別のラインの数）のヒストグラム
+// buckets[0] は距離 0、buckets[k] は [2^(k-1), 2^k)
+struct ReuseHistogram
+{
+	static constexpr size_t BucketCount = 33;
+
+	std::array<uint64_t, BucketCount> buckets{};
+
+	// 初めて触れたライン
+	uint64_t cold = 0;
+
+	static size_t BucketOf(uint64_t distance)
+	{
+		return std::min<size_t>(std::bit_width(distance), BucketCount - 1);
+	}
+
+	void add(uint64_t distance)
+	{
+		if (distance == UINT64_MAX)
+		{
+			++cold;
+		}
+		else
+		{
+			++buckets[BucketOf(distance)];
+		}
+	}
+
+	void merge(const ReuseHistogram& other)
+	{
+		for (size_t i = 0; i < BucketCount; ++i)
+		{
+			buckets[i] += other.buckets[i];
+		}
+		cold += other.cold;
+	}
+};
+
+// 再利用距離を 1 アクセスあたり O(log n) で数える
+// ラインごとに最後に触れた時刻に印を付け、前回から今回までの間にある印の数を Fenwick 木で数える
+class ReuseDistanceCounter
+{
+public:
+
+	// 初めてのラインなら UINT64_MAX
+	uint64_t access(uint64_t line)
+	{
+		if (m_time == m_tree.size())
+		{
+			compact();
+		}
+
+		uint64_t distance = UINT64_MAX;
+		const auto [it, inserted] = m_lastAccess.try_emplace(line, m_time);
+		if (!inserted)
+		{
+			distance = prefix(m_time) - prefix(it->second + 1);
+			update(it->second, -1);
+			it->second = m_time;
+		}
+
+		update(m_time, +1);
+		++m_time;
+		return distance;
+	}
+
+private:
+
+	// [0, end) の印の数
+	int64_t prefix(size_t end) const
+	{
+		int64_t sum = 0;
+		for (size_t i = end; 0 < i; i &= i - 1)
+		{
+			sum += m_tree[i - 1];
+		}
+		return sum;
+	}
+
+	void update(size_t index, int32_t delta)
+	{
+		for (size_t i = index + 1; i <= m_tree.size(); i += i & (~i + 1))
+		{
+			m_tree[i - 1] += delta;
+		}
+	}
+
+	// 時刻を使い切ったら、生きている印だけを詰め直す
+	void compact()
+	{
+		std::vector<std::pair<size_t, uint64_t>> live;
+		live.reserve(m_lastAccess.size());
+		for (const auto& [line, time] : m_lastAccess)
+		{
+			live.emplace_back(time, line);
+		}
+		std::sort(live.begin(), live.end());
+
+		m_tree.assign(std::max<size_t>(size_t{ 1 } << 16, live.size() * 2), 0);
+		m_time = 0;
+		for (const auto& [time, line] : live)
+		{
+			m_lastAccess[line] = m_time;
+			update(m_time, +1);
+			++m_time;
+		}
+	}
+
+	std::vector<int32_t> m_tree;
+	size_t m_time = 0;
+
+	// ライン -> 最後に触れた時刻
+	std::unordered_map<uint64_t, size_t> m_lastAccess;
+};
+
+// LRU のセットアソシアティブキャッシュ
+class CacheSimulator
+{
+public:
+
+	explicit CacheSimulator(const CacheConfig& config = {})
+		: m_config(config)
+		, m_tags(static_cast<size_t>(config.sets) * config.ways, 0)
+	{
+	}
+
+	// ヒットなら true
+	bool access(uint64_t line)
+	{
+		// 0 は空きを表すので 1 ずらして持つ
+		const uint64_t tag = line + 1;
+		uint64_t* ways = &m_tags[(line % m_config.sets) * m_config.ways];
+
+		// ways[0] が最近使ったもの
+		size_t way = 0;
+		while (way < m_config.ways && ways[way] != tag)
+		{
+			++way;
+		}
+
+		const bool hit = (way < m_config.ways);
+		std::copy_backward(ways, ways + std::min<size_t>(way, m_config.ways - 1), ways + std::min<size_t>(way + 1, m_config.ways));
+		ways[0] = tag;
+		return hit;
+	}
+
+private:
+
+	CacheConfig m_config;
+	std::vector<uint64_t> m_tags;
+};
+
+// 命令ごとの集計
+struct MemAccessStats
+{
+	uint64_t reads = 0;
+	uint64_t writes = 0;
+	uint64_t misses = 0;
+	ReuseHistogram reuse;
+
+	void merge(const MemAccessStats& other)
+	{
+		reads += other.reads;
+		writes += other.writes;
+		misses += other.misses;
+		reuse.merge(other.reuse);
+	}
+};
+
+struct MemAnalysis
+{
+	// ロード / ストアした命令のアドレス -> 集計
+	std::unordered_map<uint64_t, MemAccessStats> instructions;
+
+	MemAccessStats total;
+};
+
+// トレースを先頭から読み、スレッドごとに再利用距離とキャッシュを模擬する（コアごとのキャッシュをスレッドで近似する）
+// 複数のラインにまたがるアクセスは先頭のラインだけを数える。読めないチャンクがあれば false を返す
+inline bool AnalyzeMemoryAccesses(TraceReader& reader, MemAnalysis& analysis, const CacheConfig& config = {})
+{
+	struct ThreadState
+	{
+		ReuseDistanceCounter reuse;
+		CacheSimulator cache;
+	};
+
+	analysis = MemAnalysis{};
+	std::unordered_map<uint32_t, ThreadState> threads;
+
+	const bool complete = reader.forEachChunk([&](size_t, const DecodedChunk& chunk)
+	{
+		for (const auto& ev : chunk.events)
+		{
+			if (ev.type != EventType::MemoryAccess)
+			{
+				continue;
+			}
+
+			const MemEvent& mem = ev.mem;
+			ThreadState& thread = threads.try_emplace(mem.tid, ThreadState{ {}, CacheSimulator(config) }).first->second;
+
+			const uint64_t line = mem.address / config.lineSize;
+			MemAccessStats& stats = analysis.instructions[mem.app_pc];
+			++(mem.isWrite ? stats.writes : stats.reads);
+			stats.reuse.add(thread.reuse.access(line));
+			if (!thread.cache.access(line))
+			{
+				++stats.misses;
+			}
+		}
+	});
+
+	for (const auto& [pc, stats] : analysis.instructions)
+	{
+		analysis.total.merge(stats);
+	}
+	return complete;
+}
@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <optional>
+#include <vector>
+
+#include "../event_columns.hpp"
+
+// event_columns の SIMD の絞り込み・デコードと CountBlockHits を、1 イベントずつ調べる素朴な実装と突き合わせる
+static int g_failures = 0;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); ++g_failures; } } while (false)
+
+struct Random
+{
+    uint64_t state;
+
+    uint32_t next(uint32_t range)
+    {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        return static_cast<uint32_t>((state >> 33) % range);
+    }
+
+    uint32_t next32()
+    {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        return static_cast<uint32_t>(state >> 32);
+    }
+};
+
+// 64 の倍数にならない長さ（ワードの途中で終わる末尾）も含める
+static const size_t g_counts[] = { 0, 1, 3, 7, 8, 63, 64, 65, 100, 127, 128, 129, 1000, EventBatch::Capacity };
+
+// 符号ビットをまたぐ値も混ぜる
+static std::vector<uint32_t> random_values(Random& random, size_t count, uint32_t range)
+{
+    std::vector<uint32_t> values(count);
+    for (auto& value : values)
+    {
+        switch (random.next(4))
+        {
+        case 0: value = random.next32(); break;
+        case 1: value = 0x80000000u - 4 + random.next(8); break;
+        default: value = random.next(range); break;
+        }
+    }
+    return values;
+}
+
+static void check_select_range(Random& random)
+{
+    for (const size_t count : g_counts)
+    {
+        const std::vector<uint32_t> values = random_values(random, count, 256);
+        const uint32_t ranges[][2] = { { 0, 0 }, { 0, 1 }, { 10, 100 }, { 0, 0x80000000u }, { 0x7FFFFFFEu, 4 }, { 0x80000000u, 0x80000000u }, { 0, UINT32_MAX } };
+        for (const auto& [low, width] : ranges)
+        {
+            std::vector<uint64_t> expected(event_columns::MaskWordCount(count), 0);
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (low <= values[i] && uint64_t{ values[i] } < uint64_t{ low } + width)
+                {
+                    expected[i / 64] |= 1ull << (i % 64);
+                }
+            }
+
+            // 前の中身は上書きされる
+            std::vector<uint64_t> mask(expected.size(), 0x5555555555555555ull);
+            event_columns::SelectRange(values.data(), count, low, width, mask.data());
+            CHECK(mask == expected);
+
+#ifdef EVENT_COLUMNS_X86
+            std::fill(mask.begin(), mask.end(), 0);
+            const size_t done = event_columns::detail::SelectRangeSse2(values.data(), count, low, width, mask.data());
+            event_columns::detail::SelectRangeScalar(values.data(), done, count, low, width, mask.data());
+            CHECK(mask == expected);
+
+            if (event_columns::HasAvx2())
+            {
+                std::fill(mask.begin(), mask.end(), 0);
+                const size_t doneAvx2 = event_columns::detail::SelectRangeAvx2(values.data(), count, low, width, mask.data());
+                event_columns::detail::SelectRangeScalar(values.data(), doneAvx2, count, low, width, mask.data());
+                CHECK(mask == expected);
+            }
+#endif
+        }
+    }
+}
+
+static void check_and_equal(Random& random)
+{
+    for (const size_t count : g_counts)
+    {
+        const std::vector<uint32_t> values = random_values(random, count, 4);
+        for (const uint32_t value : { 0u, 1u, 0x80000000u, UINT32_MAX })
+        {
+            // 末尾を超えたビットは 0 のまま
+            std::vector<uint64_t> initial(event_columns::MaskWordCount(count), 0);
+            std::vector<uint64_t> expected(initial.size(), 0);
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (random.next(4) != 0)
+                {
+                    initial[i / 64] |= 1ull << (i % 64);
+                    if (values[i] == value)
+                    {
+                        expected[i / 64] |= 1ull << (i % 64);
+                    }
+                }
+            }
+
+            std::vector<uint64_t> mask = initial;
+            event_columns::AndEqual(values.data(), count, value, mask.data());
+            CHECK(mask == expected);
+
+#ifdef EVENT_COLUMNS_X86
+            mask = initial;
+            const size_t done = event_columns::detail::AndEqualSse2(values.data(), count, value, mask.data());
+            event_columns::detail::AndEqualScalar(values.data(), done, count, value, mask.data());
+            CHECK(mask == expected);
+
+            if (event_columns::HasAvx2())
+            {
+                mask = initial;
+                const size_t doneAvx2 = event_columns::detail::AndEqualAvx2(values.data(), count, value, mask.data());
+                event_columns::detail::AndEqualScalar(values.data(), doneAvx2, count, value, mask.data());
+                CHECK(mask == expected);
+            }
+#endif
+        }
+    }
+}
+
+static void check_decode_timestamps(Random& random)
+{
+    for (const size_t count : g_counts)
+    {
+        const std::vector<uint32_t> deltas = random_values(random, count, 1000000);
+        for (const uint64_t base : { 0ull, 1234567ull, 0xFFFFFFFFull, 1ull << 62 })
+        {
+            std::vector<uint64_t> expected(count);
+            for (size_t i = 0; i < count; ++i)
+            {
+                expected[i] = base + deltas[i];
+            }
+
+            std::vector<uint64_t> out(count, 0);
+            event_columns::DecodeTimestamps(deltas.data(), count, base, out.data());
+            CHECK(out == expected);
+
+#ifdef EVENT_COLUMNS_X86
+            std::fill(out.begin(), out.end(), 0);
+            const size_t done = event_columns::detail::DecodeSse2(deltas.data(), count, base, out.data());
+            event_columns::detail::DecodeScalar(deltas.data(), done, count, base, out.data());
+            CHECK(out == expected);
+
+            if (event_columns::HasAvx2())
+            {
+                std::fill(out.begin(), out.end(), 0);
+                const size_t doneAvx2 = event_columns::detail::DecodeAvx2(deltas.data(), count, base, out.data());
+                event_columns::detail::DecodeScalar(deltas.data(), doneAvx2, count, base, out.data());
+                CHECK(out == expected);
+            }
+#endif
+        }
+    }
+}
+
+// アドレス -> ヒット数を、すべてのイベントを 1 つずつ調べて数える
+static std::map<uint64_t, uint64_t> reference_hits(const std::vector<BBEvent>& events, const ColumnHitQuery& query)
+{
+    std::map<uint64_t, uint64_t> hits;
+    for (const auto& bb : events)
+    {
+        if (query.beginTimestamp <= bb.timestamp_us && bb.timestamp_us < query.endTimestamp && (!query.threadId || bb.tid == *query.threadId))
+        {
+            ++hits[bb.app_pc];
+        }
+    }
+    return hits;
+}
+
+static void check_query(const EventColumnStore& store, const std::vector<BBEvent>& events, const ColumnHitQuery& query)
+{
+    const ColumnHitResult result = CountBlockHits(store, query);
+    const std::map<uint64_t, uint64_t> expected = reference_hits(events, query);
+
+    CHECK(result.hitCounts.size() == store.blockCount());
+    std::map<uint64_t, uint64_t> hits;
+    uint64_t matched = 0;
+    for (uint32_t id = 0; id < result.hitCounts.size(); ++id)
+    {
+        if (result.hitCounts[id] != 0)
+        {
+            hits[store.blockAddress(id)] = result.hitCounts[id];
+            matched += result.hitCounts[id];
+        }
+    }
+    CHECK(hits == expected);
+    CHECK(result.matchedEvents == matched);
+}
+
+// 時刻は少しずつ進め、ときどきスレッド間で前後させたり大きく飛ばしたり（バッチが切り替わる）する
+static void check_count_block_hits(size_t eventCount, uint64_t seed)
+{
+    Random random{ seed };
+    EventColumnStore store;
+    std::vector<BBEvent> events;
+
+    uint64_t now = 1000000;
+    for (size_t i = 0; i < eventCount; ++i)
+    {
+        now += random.next(8);
+        if (random.next(5000) == 0)
+        {
+            now += 1ull << 32;
+        }
+
+        BBEvent bb = {};
+        bb.tid = 1 + random.next(3);
+        bb.timestamp_us = now - random.next(200);
+        bb.app_pc = 0x140001000ull + 16 * random.next(300);
+        bb.app_pc_end = bb.app_pc + 8;
+        store.append(bb);
+        events.push_back(bb);
+    }
+    CHECK(store.eventCount() == eventCount);
+
+    const uint64_t first = store.firstTimestamp();
+    const uint64_t last = store.lastTimestamp();
+
+    check_query(store, events, ColumnHitQuery{});
+    check_query(store, events, ColumnHitQuery{ 0, UINT64_MAX, 2 });
+    check_query(store, events, ColumnHitQuery{ 0, UINT64_MAX, 99 });
+    check_query(store, events, ColumnHitQuery{ first, last + 1, std::nullopt });
+    check_query(store, events, ColumnHitQuery{ last + 1, UINT64_MAX, std::nullopt });
+
+    for (int i = 0; i < 50; ++i)
+    {
+        const uint64_t span = last - first + 1;
+        const uint64_t begin = first + (uint64_t{ random.next32() } << 32 | random.next32()) % span;
+        const uint64_t end = begin + 1 + random.next(static_cast<uint32_t>(std::min<uint64_t>(span, 100000)));
+        const std::optional<uint32_t> threadId = random.next(2) ? std::optional<uint32_t>(1 + random.next(3)) : std::nullopt;
+        check_query(store, events, ColumnHitQuery{ begin, end, threadId });
+    }
+
+    // 空の範囲と逆向きの範囲は何も数えない
+    const uint64_t middle = first + (last - first) / 2;
+    for (const ColumnHitQuery& query : { ColumnHitQuery{ middle, middle, std::nullopt }, ColumnHitQuery{ middle + 1000, middle, std::nullopt },
+        ColumnHitQuery{ last, first, 1u } })
+    {
+        const ColumnHitResult result = CountBlockHits(store, query);
+        CHECK(result.matchedEvents == 0);
+        CHECK(result.scannedBatches == 0);
+        CHECK(std::count(result.hitCounts.begin(), result.hitCounts.end(), 0) == static_cast<std::ptrdiff_t>(store.blockCount()));
+    }
+}
+
+int main()
+{
+    Random random{ 1 };
+    check_select_range(random);
+    check_and_equal(random);
+    check_decode_timestamps(random);
+
+    check_count_block_hits(0, 2);
+    check_count_block_hits(77, 3);
+    check_count_block_hits(EventBatch::Capacity * 5 + 123, 4);
+    check_count_block_hits(60000, 5);
+
+    if (g_failures != 0)
+    {
+        std::fprintf(stderr, "%d checks failed\n", g_failures);
+        return 1;
+    }
+    std::printf("event_columns_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,198 @@
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <vector>
+
+#include "../cpp_tracer/hit_timeline.hpp"
+
+// HitTimeline を、以前の実装（ヒットごとに全レベルのバケットへ加算する）と突き合わせる
+static int g_failures = 0;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); ++g_failures; } } while (false)
+
+// 以前の実装：各レベルが直近 bucketsPerLevel 個のバケットを持つリングで、加算は保持している全レベルに行う
+class ReferenceTimeline
+{
+public:
+
+    ReferenceTimeline(uint32_t bucketsPerLevel, uint32_t levelCount)
+        : m_bucketsPerLevel(bucketsPerLevel)
+        , m_levels(levelCount, std::vector<Bucket>(bucketsPerLevel))
+    {
+    }
+
+    void add(uint64_t column, uint64_t key, uint32_t count = 1)
+    {
+        for (uint32_t level = 0; level < m_levels.size(); ++level)
+        {
+            if (Bucket* bucket = acquire(level, column))
+            {
+                bucket->cells[key] += count;
+            }
+        }
+    }
+
+    void addRepeat(uint64_t column, uint32_t count = 1)
+    {
+        for (uint32_t level = 0; level < m_levels.size(); ++level)
+        {
+            if (Bucket* bucket = acquire(level, column))
+            {
+                bucket->repeatCount += count;
+            }
+        }
+    }
+
+    void clear()
+    {
+        for (auto& buckets : m_levels)
+        {
+            for (auto& bucket : buckets)
+            {
+                bucket = Bucket{};
+            }
+        }
+    }
+
+    bool isRetained(uint32_t level, uint64_t index) const
+    {
+        return m_levels[level][index % m_bucketsPerLevel].index == index;
+    }
+
+    const std::map<uint64_t, uint32_t>& cells(uint32_t level, uint64_t index) const
+    {
+        return m_levels[level][index % m_bucketsPerLevel].cells;
+    }
+
+    uint32_t repeatCount(uint32_t level, uint64_t index) const
+    {
+        return m_levels[level][index % m_bucketsPerLevel].repeatCount;
+    }
+
+private:
+
+    struct Bucket
+    {
+        uint64_t index = UINT64_MAX;
+        std::map<uint64_t, uint32_t> cells;
+        uint32_t repeatCount = 0;
+    };
+
+    Bucket* acquire(uint32_t level, uint64_t column)
+    {
+        const uint64_t index = column >> level;
+        Bucket& bucket = m_levels[level][index % m_bucketsPerLevel];
+        if (bucket.index != index)
+        {
+            if (bucket.index != UINT64_MAX && index < bucket.index)
+            {
+                return nullptr;
+            }
+            bucket = Bucket{};
+            bucket.index = index;
+        }
+        return &bucket;
+    }
+
+    uint32_t m_bucketsPerLevel;
+    std::vector<std::vector<Bucket>> m_levels;
+};
+
+// 全レベルの、最後の列までの全バケットを比べる
+static void check_same(const HitTimeline& timeline, const ReferenceTimeline& reference)
+{
+    for (uint32_t level = 0; level < timeline.levelCount(); ++level)
+    {
+        for (uint64_t index = 0; index <= (timeline.columnCount() >> level); ++index)
+        {
+            const bool retained = reference.isRetained(level, index);
+            CHECK(timeline.isRetained(level, index) == retained);
+            if (!retained)
+            {
+                continue;
+            }
+
+            CHECK(timeline.repeatCount(level, index) == reference.repeatCount(level, index));
+
+            std::vector<HitTimeline::Cell> cells;
+            timeline.forEachCell(level, index, 0, UINT64_MAX, [&](const HitTimeline::Cell& cell) { cells.push_back(cell); });
+            const auto& expected = reference.cells(level, index);
+            CHECK(cells.size() == expected.size());
+            auto it = expected.begin();
+            for (size_t i = 0; i < cells.size() && it != expected.end(); ++i, ++it)
+            {
+                CHECK(cells[i].key == it->first && cells[i].count == it->second);
+            }
+        }
+    }
+}
+
+struct Random
+{
+    uint64_t state;
+
+    uint32_t next(uint32_t range)
+    {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        return static_cast<uint32_t>((state >> 33) % range);
+    }
+};
+
+// 列を進めながら加算し、ときどき保持範囲の内外にある古い列（畳んだループの列）へ加算・畳み込みをする
+static void run(uint32_t bucketsPerLevel, uint32_t levelCount, uint64_t columns, uint32_t lateRange, uint64_t seed)
+{
+    HitTimeline timeline{ bucketsPerLevel, levelCount };
+    ReferenceTimeline reference{ bucketsPerLevel, levelCount };
+    Random random{ seed };
+
+    for (int round = 0; round < 2; ++round)
+    {
+        for (uint64_t column = 0; column < columns; ++column)
+        {
+            const uint32_t hits = 1 + random.next(4);
+            for (uint32_t i = 0; i < hits; ++i)
+            {
+                const uint64_t key = random.next(64);
+                timeline.add(column, key);
+                reference.add(column, key);
+            }
+
+            if (random.next(8) == 0)
+            {
+                const uint64_t late = column - std::min<uint64_t>(column, random.next(lateRange));
+                const uint64_t key = random.next(64);
+                timeline.add(late, key, 3);
+                reference.add(late, key, 3);
+                timeline.addRepeat(late);
+                reference.addRepeat(late);
+            }
+
+            // 途中でも読む（作り直したあとの加算も反映されるか）
+            if (column % 97 == 0)
+            {
+                check_same(timeline, reference);
+            }
+        }
+        check_same(timeline, reference);
+
+        timeline.clear();
+        reference.clear();
+    }
+}
+
+int main()
+{
+    run(8, 6, 2000, 4, 1);
+    run(8, 6, 2000, 64, 2);
+    run(4, 10, 5000, 300, 3);
+    run(512, 24, 3000, 600, 4);
+
+    if (g_failures != 0)
+    {
+        std::fprintf(stderr, "%d checks failed\n", g_failures);
+        return 1;
+    }
+    std::printf("hit_timeline_test: ok\n");
+    return 0;
+}
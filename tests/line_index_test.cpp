@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <vector>
+
+#include "../cpp_tracer/line_index.hpp"
+
+// BlockLineIndex を、置き換える前の updateLinesDef（std::map に入れてから全体を走査して切り詰める）と突き合わせる
+static int g_failures = 0;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); ++g_failures; } } while (false)
+
+// 以前の実装：未登録の開始行だけを追加し、毎回全体を走査して前の要素の終端を次の開始行で切り詰める
+// 終端が開始行より前のブロックは、BlockLineIndex と同じく開始行 1 行として扱う
+// 以前は 0 を未登録の印にしていたので 0 行目に始まるブロックは上書きされていたが、ここでは他の行と同じく最初のものを残す
+class ReferenceLines
+{
+public:
+
+    bool insert(uint32_t startLine, uint32_t endLine)
+    {
+        if (!m_lines.try_emplace(startLine, LineRange{ startLine, std::max(startLine, endLine) }).second)
+        {
+            return false;
+        }
+
+        for (auto it = m_lines.begin(); std::next(it) != m_lines.end(); ++it)
+        {
+            it->second.endLine = std::min(it->second.endLine, std::next(it)->second.startLine - 1);
+        }
+        return true;
+    }
+
+    std::vector<LineRange> overlapping(uint32_t firstLine, uint32_t lastLine) const
+    {
+        std::vector<LineRange> result;
+        if (lastLine <= firstLine)
+        {
+            return result;
+        }
+        for (const auto& [start, range] : m_lines)
+        {
+            if (range.startLine < lastLine && firstLine <= range.endLine)
+            {
+                result.push_back(range);
+            }
+        }
+        return result;
+    }
+
+    const std::map<uint32_t, LineRange>& lines() const
+    {
+        return m_lines;
+    }
+
+private:
+
+    std::map<uint32_t, LineRange> m_lines;
+};
+
+static bool same(const LineRange& a, const LineRange& b)
+{
+    return a.startLine == b.startLine && a.endLine == b.endLine;
+}
+
+static std::vector<LineRange> all_ranges(const BlockLineIndex& index)
+{
+    std::vector<LineRange> result;
+    index.forEach([&](const LineRange& r) { result.push_back(r); });
+    return result;
+}
+
+static std::vector<LineRange> overlapping(const BlockLineIndex& index, uint32_t firstLine, uint32_t lastLine)
+{
+    std::vector<LineRange> result;
+    index.forEachOverlapping(firstLine, lastLine, [&](const LineRange& r) { result.push_back(r); });
+    return result;
+}
+
+static bool equal_ranges(const std::vector<LineRange>& a, const std::vector<LineRange>& b)
+{
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), same);
+}
+
+// 同じ順で両方に入れ、毎回全体と find が一致するかを見る
+static void check_sequence(const std::vector<LineRange>& inserts)
+{
+    BlockLineIndex index;
+    ReferenceLines reference;
+    for (const auto& r : inserts)
+    {
+        CHECK(index.insert(r.startLine, r.endLine) == reference.insert(r.startLine, r.endLine));
+
+        std::vector<LineRange> expected;
+        for (const auto& [start, range] : reference.lines()) expected.push_back(range);
+        CHECK(equal_ranges(all_ranges(index), expected));
+        CHECK(index.size() == reference.lines().size());
+    }
+
+    for (const auto& [start, range] : reference.lines())
+    {
+        const LineRange* found = index.find(start);
+        CHECK(found && same(*found, range));
+    }
+
+    // 範囲の端、隙間、全体の外側を含めて重なりを調べる
+    uint32_t maxLine = 0;
+    for (const auto& r : inserts) maxLine = std::max({ maxLine, r.startLine, r.endLine });
+    for (uint32_t first = 0; first <= maxLine + 2; first += 1 + first / 16)
+    {
+        for (uint32_t last = first; last <= maxLine + 3; last += 1 + last / 8)
+        {
+            CHECK(equal_ranges(overlapping(index, first, last), reference.overlapping(first, last)));
+        }
+    }
+}
+
+static void test_adjacent()
+{
+    // 終端が次の開始行の直前 / 次の開始行と同じ / 次の開始行を越える
+    check_sequence({ { 10, 19 }, { 20, 29 } });
+    check_sequence({ { 10, 20 }, { 20, 29 } });
+    check_sequence({ { 20, 29 }, { 10, 25 } });
+    check_sequence({ { 10, 30 }, { 20, 29 }, { 30, 40 } });
+}
+
+static void test_nested()
+{
+    // 外側のブロックは内側の開始行の直前で切られる（内側の後ろの行は取り戻さない）
+    check_sequence({ { 10, 50 }, { 20, 30 } });
+    check_sequence({ { 20, 30 }, { 10, 50 } });
+    check_sequence({ { 10, 50 }, { 20, 40 }, { 25, 30 }, { 45, 60 } });
+}
+
+static void test_identical()
+{
+    // 同じ開始行は最初のものが残る
+    check_sequence({ { 10, 20 }, { 10, 20 } });
+    check_sequence({ { 10, 20 }, { 10, 40 }, { 10, 5 } });
+}
+
+static void test_zero_length()
+{
+    // 1 行のブロック、終端が開始行より前のブロック、0 行目
+    check_sequence({ { 10, 10 }, { 11, 11 }, { 12, 12 } });
+    check_sequence({ { 10, 3 }, { 5, 20 } });
+    check_sequence({ { 0, 0 }, { 0, 10 }, { 1, 5 } });
+
+    BlockLineIndex index;
+    index.insert(10, 20);
+    CHECK(overlapping(index, 15, 15).empty());
+    CHECK(overlapping(index, 20, 10).empty());
+}
+
+// チャンクの分割をまたぐ量を、決まった順序（昇順 / 降順 / ばらばら）で入れる
+static void test_split()
+{
+    std::vector<LineRange> ascending, descending, shuffled;
+    for (uint32_t i = 0; i < 300; ++i)
+    {
+        ascending.push_back({ i * 3, i * 3 + 7 });
+        descending.push_back({ (299 - i) * 3, (299 - i) * 3 + 1 });
+    }
+    uint64_t state = 1;
+    for (uint32_t i = 0; i < 400; ++i)
+    {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        const uint32_t start = (uint32_t)(state >> 40) % 1000;
+        shuffled.push_back({ start, start + (uint32_t)(state >> 20) % 40 });
+    }
+    check_sequence(ascending);
+    check_sequence(descending);
+    check_sequence(shuffled);
+}
+
+// コピーはチャンクを共有するが、元に書き込んでもコピーの中身は変わらない
+static void test_copy_on_write()
+{
+    BlockLineIndex index;
+    for (uint32_t i = 0; i < 200; ++i) index.insert(i * 10, i * 10 + 20);
+
+    const BlockLineIndex copy = index;
+    const std::vector<LineRange> before = all_ranges(copy);
+
+    index.insert(5, 9);
+    index.insert(1995, 2100);
+    index.insert(3000, 3010);
+    CHECK(equal_ranges(all_ranges(copy), before));
+    CHECK(copy.size() == 200);
+    CHECK(index.size() == 203);
+}
+
+int main()
+{
+    test_adjacent();
+    test_nested();
+    test_identical();
+    test_zero_length();
+    test_split();
+    test_copy_on_write();
+
+    if (g_failures != 0)
+    {
+        std::fprintf(stderr, "%d checks failed\n", g_failures);
+        return 1;
+    }
+    std::printf("line_index_test: ok\n");
+    return 0;
+}
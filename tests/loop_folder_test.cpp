@@ -0,0 +1,106 @@
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../cpp_tracer/loop_folder.hpp"
+
+// LoopFolder が周期を確かめてから畳むことを、列の並びごとに確かめる
+static int g_failures = 0;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); ++g_failures; } } while (false)
+
+// 列の名前（'A' など）ごとに、キーが戻るところで区切られるキー列を作る
+// どの列も 0 で始めるので、次の列の先頭で必ず区切られる
+static std::vector<uint64_t> column_keys(char name)
+{
+    return { 0, static_cast<uint64_t>(name) };
+}
+
+// 列を順に流して最後に flush し、出てきた列を "0 1 1* ..."（* は畳んだ列）の形にする
+static std::string fold(const std::string& columns, uint64_t foldWindow = 512, uint32_t threadId = 1)
+{
+    LoopFolder folder{ foldWindow };
+    std::string result;
+    const auto emit = [&](uint64_t column, const std::vector<uint64_t>&, bool folded)
+        {
+            if (!result.empty())
+            {
+                result += ' ';
+            }
+            result += std::to_string(column);
+            if (folded)
+            {
+                result += '*';
+            }
+        };
+
+    for (const char name : columns)
+    {
+        for (const uint64_t key : column_keys(name))
+        {
+            folder.add(threadId, key, emit);
+        }
+    }
+    folder.flush(emit);
+    return result;
+}
+
+static void check_fold(const std::string& columns, const std::string& expected, uint64_t foldWindow = 512)
+{
+    const std::string actual = fold(columns, foldWindow);
+    if (actual != expected)
+    {
+        std::fprintf(stderr, "%s: expected \"%s\", got \"%s\"\n", columns.c_str(), expected.c_str(), actual.c_str());
+        ++g_failures;
+    }
+}
+
+int main()
+{
+    // 周期 1：2 列目で周期を確かめてから畳む
+    check_fold("AAAAA", "0 1 1* 1* 1*");
+
+    // 周期 2：2 回分の 4 列を出してから畳む
+    check_fold("ABABABAB", "0 1 2 3 2* 3* 2* 3*");
+
+    // 繰り返しが無ければ畳まない
+    check_fold("ABCAD", "0 1 2 3 4");
+
+    // 一度だけの重なり（A B A）では畳まない
+    check_fold("ABAC", "0 1 2 3");
+
+    // 畳む先が foldWindow より古ければ新しい列にする
+    check_fold("AAAA", "0 1 2 3", 0);
+
+    // スレッドごとに別々に区切って畳む
+    {
+        LoopFolder folder{ 512 };
+        std::vector<std::pair<uint64_t, bool>> emitted;
+        const auto emit = [&](uint64_t column, const std::vector<uint64_t>&, bool folded) { emitted.emplace_back(column, folded); };
+        for (int i = 0; i < 3; ++i)
+        {
+            for (const uint32_t threadId : { 1u, 2u })
+            {
+                for (const uint64_t key : column_keys('A'))
+                {
+                    folder.add(threadId, key, emit);
+                }
+            }
+        }
+        folder.flush(emit);
+        CHECK(emitted.size() == 6);
+        CHECK(folder.columnCount() == 4);
+        CHECK(folder.foldedCount() == 2);
+    }
+
+    if (g_failures != 0)
+    {
+        std::fprintf(stderr, "%d checks failed\n", g_failures);
+        return 1;
+    }
+    std::printf("loop_folder_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <vector>
+
+#include "../mem_analysis.hpp"
+
+// ReuseDistanceCounter と CacheSimulator を、素朴な実装と突き合わせる
+static int g_failures = 0;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); ++g_failures; } } while (false)
+
+struct Random
+{
+    uint64_t state;
+
+    uint32_t next(uint32_t range)
+    {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        return static_cast<uint32_t>((state >> 33) % range);
+    }
+};
+
+// 最近触れた順に並べたラインの中での位置が再利用距離
+class ReferenceReuse
+{
+public:
+
+    uint64_t access(uint64_t line)
+    {
+        const auto it = std::find(m_stack.begin(), m_stack.end(), line);
+        const uint64_t distance = (it == m_stack.end()) ? UINT64_MAX : static_cast<uint64_t>(it - m_stack.begin());
+        if (it != m_stack.end())
+        {
+            m_stack.erase(it);
+        }
+        m_stack.insert(m_stack.begin(), line);
+        return distance;
+    }
+
+private:
+
+    std::vector<uint64_t> m_stack;
+};
+
+// セットごとに最近使った順のリストを持ち、溢れたら末尾を追い出す
+class ReferenceCache
+{
+public:
+
+    explicit ReferenceCache(const CacheConfig& config)
+        : m_config(config)
+        , m_sets(config.sets)
+    {
+    }
+
+    bool access(uint64_t line)
+    {
+        std::list<uint64_t>& set = m_sets[line % m_config.sets];
+        const auto it = std::find(set.begin(), set.end(), line);
+        const bool hit = (it != set.end());
+        if (hit)
+        {
+            set.erase(it);
+        }
+        else if (set.size() == m_config.ways)
+        {
+            set.pop_back();
+        }
+        set.push_front(line);
+        return hit;
+    }
+
+private:
+
+    CacheConfig m_config;
+    std::vector<std::list<uint64_t>> m_sets;
+};
+
+// lineRange 本のラインに、ときどき局所的な繰り返しを混ぜて触れる（時刻を詰め直すところも通るように十分な回数）
+static void check_reuse(uint32_t lineRange, uint32_t accesses, uint64_t seed)
+{
+    ReuseDistanceCounter counter;
+    ReferenceReuse reference;
+    Random random{ seed };
+
+    uint64_t line = 0;
+    for (uint32_t i = 0; i < accesses; ++i)
+    {
+        line = (random.next(4) == 0) ? line : random.next(lineRange);
+        const uint64_t expected = reference.access(line);
+        const uint64_t actual = counter.access(line);
+        if (actual != expected)
+        {
+            std::fprintf(stderr, "reuse: range=%u access %u line %llu: expected %llu, got %llu\n", lineRange, i,
+                static_cast<unsigned long long>(line), static_cast<unsigned long long>(expected), static_cast<unsigned long long>(actual));
+            ++g_failures;
+            return;
+        }
+    }
+}
+
+static void check_cache(const CacheConfig& config, uint32_t lineRange, uint32_t accesses, uint64_t seed)
+{
+    CacheSimulator cache(config);
+    ReferenceCache reference(config);
+    Random random{ seed };
+
+    for (uint32_t i = 0; i < accesses; ++i)
+    {
+        const uint64_t line = random.next(lineRange);
+        if (cache.access(line) != reference.access(line))
+        {
+            std::fprintf(stderr, "cache: sets=%u ways=%u access %u line %llu differs\n", config.sets, config.ways, i, static_cast<unsigned long long>(line));
+            ++g_failures;
+            return;
+        }
+    }
+}
+
+int main()
+{
+    // 手で追える例：A B A C A B
+    {
+        ReuseDistanceCounter counter;
+        CHECK(counter.access(1) == UINT64_MAX);
+        CHECK(counter.access(2) == UINT64_MAX);
+        CHECK(counter.access(1) == 1);
+        CHECK(counter.access(3) == UINT64_MAX);
+        CHECK(counter.access(1) == 1);
+        CHECK(counter.access(2) == 2);
+        CHECK(counter.access(2) == 0);
+    }
+
+    check_reuse(16, 200000, 1);
+    check_reuse(300, 200000, 2);
+    check_reuse(5000, 150000, 3);
+
+    // 1 セット 2 ウェイ：A B A C B（C は最近使っていない B を追い出す）
+    {
+        CacheSimulator cache(CacheConfig{ 64, 1, 2 });
+        CHECK(!cache.access(10));
+        CHECK(!cache.access(20));
+        CHECK(cache.access(10));
+        CHECK(!cache.access(30));
+        CHECK(!cache.access(20));
+        CHECK(cache.access(30));
+    }
+
+    check_cache(CacheConfig{ 64, 1, 1 }, 4, 10000, 4);
+    check_cache(CacheConfig{ 64, 4, 4 }, 40, 100000, 5);
+    check_cache(CacheConfig{ 64, 64, 8 }, 1000, 200000, 6);
+
+    if (g_failures != 0)
+    {
+        std::fprintf(stderr, "%d checks failed\n", g_failures);
+        return 1;
+    }
+    std::printf("mem_analysis_test: ok\n");
+    return 0;
+}
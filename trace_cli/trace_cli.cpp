@@ -0,0 +1,799 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <charconv>
+#include <chrono>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../trace_query.hpp"
+#include "../trace_profile.hpp"
+#include "../mem_analysis.hpp"
+#include "../event_columns.hpp"
+#include "../cpp_tracer/symbolizer.hpp"
+
+// 記録済みトレース (.cbtrace) に対するコマンドラインツール
+// 結果は JSON で標準出力に書く
+static void print_usage()
+{
+    std::fprintf(stderr,
+        "usage:\n"
+        "  trace_cli query <trace> [--from=us] [--to=us] [--tid=N] [--block=rva]... [--lines]\n"
+        "                          [--threads=N] [--exe=path] [--msdia=path]\n"
+        "  trace_cli profile <trace> --out=<csv> [--exe=path] [--msdia=path]\n"
+        "  trace_cli diff <A> <B> [--top=N] [--exe-a=path] [--exe-b=path] [--msdia=path]\n"
+        "  trace_cli mem <trace> [--top=N] [--line-size=B] [--sets=N] [--ways=N] [--exe=path] [--msdia=path]\n"
+        "  trace_cli hits <trace> [--from=us] [--to=us] [--tid=N] [--top=N]\n"
+        "\n"
+        "  --from / --to   time window in microseconds from the first event\n"
+        "  --tid           only events of this thread\n"
+        "  --block         only this block (RVA of the block start in the exe, hex or decimal)\n"
+        "  --lines         resolve blocks to source lines via the exe's PDB\n"
+        "  <A> / <B>       a trace, or a profile written by \"profile\" (.csv)\n"
+        "  mem             needs a trace recorded with the viewer's --mem option\n"
+        "  hits            loads the whole trace into columns and counts hits per block (for large traces)\n");
+}
+
+static std::wstring widen(const std::string& s)
+{
+    if (s.empty()) return {};
+    const int len = MultiByteToWideChar(CP_UTF8, 0, s.data(), (int)s.size(), nullptr, 0);
+    std::wstring out(len, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, s.data(), (int)s.size(), out.data(), len);
+    return out;
+}
+
+static std::string narrow(const std::wstring& s)
+{
+    if (s.empty()) return {};
+    const int len = WideCharToMultiByte(CP_UTF8, 0, s.data(), (int)s.size(), nullptr, 0, nullptr, nullptr);
+    std::string out(len, '\0');
+    WideCharToMultiByte(CP_UTF8, 0, s.data(), (int)s.size(), out.data(), len, nullptr, nullptr);
+    return out;
+}
+
+static std::string json_string(std::string_view s)
+{
+    std::string out = "\"";
+    for (const char ch : s)
+    {
+        switch (ch)
+        {
+        case '"':  out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if ((unsigned char)ch < 0x20)
+            {
+                char buf[8];
+                std::snprintf(buf, sizeof(buf), "\\u%04x", ch);
+                out += buf;
+            }
+            else
+            {
+                out.push_back(ch);
+            }
+        }
+    }
+    out.push_back('"');
+    return out;
+}
+
+// 10 進または 0x で始まる 16 進
+static bool parse_u64(std::string_view s, uint64_t& out)
+{
+    int base = 10;
+    if (s.starts_with("0x") || s.starts_with("0X"))
+    {
+        s.remove_prefix(2);
+        base = 16;
+    }
+    const auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), out, base);
+    return ec == std::errc() && ptr == s.data() + s.size() && !s.empty();
+}
+
+// "--name=value" の value を取り出す
+static bool option_value(std::string_view arg, std::string_view name, std::string_view& value)
+{
+    if (arg.size() <= name.size() + 1 || !arg.starts_with(name) || arg[name.size()] != '=') return false;
+    value = arg.substr(name.size() + 1);
+    return true;
+}
+
+struct QueryOptions
+{
+    std::string tracePath;
+    std::optional<uint64_t> from, to;
+    std::optional<uint32_t> tid;
+    std::vector<uint64_t> blockRvas;
+    bool lines = false;
+    size_t threads = TraceReader::DefaultThreadCount();
+    std::string exePath;
+    std::wstring msdiaPath = L"msdia140.dll";
+};
+
+static bool parse_query_options(int argc, const char* argv[], QueryOptions& opt)
+{
+    for (int i = 2; i < argc; ++i)
+    {
+        const std::string_view arg = argv[i];
+        std::string_view value;
+        uint64_t n = 0;
+        if (arg == "--lines") opt.lines = true;
+        else if (option_value(arg, "--from", value) && parse_u64(value, n)) opt.from = n;
+        else if (option_value(arg, "--to", value) && parse_u64(value, n)) opt.to = n;
+        else if (option_value(arg, "--tid", value) && parse_u64(value, n)) opt.tid = (uint32_t)n;
+        else if (option_value(arg, "--block", value) && parse_u64(value, n)) opt.blockRvas.push_back(n);
+        else if (option_value(arg, "--threads", value) && parse_u64(value, n) && 0 < n) opt.threads = (size_t)n;
+        else if (option_value(arg, "--exe", value)) opt.exePath = value;
+        else if (option_value(arg, "--msdia", value)) opt.msdiaPath = widen(std::string(value));
+        else if (!arg.starts_with("--") && opt.tracePath.empty()) opt.tracePath = arg;
+        else
+        {
+            std::fprintf(stderr, "unknown option: %s\n", argv[i]);
+            return false;
+        }
+    }
+    return !opt.tracePath.empty();
+}
+
+// exe 内のブロック（先頭, 終端）をワーカーで並列に解決する（exe 外のブロックは found = false のまま）
+static std::vector<SymbolizedBlock> symbolize_blocks(const std::wstring& msdiaPath, const std::string& exePath, const TraceModule& exe,
+    const std::vector<std::pair<uint64_t, uint64_t>>& blocks)
+{
+    std::vector<SymbolizedBlock> symbolized(blocks.size());
+
+    Symbolizer symbolizer;
+    symbolizer.start(msdiaPath, widen(exePath));
+
+    size_t requested = 0;
+    for (const auto& [begin, end] : blocks)
+    {
+        if (!exe.inRange(begin)) continue;
+        symbolizer.request(begin, (uint32_t)(begin - exe.base), (uint32_t)(end - exe.base));
+        ++requested;
+    }
+
+    std::vector<uint64_t> completed;
+    while (completed.size() < requested)
+    {
+        symbolizer.takeCompleted(completed);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        symbolizer.table().find(blocks[i].first, symbolized[i]);
+    }
+    symbolizer.stop();
+
+    return symbolized;
+}
+
+// 解決したブロックを行単位にまとめたもの
+struct LineHits
+{
+    uint32_t endLine = 0;
+    uint64_t hitCount = 0;
+    uint64_t firstTimestamp = UINT64_MAX;
+    uint64_t lastTimestamp = 0;
+};
+
+static int run_query(const QueryOptions& opt)
+{
+    TraceReader reader;
+    if (!reader.open(opt.tracePath))
+    {
+        std::fprintf(stderr, "failed to open %s\n", opt.tracePath.c_str());
+        return 2;
+    }
+
+    TraceQueryEngine engine(reader);
+    const uint64_t start = engine.firstTimestamp();
+    const std::optional<TraceModule> exe = engine.exeModule();
+
+    TraceQuery query;
+    query.beginTimestamp = opt.from ? start + *opt.from : 0;
+    query.endTimestamp = opt.to ? start + *opt.to : UINT64_MAX;
+    query.threadId = opt.tid;
+    if (!opt.blockRvas.empty())
+    {
+        if (!exe)
+        {
+            std::fprintf(stderr, "--block needs the exe module, but the trace has no module events for it\n");
+            return 2;
+        }
+        for (const uint64_t rva : opt.blockRvas) query.blocks.push_back(exe->base + rva);
+    }
+
+    const TraceQueryResult result = engine.run(query, opt.threads);
+    if (result.failedChunks != 0)
+    {
+        std::fprintf(stderr, "failed to read %zu of %zu chunks of %s\n", result.failedChunks, result.scannedChunks, opt.tracePath.c_str());
+        return 2;
+    }
+
+    // 行への解決は exe 内のブロックだけ
+    std::vector<SymbolizedBlock> symbolized(result.blocks.size());
+    const std::string exePath = !opt.exePath.empty() ? opt.exePath : reader.exePath();
+    if (opt.lines && exe)
+    {
+        std::vector<std::pair<uint64_t, uint64_t>> blocks;
+        for (const auto& block : result.blocks) blocks.emplace_back(block.address, block.endAddress);
+        symbolized = symbolize_blocks(opt.msdiaPath, exePath, *exe, blocks);
+    }
+
+    std::string out;
+    out += "{\n";
+    out += "  \"trace\": " + json_string(opt.tracePath) + ",\n";
+    out += "  \"exe\": " + json_string(exePath) + ",\n";
+    out += "  \"start_us\": " + std::to_string(start) + ",\n";
+    out += "  \"duration_us\": " + std::to_string(engine.lastTimestamp() - start) + ",\n";
+    out += "  \"chunks\": { \"total\": " + std::to_string(result.totalChunks) + ", \"scanned\": " + std::to_string(result.scannedChunks) + " },\n";
+    out += "  \"matched_events\": " + std::to_string(result.matchedEvents) + ",\n";
+
+    // 時刻はすべて最初のイベントからの相対値
+    out += "  \"blocks\": [";
+    std::map<std::pair<std::wstring, uint32_t>, LineHits> lineHits;
+    for (size_t i = 0; i < result.blocks.size(); ++i)
+    {
+        const auto& block = result.blocks[i];
+        out += (i == 0) ? "\n    { " : ",\n    { ";
+        if (exe && exe->inRange(block.address))
+        {
+            char rva[32];
+            std::snprintf(rva, sizeof(rva), "0x%llx", (unsigned long long)(block.address - exe->base));
+            out += "\"rva\": " + json_string(rva);
+        }
+        else
+        {
+            char address[32];
+            std::snprintf(address, sizeof(address), "0x%llx", (unsigned long long)block.address);
+            out += "\"address\": " + json_string(address);
+        }
+        out += ", \"hits\": " + std::to_string(block.hitCount);
+        out += ", \"first_us\": " + std::to_string(block.firstTimestamp - start);
+        out += ", \"last_us\": " + std::to_string(block.lastTimestamp - start);
+        out += ", \"first_tid\": " + std::to_string(block.firstThreadId);
+
+        const SymbolizedBlock& sym = symbolized[i];
+        if (sym.found)
+        {
+            // 行は 1 始まりで出す
+            out += ", \"file\": " + json_string(narrow(sym.file));
+            out += ", \"begin_line\": " + std::to_string(sym.beginLine + 1);
+            out += ", \"end_line\": " + std::to_string(sym.endLine + 1);
+
+            LineHits& line = lineHits[{ sym.file, sym.beginLine }];
+            line.endLine = std::max(line.endLine, sym.endLine);
+            line.hitCount += block.hitCount;
+            line.firstTimestamp = std::min(line.firstTimestamp, block.firstTimestamp);
+            line.lastTimestamp = std::max(line.lastTimestamp, block.lastTimestamp);
+        }
+        out += " }";
+    }
+    out += result.blocks.empty() ? "]" : "\n  ]";
+
+    if (opt.lines)
+    {
+        out += ",\n  \"lines\": [";
+        bool first = true;
+        for (const auto& [key, line] : lineHits)
+        {
+            out += first ? "\n    { " : ",\n    { ";
+            first = false;
+            out += "\"file\": " + json_string(narrow(key.first));
+            out += ", \"begin_line\": " + std::to_string(key.second + 1);
+            out += ", \"end_line\": " + std::to_string(line.endLine + 1);
+            out += ", \"hits\": " + std::to_string(line.hitCount);
+            out += ", \"first_us\": " + std::to_string(line.firstTimestamp - start);
+            out += ", \"last_us\": " + std::to_string(line.lastTimestamp - start);
+            out += " }";
+        }
+        out += lineHits.empty() ? "]" : "\n  ]";
+    }
+
+    out += "\n}\n";
+    std::fwrite(out.data(), 1, out.size(), stdout);
+    return 0;
+}
+
+// トレースならブロックのコストを集計して行 / 関数に解決し、.csv なら書き出したプロファイルをそのまま読む
+static bool load_profile(const std::string& path, const std::string& exeOverride, const std::wstring& msdiaPath, Profile& out)
+{
+    if (path.ends_with(".csv") || path.ends_with(".CSV"))
+    {
+        return out.readCsv(path);
+    }
+
+    TraceReader reader;
+    if (!reader.open(path)) return false;
+
+    TraceQueryEngine engine(reader);
+    const std::optional<TraceModule> exe = engine.exeModule();
+    if (!exe)
+    {
+        std::fprintf(stderr, "%s has no module events for the exe\n", path.c_str());
+        return false;
+    }
+
+    std::unordered_map<uint64_t, BlockCost> costs;
+    if (!CollectBlockCosts(reader, costs))
+    {
+        std::fprintf(stderr, "failed to read a chunk of %s\n", path.c_str());
+        return false;
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> blocks;
+    std::vector<const BlockCost*> blockCosts;
+    blocks.reserve(costs.size());
+    blockCosts.reserve(costs.size());
+    for (const auto& [address, cost] : costs)
+    {
+        blocks.emplace_back(address, cost.endAddress);
+        blockCosts.push_back(&cost);
+    }
+
+    const std::vector<SymbolizedBlock> symbolized = symbolize_blocks(msdiaPath, !exeOverride.empty() ? exeOverride : reader.exePath(), *exe, blocks);
+    for (size_t i = 0; i < blocks.size(); ++i)
+    {
+        const SymbolizedBlock& sym = symbolized[i];
+        if (!sym.found) continue;
+
+        ProfileEntry entry;
+        entry.file = narrow(sym.file);
+        entry.beginLine = sym.beginLine + 1;
+        entry.endLine = sym.endLine + 1;
+        entry.function = narrow(sym.function);
+        entry.hitCount = blockCosts[i]->hitCount;
+        entry.timeUs = blockCosts[i]->timeUs;
+        entry.instructions = blockCosts[i]->instructions();
+        out.add(entry);
+    }
+
+    return true;
+}
+
+struct ProfileOptions
+{
+    std::vector<std::string> inputs;
+    std::string outPath;
+    std::string exePathA, exePathB;
+    std::wstring msdiaPath = L"msdia140.dll";
+    size_t top = 50;
+};
+
+static bool parse_profile_options(int argc, const char* argv[], ProfileOptions& opt)
+{
+    for (int i = 2; i < argc; ++i)
+    {
+        const std::string_view arg = argv[i];
+        std::string_view value;
+        uint64_t n = 0;
+        if (option_value(arg, "--out", value)) opt.outPath = value;
+        else if (option_value(arg, "--exe", value) || option_value(arg, "--exe-a", value)) opt.exePathA = value;
+        else if (option_value(arg, "--exe-b", value)) opt.exePathB = value;
+        else if (option_value(arg, "--msdia", value)) opt.msdiaPath = widen(std::string(value));
+        else if (option_value(arg, "--top", value) && parse_u64(value, n)) opt.top = (size_t)n;
+        else if (!arg.starts_with("--")) opt.inputs.emplace_back(arg);
+        else
+        {
+            std::fprintf(stderr, "unknown option: %s\n", argv[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+static int run_profile(const ProfileOptions& opt)
+{
+    Profile profile;
+    if (!load_profile(opt.inputs[0], opt.exePathA, opt.msdiaPath, profile))
+    {
+        std::fprintf(stderr, "failed to load %s\n", opt.inputs[0].c_str());
+        return 2;
+    }
+
+    if (!profile.writeCsv(opt.outPath))
+    {
+        std::fprintf(stderr, "failed to write %s\n", opt.outPath.c_str());
+        return 2;
+    }
+    return 0;
+}
+
+static void append_diff_rows(std::string& out, const char* name, const std::vector<DiffRow>& rows, size_t top, bool withLine)
+{
+    out += "  \"";
+    out += name;
+    out += "\": [";
+    const size_t count = std::min(rows.size(), top);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const DiffRow& row = rows[i];
+        out += (i == 0) ? "\n    { " : ",\n    { ";
+        out += "\"file\": " + json_string(row.file);
+        if (withLine) out += ", \"line\": " + std::to_string(row.line);
+        out += ", \"function\": " + json_string(row.function);
+        out += ", \"hits_a\": " + std::to_string(row.hitsA);
+        out += ", \"hits_b\": " + std::to_string(row.hitsB);
+        out += ", \"delta_hits\": " + std::to_string(row.deltaHits());
+        out += ", \"time_a_us\": " + std::to_string(row.timeA);
+        out += ", \"time_b_us\": " + std::to_string(row.timeB);
+        out += ", \"delta_time_us\": " + std::to_string(row.deltaTime());
+        out += ", \"instructions_a\": " + std::to_string(row.instructionsA);
+        out += ", \"instructions_b\": " + std::to_string(row.instructionsB);
+        out += ", \"delta_instructions\": " + std::to_string(row.deltaInstructions());
+        out += " }";
+    }
+    out += (count == 0) ? "]" : "\n  ]";
+}
+
+static int run_diff(const ProfileOptions& opt)
+{
+    Profile a, b;
+    if (!load_profile(opt.inputs[0], opt.exePathA, opt.msdiaPath, a))
+    {
+        std::fprintf(stderr, "failed to load %s\n", opt.inputs[0].c_str());
+        return 2;
+    }
+    if (!load_profile(opt.inputs[1], opt.exePathB, opt.msdiaPath, b))
+    {
+        std::fprintf(stderr, "failed to load %s\n", opt.inputs[1].c_str());
+        return 2;
+    }
+
+    const ProfileDiff diff = DiffProfiles(a, b);
+
+    // 変化の大きい順に上位 top 件
+    std::string out;
+    out += "{\n";
+    out += "  \"a\": " + json_string(opt.inputs[0]) + ",\n";
+    out += "  \"b\": " + json_string(opt.inputs[1]) + ",\n";
+    append_diff_rows(out, "functions", diff.functions, opt.top, false);
+    out += ",\n";
+    append_diff_rows(out, "lines", diff.lines, opt.top, true);
+    out += "\n}\n";
+    std::fwrite(out.data(), 1, out.size(), stdout);
+    return 0;
+}
+
+struct MemOptions
+{
+    std::string tracePath;
+    CacheConfig cache;
+    size_t top = 50;
+    std::string exePath;
+    std::wstring msdiaPath = L"msdia140.dll";
+};
+
+static bool parse_mem_options(int argc, const char* argv[], MemOptions& opt)
+{
+    for (int i = 2; i < argc; ++i)
+    {
+        const std::string_view arg = argv[i];
+        std::string_view value;
+        uint64_t n = 0;
+        if (option_value(arg, "--top", value) && parse_u64(value, n)) opt.top = (size_t)n;
+        else if (option_value(arg, "--line-size", value) && parse_u64(value, n) && 0 < n) opt.cache.lineSize = (uint32_t)n;
+        else if (option_value(arg, "--sets", value) && parse_u64(value, n) && 0 < n) opt.cache.sets = (uint32_t)n;
+        else if (option_value(arg, "--ways", value) && parse_u64(value, n) && 0 < n) opt.cache.ways = (uint32_t)n;
+        else if (option_value(arg, "--exe", value)) opt.exePath = value;
+        else if (option_value(arg, "--msdia", value)) opt.msdiaPath = widen(std::string(value));
+        else if (!arg.starts_with("--") && opt.tracePath.empty()) opt.tracePath = arg;
+        else
+        {
+            std::fprintf(stderr, "unknown option: %s\n", argv[i]);
+            return false;
+        }
+    }
+    return !opt.tracePath.empty();
+}
+
+static void append_mem_stats(std::string& out, const MemAccessStats& stats)
+{
+    const uint64_t accesses = stats.reads + stats.writes;
+    char missRate[32];
+    std::snprintf(missRate, sizeof(missRate), "%.4f", (0 < accesses) ? (double)stats.misses / accesses : 0.0);
+
+    out += "\"reads\": " + std::to_string(stats.reads);
+    out += ", \"writes\": " + std::to_string(stats.writes);
+    out += ", \"misses\": " + std::to_string(stats.misses);
+    out += ", \"miss_rate\": ";
+    out += missRate;
+
+    // log2 の i 番目は再利用距離が [2^(i-1), 2^i) のアクセス数（0 番目は距離 0）。末尾の 0 は省く
+    size_t bucketCount = ReuseHistogram::BucketCount;
+    while (0 < bucketCount && stats.reuse.buckets[bucketCount - 1] == 0) --bucketCount;
+    out += ", \"reuse\": { \"cold\": " + std::to_string(stats.reuse.cold) + ", \"log2\": [";
+    for (size_t i = 0; i < bucketCount; ++i)
+    {
+        if (i != 0) out += ", ";
+        out += std::to_string(stats.reuse.buckets[i]);
+    }
+    out += "] }";
+}
+
+// ロード / ストアを行に解決し、キャッシュミスの多い順に出す
+static int run_mem(const MemOptions& opt)
+{
+    TraceReader reader;
+    if (!reader.open(opt.tracePath))
+    {
+        std::fprintf(stderr, "failed to open %s\n", opt.tracePath.c_str());
+        return 2;
+    }
+
+    TraceQueryEngine engine(reader);
+    const std::optional<TraceModule> exe = engine.exeModule();
+    if (!exe)
+    {
+        std::fprintf(stderr, "%s has no module events for the exe\n", opt.tracePath.c_str());
+        return 2;
+    }
+
+    MemAnalysis analysis;
+    if (!AnalyzeMemoryAccesses(reader, analysis, opt.cache))
+    {
+        std::fprintf(stderr, "failed to read a chunk of %s\n", opt.tracePath.c_str());
+        return 2;
+    }
+    if (analysis.instructions.empty())
+    {
+        std::fprintf(stderr, "%s has no memory access events (record with --mem)\n", opt.tracePath.c_str());
+        return 2;
+    }
+
+    // 命令 1 つを 1 バイトのブロックとして解決する
+    std::vector<std::pair<uint64_t, uint64_t>> instructions;
+    std::vector<const MemAccessStats*> instructionStats;
+    instructions.reserve(analysis.instructions.size());
+    instructionStats.reserve(analysis.instructions.size());
+    for (const auto& [pc, stats] : analysis.instructions)
+    {
+        instructions.emplace_back(pc, pc + 1);
+        instructionStats.push_back(&stats);
+    }
+
+    const std::string exePath = !opt.exePath.empty() ? opt.exePath : reader.exePath();
+    const std::vector<SymbolizedBlock> symbolized = symbolize_blocks(opt.msdiaPath, exePath, *exe, instructions);
+
+    struct LineKey
+    {
+        std::wstring file;
+        uint32_t line;
+        std::wstring function;
+        auto operator<=>(const LineKey&) const = default;
+    };
+    std::map<LineKey, MemAccessStats> lineStats;
+    MemAccessStats outside;
+    for (size_t i = 0; i < instructions.size(); ++i)
+    {
+        const SymbolizedBlock& sym = symbolized[i];
+        if (sym.found)
+        {
+            lineStats[{ sym.file, sym.beginLine, sym.function }].merge(*instructionStats[i]);
+        }
+        else
+        {
+            outside.merge(*instructionStats[i]);
+        }
+    }
+
+    std::vector<std::pair<const LineKey*, const MemAccessStats*>> rows;
+    rows.reserve(lineStats.size());
+    for (const auto& [key, stats] : lineStats) rows.emplace_back(&key, &stats);
+    std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b)
+    {
+        if (a.second->misses != b.second->misses) return a.second->misses > b.second->misses;
+        return (a.second->reads + a.second->writes) > (b.second->reads + b.second->writes);
+    });
+
+    std::string out;
+    out += "{\n";
+    out += "  \"trace\": " + json_string(opt.tracePath) + ",\n";
+    out += "  \"exe\": " + json_string(exePath) + ",\n";
+    out += "  \"cache\": { \"line_size\": " + std::to_string(opt.cache.lineSize) + ", \"sets\": " + std::to_string(opt.cache.sets) + ", \"ways\": " + std::to_string(opt.cache.ways) + " },\n";
+    out += "  \"total\": { ";
+    append_mem_stats(out, analysis.total);
+    out += " },\n";
+    out += "  \"outside_exe\": { ";
+    append_mem_stats(out, outside);
+    out += " },\n";
+
+    // 行は 1 始まりで出す
+    out += "  \"lines\": [";
+    const size_t count = std::min(rows.size(), opt.top);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const auto& [key, stats] = rows[i];
+        out += (i == 0) ? "\n    { " : ",\n    { ";
+        out += "\"file\": " + json_string(narrow(key->file));
+        out += ", \"line\": " + std::to_string(key->line + 1);
+        out += ", \"function\": " + json_string(narrow(key->function));
+        out += ", ";
+        append_mem_stats(out, *stats);
+        out += " }";
+    }
+    out += (count == 0) ? "]" : "\n  ]";
+    out += "\n}\n";
+    std::fwrite(out.data(), 1, out.size(), stdout);
+    return 0;
+}
+
+struct HitsOptions
+{
+    std::string tracePath;
+    std::optional<uint64_t> from, to;
+    std::optional<uint32_t> tid;
+    size_t top = 50;
+};
+
+static bool parse_hits_options(int argc, const char* argv[], HitsOptions& opt)
+{
+    for (int i = 2; i < argc; ++i)
+    {
+        const std::string_view arg = argv[i];
+        std::string_view value;
+        uint64_t n = 0;
+        if (option_value(arg, "--from", value) && parse_u64(value, n)) opt.from = n;
+        else if (option_value(arg, "--to", value) && parse_u64(value, n)) opt.to = n;
+        else if (option_value(arg, "--tid", value) && parse_u64(value, n)) opt.tid = (uint32_t)n;
+        else if (option_value(arg, "--top", value) && parse_u64(value, n)) opt.top = (size_t)n;
+        else if (!arg.starts_with("--") && opt.tracePath.empty()) opt.tracePath = arg;
+        else
+        {
+            std::fprintf(stderr, "unknown option: %s\n", argv[i]);
+            return false;
+        }
+    }
+    if (opt.from && opt.to && *opt.to <= *opt.from)
+    {
+        std::fprintf(stderr, "--to must be greater than --from\n");
+        return false;
+    }
+    return !opt.tracePath.empty();
+}
+
+// 列に読み込んでからヒット数を数え、多い順に出す（読み込みと集計の時間も出す）
+static int run_hits(const HitsOptions& opt)
+{
+    TraceReader reader;
+    if (!reader.open(opt.tracePath))
+    {
+        std::fprintf(stderr, "failed to open %s\n", opt.tracePath.c_str());
+        return 2;
+    }
+
+    TraceQueryEngine engine(reader);
+    const std::optional<TraceModule> exe = engine.exeModule();
+
+    const auto loadStart = std::chrono::steady_clock::now();
+    EventColumnStore store;
+    if (!LoadEventColumns(reader, store))
+    {
+        std::fprintf(stderr, "failed to read a chunk of %s\n", opt.tracePath.c_str());
+        return 2;
+    }
+    const auto countStart = std::chrono::steady_clock::now();
+
+    const uint64_t start = store.firstTimestamp();
+    ColumnHitQuery query;
+    query.beginTimestamp = opt.from ? start + *opt.from : 0;
+    query.endTimestamp = opt.to ? start + *opt.to : UINT64_MAX;
+    query.threadId = opt.tid;
+    const ColumnHitResult result = CountBlockHits(store, query);
+    const auto countEnd = std::chrono::steady_clock::now();
+
+    std::vector<uint32_t> ids;
+    for (uint32_t id = 0; id < result.hitCounts.size(); ++id)
+    {
+        if (result.hitCounts[id] != 0) ids.push_back(id);
+    }
+    const size_t count = std::min(ids.size(), opt.top);
+    std::partial_sort(ids.begin(), ids.begin() + count, ids.end(),
+        [&](uint32_t a, uint32_t b) { return result.hitCounts[a] > result.hitCounts[b]; });
+
+    const double loadSeconds = std::chrono::duration<double>(countStart - loadStart).count();
+    const double countSeconds = std::chrono::duration<double>(countEnd - countStart).count();
+    char rates[128];
+    std::snprintf(rates, sizeof(rates), "\"load_s\": %.6f, \"count_s\": %.6f, \"count_events_per_s\": %.0f",
+        loadSeconds, countSeconds, (0 < countSeconds) ? store.eventCount() / countSeconds : 0.0);
+
+    std::string out;
+    out += "{\n";
+    out += "  \"trace\": " + json_string(opt.tracePath) + ",\n";
+    out += "  \"start_us\": " + std::to_string(start) + ",\n";
+    out += "  \"events\": " + std::to_string(store.eventCount()) + ",\n";
+    out += "  \"batches\": { \"total\": " + std::to_string(result.totalBatches) + ", \"scanned\": " + std::to_string(result.scannedBatches) + " },\n";
+    out += "  \"matched_events\": " + std::to_string(result.matchedEvents) + ",\n";
+    out += std::string("  \"timing\": { ") + rates + " },\n";
+    out += std::string("  \"avx2\": ") + (event_columns::HasAvx2() ? "true" : "false") + ",\n";
+    out += "  \"blocks\": [";
+    for (size_t i = 0; i < count; ++i)
+    {
+        const uint32_t id = ids[i];
+        const uint64_t address = store.blockAddress(id);
+        out += (i == 0) ? "\n    { " : ",\n    { ";
+        char text[32];
+        if (exe && exe->inRange(address))
+        {
+            std::snprintf(text, sizeof(text), "0x%llx", (unsigned long long)(address - exe->base));
+            out += "\"rva\": " + json_string(text);
+        }
+        else
+        {
+            std::snprintf(text, sizeof(text), "0x%llx", (unsigned long long)address);
+            out += "\"address\": " + json_string(text);
+        }
+        out += ", \"hits\": " + std::to_string(result.hitCounts[id]) + " }";
+    }
+    out += (count == 0) ? "]" : "\n  ]";
+    out += "\n}\n";
+    std::fwrite(out.data(), 1, out.size(), stdout);
+    return 0;
+}
+
+int main(int argc, const char* argv[])
+{
+    if (argc < 2)
+    {
+        print_usage();
+        return 1;
+    }
+
+    const std::string_view command = argv[1];
+    if (command == "query")
+    {
+        QueryOptions opt;
+        if (!parse_query_options(argc, argv, opt))
+        {
+            print_usage();
+            return 1;
+        }
+        return run_query(opt);
+    }
+
+    if (command == "profile" || command == "diff")
+    {
+        ProfileOptions opt;
+        const size_t inputCount = (command == "diff") ? 2 : 1;
+        if (!parse_profile_options(argc, argv, opt) || opt.inputs.size() != inputCount || (command == "profile" && opt.outPath.empty()))
+        {
+            print_usage();
+            return 1;
+        }
+        return (command == "diff") ? run_diff(opt) : run_profile(opt);
+    }
+
+    if (command == "mem")
+    {
+        MemOptions opt;
+        if (!parse_mem_options(argc, argv, opt))
+        {
+            print_usage();
+            return 1;
+        }
+        return run_mem(opt);
+    }
+
+    if (command == "hits")
+    {
+        HitsOptions opt;
+        if (!parse_hits_options(argc, argv, opt))
+        {
+            print_usage();
+            return 1;
+        }
+        return run_hits(opt);
+    }
+
+    print_usage();
+    return 1;
+}
@@ -1,25 +1,29 @@
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <cwchar>
 #include <vector>
-#include <deque>
 #include <string>
 #include <atomic>
+#include <type_traits>
+#include <unordered_map>
 
 #include "dr_api.h"
 #include "drmgr.h"
+#include "drreg.h"
+#include "drutil.h"
 
 #ifdef _WIN32
+#  include <winsock2.h>
+#  include <ws2tcpip.h>
+#  include <afunix.h>
 #  include <windows.h>
 #endif
 
 #include "../trace_common.hpp"
 
-struct PendingData
-{
-    ModEvent data;
-    std::string modulePath;
-};
-
 static inline bool spsc_push(RingHeader* h, EventArgs* buf, const EventArgs& v)
 {
     const uint32_t cap = h->capacity;
@@ -42,37 +46,84 @@ static inline bool spsc_pop(RingHeader* h, Command* buf, Command& out)
     return true;
 }
 
-static std::deque<PendingData> g_pendingq;
 static ShmLayout* g_shm = nullptr;
-static uint16_t g_charStart = 0;
+static std::atomic<uint32_t> g_charStart = 0;
+
+// イベントのリングに書くスレッドは 1 つではない（アプリのスレッドごとの on_bb とメモリアクセスの送信、ブロックを翻訳したスレッドの BlockDefine、モジュールの読み込み）
+// リングは書き手が 1 つの前提なので、書き手どうしはこのスピンロックで順番にする（読み手の側はそのまま）
+static std::atomic_flag g_event_push_lock = ATOMIC_FLAG_INIT;
+
+struct EventPushLock
+{
+    EventPushLock()
+    {
+        while (g_event_push_lock.test_and_set(std::memory_order_acquire))
+        {
+            YieldProcessor();
+        }
+    }
+
+    ~EventPushLock()
+    {
+        g_event_push_lock.clear(std::memory_order_release);
+    }
+};
+
+static inline bool push_event(const EventArgs& v)
+{
+    EventPushLock lock;
+    return spsc_push(&g_shm->eventHeader, g_shm->eventBuffer, v);
+}
 static HANDLE g_hMap = nullptr;
-static HANDLE g_evt_a2b = nullptr; // DR→Viewer
+static HANDLE g_hSessionMap = nullptr;
+static HANDLE g_evt_a2b = nullptr; // DR→Viewer（接続完了）
 static HANDLE g_evt_b2a = nullptr; // Viewer→DR
 
-static void ipc_init(const wchar_t* channelNameOpt)
+// セッションとチャンネルはビューアが起動前に作って初期化してあるので、番号を取って開き、登録して知らせるだけ
+// drrun は子プロセスにも同じ引数でクライアントを入れるので、子プロセスはここで次の番号を取る
+static void ipc_init(const wchar_t* sessionNameOpt)
 {
-    const uint32_t pid = dr_get_process_id();
+    if (!sessionNameOpt) { dr_printf("bbtrace-ipc: no channel\n"); return; }
 
-    g_hMap = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)sizeof(ShmLayout), channelNameOpt);
-    DWORD map_err = GetLastError();
-    if (!g_hMap) { dr_printf("CFM failed: %lu\n", GetLastError()); return; }
+    g_hSessionMap = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, sessionNameOpt);
+    if (!g_hSessionMap) { dr_printf("OFM(session) failed: %lu\n", GetLastError()); return; }
 
-    void* base = MapViewOfFile(g_hMap, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(ShmLayout));
-    if (!base) { dr_printf("MVF failed: %lu\n", GetLastError()); return; }
-    g_shm = (ShmLayout*)base;
+    auto* session = (SessionDirectory*)MapViewOfFile(g_hSessionMap, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(SessionDirectory));
+    if (!session) { dr_printf("MVF(session) failed: %lu\n", GetLastError()); return; }
+    if (session->magic != SessionMagic) { dr_printf("bbtrace-ipc: session header mismatch\n"); UnmapViewOfFile(session); return; }
 
-    if (map_err != ERROR_ALREADY_EXISTS)
+    const uint32_t slot = (uint32_t)InterlockedIncrement((volatile LONG*)&session->claimedCount) - 1;
+    if (session->maxProcesses <= slot)
     {
-        memset(g_shm, 0, sizeof(*g_shm));
-        g_shm->header.magic = 0x52544252;
-        g_shm->header.channel = (channelNameOpt[0] << 16) + channelNameOpt[1];
-        g_shm->header.pid = pid;
-        g_shm->header.eventsCapacity = 1u << 15;
-        g_shm->header.commandsCapacity = 1024;
-        g_shm->eventHeader.capacity = 1u << 15;
-        g_shm->commandHeader.capacity = 1024;
-        g_charStart = 0;
+        dr_printf("bbtrace-ipc: too many processes in the session, pid=%d is not traced\n", dr_get_process_id());
+        UnmapViewOfFile(session);
+        return;
     }
+
+    wchar_t channelName[160];
+    swprintf_s(channelName, SessionChannelFormat, sessionNameOpt, slot);
+    g_hMap = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, channelName);
+    if (!g_hMap) { dr_printf("OFM failed: %lu\n", GetLastError()); UnmapViewOfFile(session); return; }
+
+    void* base = MapViewOfFile(g_hMap, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(ShmLayout));
+    if (!base) { dr_printf("MVF failed: %lu\n", GetLastError()); UnmapViewOfFile(session); return; }
+
+    ShmLayout* shm = (ShmLayout*)base;
+    if (shm->header.magic != ShmMagic) { dr_printf("bbtrace-ipc: shm header mismatch\n"); UnmapViewOfFile(base); UnmapViewOfFile(session); return; }
+
+    shm->header.pid = dr_get_process_id();
+    g_shm = shm;
+
+    // pid を書いてから Ready にする
+    session->entries[slot].pid = dr_get_process_id();
+    _ReadWriteBarrier();
+    InterlockedExchange((volatile LONG*)&session->entries[slot].state, SessionEntryReady);
+    UnmapViewOfFile(session);
+
+    const std::wstring readyName = std::wstring(sessionNameOpt) + ShmReadyEventSuffix;
+    g_evt_a2b = OpenEventW(EVENT_MODIFY_STATE, FALSE, readyName.c_str());
+    if (g_evt_a2b) { SetEvent(g_evt_a2b); }
+    dr_printf("bbtrace-ipc: channel %u (pid=%d)\n", slot, dr_get_process_id());
 }
 
 static void ipc_close() {
@@ -80,6 +131,213 @@ static void ipc_close() {
     if (g_evt_b2a) { CloseHandle(g_evt_b2a); g_evt_b2a = nullptr; }
     if (g_shm)     { UnmapViewOfFile(g_shm);  g_shm = nullptr; }
     if (g_hMap)    { CloseHandle(g_hMap);     g_hMap = nullptr; }
+    if (g_hSessionMap) { CloseHandle(g_hSessionMap); g_hSessionMap = nullptr; }
+}
+
+/////////////////////////////////////
+// コレクタへの送信（--collector=tcp:host:port / --collector=unix:path）
+//
+// 共有メモリの代わりにプロセス内に ShmLayout を置き、イベントはこれまでと同じリングに積む
+// 送信スレッドがリングに溜まった分を 1 つのチャンクにまとめ、リングの領域をそのまま WSASend に渡す（折り返しで 2 区間）
+// パスだけは ModuleAdd のたびにチャンク用に詰め直す（まれなので）
+
+// 溜まった数が StreamMinBatch に満たないうちは、前回から StreamMaxDelayMs 経つまで送らない
+static constexpr uint32_t StreamMinBatch = 4096;
+static constexpr uint32_t StreamMaxDelayMs = 5;
+
+static char g_collector[256];
+static SOCKET g_stream_socket = INVALID_SOCKET;
+static void* g_stream_lock = nullptr;
+static uint64_t g_stream_last_send_ms = 0;
+static std::string g_stream_paths;
+
+static bool send_all(SOCKET s, WSABUF* bufs, DWORD count)
+{
+    DWORD total = 0;
+    for (DWORD i = 0; i < count; ++i) total += bufs[i].len;
+
+    // ブロッキングのソケットなので、エラーでなければ全部送られる
+    DWORD sent = 0;
+    return WSASend(s, bufs, count, &sent, 0, nullptr, nullptr) == 0 && sent == total;
+}
+
+static bool stream_connect(const char* spec)
+{
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return false;
+
+    if (strncmp(spec, "unix:", 5) == 0)
+    {
+        SOCKADDR_UN addr = {};
+        addr.sun_family = AF_UNIX;
+        if (sizeof(addr.sun_path) <= strlen(spec + 5)) return false;
+        strcpy_s(addr.sun_path, spec + 5);
+
+        g_stream_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (g_stream_socket == INVALID_SOCKET) return false;
+        if (connect(g_stream_socket, (const sockaddr*)&addr, sizeof(addr)) != 0)
+        {
+            closesocket(g_stream_socket);
+            g_stream_socket = INVALID_SOCKET;
+            return false;
+        }
+    }
+    else
+    {
+        // tcp:host:port（tcp: は省略できる）
+        std::string hostPort(strncmp(spec, "tcp:", 4) == 0 ? spec + 4 : spec);
+        const size_t colon = hostPort.rfind(':');
+        if (colon == std::string::npos) return false;
+        const std::string host = hostPort.substr(0, colon);
+        const std::string port = hostPort.substr(colon + 1);
+
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* result = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0) return false;
+
+        for (addrinfo* ai = result; ai; ai = ai->ai_next)
+        {
+            g_stream_socket = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (g_stream_socket == INVALID_SOCKET) continue;
+            if (connect(g_stream_socket, ai->ai_addr, (int)ai->ai_addrlen) == 0) break;
+            closesocket(g_stream_socket);
+            g_stream_socket = INVALID_SOCKET;
+        }
+        freeaddrinfo(result);
+        if (g_stream_socket == INVALID_SOCKET) return false;
+
+        BOOL noDelay = TRUE;
+        setsockopt(g_stream_socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+    }
+
+    StreamHello hello = {};
+    hello.magic = StreamMagic;
+    hello.pid = (uint32_t)dr_get_process_id();
+    hello.eventSize = (uint32_t)sizeof(EventArgs);
+    WSABUF buf = { (ULONG)sizeof(hello), (CHAR*)&hello };
+    return send_all(g_stream_socket, &buf, 1);
+}
+
+static void stream_disconnect()
+{
+    if (g_stream_socket != INVALID_SOCKET)
+    {
+        shutdown(g_stream_socket, SD_SEND);
+        closesocket(g_stream_socket);
+        g_stream_socket = INVALID_SOCKET;
+    }
+}
+
+// リングに溜まった分を 1 チャンクで送り、送った数を返す（g_stream_lock の中で呼ぶ）
+static uint32_t stream_send_batch(bool force)
+{
+    RingHeader* h = &g_shm->eventHeader;
+    const uint32_t cap = h->capacity;
+    const uint32_t w = h->writeIndex;
+    _ReadWriteBarrier();
+    const uint32_t r = h->readIndex;
+
+    const uint32_t count = (w - r) & (cap - 1);
+    if (count == 0) return 0;
+    if (!force && count < StreamMinBatch && dr_get_milliseconds() - g_stream_last_send_ms < StreamMaxDelayMs) return 0;
+
+    const uint32_t first = std::min(count, cap - r);
+    const uint32_t second = count - first;
+
+    g_stream_paths.clear();
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const EventArgs& ev = g_shm->eventBuffer[(r + i) & (cap - 1)];
+        if (ev.type == ModuleAdd)
+        {
+            g_stream_paths.append(g_shm->strBuffer + ev.mod.pathIndex, ev.mod.path_len);
+        }
+    }
+
+    StreamChunkHeader header = {};
+    header.eventCount = count;
+    header.stringSize = (uint32_t)g_stream_paths.size();
+    header.payloadSize = count * (uint32_t)sizeof(EventArgs) + header.stringSize;
+    header.droppedCount = h->droppedCount;
+
+    WSABUF bufs[4] = {
+        { (ULONG)sizeof(header), (CHAR*)&header },
+        { first * (ULONG)sizeof(EventArgs), (CHAR*)&g_shm->eventBuffer[r] },
+        { second * (ULONG)sizeof(EventArgs), (CHAR*)&g_shm->eventBuffer[0] },
+        { (ULONG)g_stream_paths.size(), (CHAR*)g_stream_paths.data() },
+    };
+    if (!send_all(g_stream_socket, bufs, 4))
+    {
+        dr_printf("bbtrace-ipc: collector send failed: %d\n", WSAGetLastError());
+        stream_disconnect();
+        return 0;
+    }
+
+    // 送り終えてから領域を返す
+    _ReadWriteBarrier();
+    h->readIndex = w;
+    g_stream_last_send_ms = dr_get_milliseconds();
+    return count;
+}
+
+static void stream_loop(void*)
+{
+    for (;;)
+    {
+        dr_mutex_lock(g_stream_lock);
+        const bool connected = (g_stream_socket != INVALID_SOCKET);
+        const uint32_t sent = connected ? stream_send_batch(false) : 0;
+        dr_mutex_unlock(g_stream_lock);
+
+        if (!connected) break;
+        if (sent < StreamMinBatch) dr_sleep(1);
+    }
+}
+
+// 受け手のいない ShmLayout をプロセス内に置いて、送信スレッドを受け手にする
+static void stream_init(const char* spec)
+{
+    auto* shm = (ShmLayout*)dr_global_alloc(sizeof(ShmLayout));
+    memset(shm, 0, sizeof(ShmLayout));
+    shm->header.magic = ShmMagic;
+    shm->header.pid = dr_get_process_id();
+    shm->header.eventsCapacity = (uint32_t)std::size(shm->eventBuffer);
+    shm->header.commandsCapacity = (uint32_t)std::size(shm->commandBuffer);
+    shm->eventHeader.capacity = shm->header.eventsCapacity;
+    shm->commandHeader.capacity = shm->header.commandsCapacity;
+
+    g_stream_lock = dr_mutex_create();
+    if (!stream_connect(spec))
+    {
+        dr_printf("bbtrace-ipc: failed to connect to the collector %s\n", spec);
+        stream_disconnect();
+        dr_global_free(shm, sizeof(ShmLayout));
+        return;
+    }
+
+    g_shm = shm;
+    dr_printf("bbtrace-ipc: streaming to %s\n", spec);
+}
+
+// 残りを送り切ってから閉じる
+static void stream_close()
+{
+    if (!g_stream_lock) return;
+
+    dr_mutex_lock(g_stream_lock);
+    while (g_stream_socket != INVALID_SOCKET && stream_send_batch(true) != 0) {}
+    stream_disconnect();
+    dr_mutex_unlock(g_stream_lock);
+
+    if (g_shm)
+    {
+        ShmLayout* shm = g_shm;
+        g_shm = nullptr;
+        dr_global_free(shm, sizeof(ShmLayout));
+    }
+    WSACleanup();
 }
 
 static void apply_command(const Command& c)
@@ -99,35 +357,354 @@ static void cmd_loop(void*)
     }
 }
 
-static volatile int g_ipc_ready = 0;
 static size_t g_send_count = 0;
 
-static void on_bb(void* drcontext, app_pc start, void* tag, app_pc end)
+/////////////////////////////////////
+// 上位 K ブロックの検出
+
+// ブロックごとの回数を固定個のカウンタで近似する（Space-Saving）
+// カウンタが埋まっているときに新しいブロックが来たら最小のカウンタを奪い、その回数を error に残す
+// counters は count の最小ヒープで、最小のカウンタは先頭にある（index はアドレス -> ヒープ内の位置）
+struct SpaceSaving
 {
-    if (!g_ipc_ready)
+    struct Counter
     {
-        return;
+        uint64_t address;
+        uint64_t endAddress;
+        uint64_t count;
+        uint64_t error;
+    };
+
+    explicit SpaceSaving(size_t capacity_) : capacity(capacity_)
+    {
+        counters.reserve(capacity);
+        index.reserve(capacity * 2);
+    }
+
+    void add(uint64_t address, uint64_t endAddress, uint64_t count, uint64_t error)
+    {
+        auto it = index.find(address);
+        if (it != index.end())
+        {
+            Counter& c = counters[it->second];
+            c.count += count;
+            c.error += error;
+            sift_down(it->second);
+            return;
+        }
+
+        if (counters.size() < capacity)
+        {
+            index.emplace(address, counters.size());
+            counters.push_back(Counter{ address, endAddress, count, error });
+            sift_up(counters.size() - 1);
+            return;
+        }
+
+        // 表のノードは作り直さずにキーだけ差し替える
+        Counter& c = counters[0];
+        auto node = index.extract(c.address);
+        node.key() = address;
+        index.insert(std::move(node));
+        c = Counter{ address, endAddress, c.count + count, c.count + error };
+        sift_down(0);
     }
 
-    while (!g_pendingq.empty())
+    void clear()
     {
-        auto modData = g_pendingq.front();
-        g_pendingq.pop_front();
+        counters.clear();
+        index.clear();
+    }
+
+    void swap_counters(size_t a, size_t b)
+    {
+        std::swap(counters[a], counters[b]);
+        index[counters[a].address] = a;
+        index[counters[b].address] = b;
+    }
+
+    void sift_up(size_t i)
+    {
+        while (0 < i && counters[i].count < counters[(i - 1) / 2].count)
+        {
+            swap_counters(i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
 
-        const auto currentIndex = modData.data.pathIndex;
-        dr_printf("bbtrace-ipc: on_bb sending on_module_load event deferred: %u\n", currentIndex);
+    void sift_down(size_t i)
+    {
+        for (;;)
         {
-            auto pp = g_shm->strBuffer + currentIndex;
-            //strcpy_s(pp, modData.modulePath.size(), modData.modulePath.data());
-            strcpy(pp, modData.modulePath.data());
+            size_t smallest = i;
+            for (const size_t child : { i * 2 + 1, i * 2 + 2 })
+            {
+                if (child < counters.size() && counters[child].count < counters[smallest].count)
+                {
+                    smallest = child;
+                }
+            }
+            if (smallest == i)
+            {
+                return;
+            }
+            swap_counters(i, smallest);
+            i = smallest;
         }
+    }
+
+    size_t capacity;
+    std::vector<Counter> counters;
+    std::unordered_map<uint64_t, size_t> index;
+};
+
+// スレッドごとのスケッチ。HotMergeInterval 回ごとか HotMergePeriodMs ごとに全体のスケッチへ足して空にする
+struct ThreadSketch
+{
+    SpaceSaving sketch{ 256 };
+    uint32_t hits = 0;
+    uint64_t lastMergeMs = 0;
+};
+
+static constexpr uint32_t HotMergeInterval = 4096;
+static constexpr uint64_t HotMergePeriodMs = 50;
+
+static int g_tls_index = -1;
+static void* g_hot_lock = nullptr;
+static SpaceSaving g_hot_blocks{ 1024 };
+static uint64_t g_hot_total = 0;
+static bool g_topk_only = false;
+
+// 全体のスケッチの上位を共有メモリに書く（g_hot_lock を持って呼ぶ）
+static void publish_hot_blocks()
+{
+    HotBlockTable& table = g_shm->hotBlocks;
+
+    SpaceSaving::Counter top[std::extent_v<decltype(HotBlockTable::entries)>];
+    const size_t n = (size_t)(std::partial_sort_copy(g_hot_blocks.counters.begin(), g_hot_blocks.counters.end(), std::begin(top), std::end(top),
+        [](const SpaceSaving::Counter& a, const SpaceSaving::Counter& b) { return a.count > b.count; }) - std::begin(top));
+
+    table.sequence = table.sequence + 1;
+    _ReadWriteBarrier();
+    for (size_t i = 0; i < n; ++i)
+    {
+        table.entries[i] = HotBlockEntry{ top[i].address, top[i].endAddress, top[i].count, top[i].error };
+    }
+    table.count = (uint32_t)n;
+    table.totalHits = g_hot_total;
+    _ReadWriteBarrier();
+    table.sequence = table.sequence + 1;
+}
+
+static void merge_hot_blocks(ThreadSketch* state)
+{
+    if (state->hits == 0)
+    {
+        return;
+    }
 
+    dr_mutex_lock(g_hot_lock);
+    for (const auto& c : state->sketch.counters)
+    {
+        g_hot_blocks.add(c.address, c.endAddress, c.count, c.error);
+    }
+    g_hot_total += state->hits;
+    if (g_shm)
+    {
+        publish_hot_blocks();
+    }
+    dr_mutex_unlock(g_hot_lock);
+
+    state->sketch.clear();
+    state->hits = 0;
+}
+
+/////////////////////////////////////
+// メモリアクセスのサンプリング（--mem[=N]）
+//
+// ロード / ストアごとに実効アドレスをスレッドごとのバッファへインラインで書き込み、
+// バッファが埋まりかけたらブロックの先頭（on_bb）で N 回に 1 回だけまとめて送る
+// 間引きはバッファ単位なので、送った区間の中ではアクセスが連続している
+
+struct MemRef
+{
+    uint64_t pc;
+    uint64_t address;
+    uint32_t size;
+    uint32_t isWrite;
+};
+
+static constexpr size_t MemBufferSize = 16384;
+
+// 1 ブロックのアクセス数はこれを超えない前提で、残りがこれを切ったら送る
+static constexpr size_t MemBlockReserve = 4096;
+
+struct MemBuffer
+{
+    MemRef* ptr;
+    uint64_t flushCount;
+    MemRef refs[MemBufferSize];
+};
+
+static int g_mem_tls_index = -1;
+static uint32_t g_mem_sample = 0; // 0 なら計装しない
+
+static void flush_mem_refs(void* drcontext, MemBuffer* buffer)
+{
+    const bool sampled = (buffer->flushCount++ % g_mem_sample) == 0;
+    if (sampled && g_shm && !g_topk_only)
+    {
         EventArgs data;
-        data.type = EventType::ModuleAdd;
-        data.mod = modData.data;
-        spsc_push(&g_shm->eventHeader, g_shm->eventBuffer, data);
+        data.type = MemoryAccess;
+        data.mem.pid = dr_get_process_id();
+        data.mem.tid = (uint32_t)dr_get_thread_id(drcontext);
+
+        // バッファ 1 つ分はまとめて書く
+        EventPushLock lock;
+        for (const MemRef* ref = buffer->refs; ref < buffer->ptr; ++ref)
+        {
+            data.mem.app_pc = ref->pc;
+            data.mem.address = ref->address;
+            data.mem.size = ref->size;
+            data.mem.isWrite = ref->isWrite;
+            spsc_push(&g_shm->eventHeader, g_shm->eventBuffer, data);
+        }
+    }
+    buffer->ptr = buffer->refs;
+}
+
+// where の前に、ref の実効アドレスを MemBuffer::ptr へ書いて ptr を進めるコードを入れる
+static void insert_save_mem_ref(void* drcontext, instrlist_t* bb, instr_t* where, opnd_t ref, app_pc pc, bool isWrite)
+{
+    reg_id_t reg_ptr, reg_tmp;
+    if (drreg_reserve_register(drcontext, bb, where, nullptr, &reg_ptr) != DRREG_SUCCESS ||
+        drreg_reserve_register(drcontext, bb, where, nullptr, &reg_tmp) != DRREG_SUCCESS)
+    {
+        DR_ASSERT(false);
+        return;
+    }
+
+    // reg_tmp = 実効アドレス
+    drutil_insert_get_mem_addr(drcontext, bb, where, ref, reg_tmp, reg_ptr);
+
+    // reg_ptr = 書き込み位置
+    drmgr_insert_read_tls_field(drcontext, g_mem_tls_index, bb, where, reg_ptr);
+    instrlist_meta_preinsert(bb, where, XINST_CREATE_load(drcontext, opnd_create_reg(reg_ptr),
+        OPND_CREATE_MEMPTR(reg_ptr, offsetof(MemBuffer, ptr))));
+
+    instrlist_meta_preinsert(bb, where, XINST_CREATE_store(drcontext,
+        OPND_CREATE_MEMPTR(reg_ptr, offsetof(MemRef, address)), opnd_create_reg(reg_tmp)));
+    instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)pc, opnd_create_reg(reg_tmp), bb, where, nullptr, nullptr);
+    instrlist_meta_preinsert(bb, where, XINST_CREATE_store(drcontext,
+        OPND_CREATE_MEMPTR(reg_ptr, offsetof(MemRef, pc)), opnd_create_reg(reg_tmp)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_st(drcontext,
+        OPND_CREATE_MEM32(reg_ptr, offsetof(MemRef, size)), OPND_CREATE_INT32((int)drutil_opnd_mem_size_in_bytes(ref, where))));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_mov_st(drcontext,
+        OPND_CREATE_MEM32(reg_ptr, offsetof(MemRef, isWrite)), OPND_CREATE_INT32(isWrite ? 1 : 0)));
+
+    // ptr を進める（フラグを壊さないように lea で）
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_lea(drcontext, opnd_create_reg(reg_ptr),
+        OPND_CREATE_MEM_lea(reg_ptr, DR_REG_NULL, 0, sizeof(MemRef))));
+    drmgr_insert_read_tls_field(drcontext, g_mem_tls_index, bb, where, reg_tmp);
+    instrlist_meta_preinsert(bb, where, XINST_CREATE_store(drcontext,
+        OPND_CREATE_MEMPTR(reg_tmp, offsetof(MemBuffer, ptr)), opnd_create_reg(reg_ptr)));
+
+    drreg_unreserve_register(drcontext, bb, where, reg_ptr);
+    drreg_unreserve_register(drcontext, bb, where, reg_tmp);
+}
+
+static void instrument_mem(void* drcontext, instrlist_t* bb, instr_t* where)
+{
+    if (!instr_reads_memory(where) && !instr_writes_memory(where))
+    {
+        return;
+    }
+
+    const app_pc pc = instr_get_app_pc(where);
+    for (int i = 0; i < instr_num_srcs(where); ++i)
+    {
+        if (opnd_is_memory_reference(instr_get_src(where, i)))
+        {
+            insert_save_mem_ref(drcontext, bb, where, instr_get_src(where, i), pc, false);
+        }
+    }
+    for (int i = 0; i < instr_num_dsts(where); ++i)
+    {
+        if (opnd_is_memory_reference(instr_get_dst(where, i)))
+        {
+            insert_save_mem_ref(drcontext, bb, where, instr_get_dst(where, i), pc, true);
+        }
+    }
+}
 
-        dr_printf("bbtrace-ipc: EventSlot send data : %d\n", data.type);
+static void on_thread_init(void* drcontext)
+{
+    drmgr_set_tls_field(drcontext, g_tls_index, new ThreadSketch());
+
+    if (g_mem_sample != 0)
+    {
+        auto* buffer = new MemBuffer();
+        buffer->ptr = buffer->refs;
+        buffer->flushCount = 0;
+        drmgr_set_tls_field(drcontext, g_mem_tls_index, buffer);
+    }
+}
+
+static void on_thread_exit(void* drcontext)
+{
+    auto* state = (ThreadSketch*)drmgr_get_tls_field(drcontext, g_tls_index);
+    if (state)
+    {
+        merge_hot_blocks(state);
+        delete state;
+        drmgr_set_tls_field(drcontext, g_tls_index, nullptr);
+    }
+
+    if (g_mem_sample != 0)
+    {
+        auto* buffer = (MemBuffer*)drmgr_get_tls_field(drcontext, g_mem_tls_index);
+        if (buffer)
+        {
+            flush_mem_refs(drcontext, buffer);
+            delete buffer;
+            drmgr_set_tls_field(drcontext, g_mem_tls_index, nullptr);
+        }
+    }
+}
+
+static void on_bb(void* drcontext, app_pc start, void* tag, app_pc end)
+{
+    // このブロックのアクセスが入りきらなくなる前に送る（接続していなくても捨てて空ける）
+    if (g_mem_sample != 0)
+    {
+        auto* buffer = (MemBuffer*)drmgr_get_tls_field(drcontext, g_mem_tls_index);
+        if (buffer && buffer->refs + (MemBufferSize - MemBlockReserve) <= buffer->ptr)
+        {
+            flush_mem_refs(drcontext, buffer);
+        }
+    }
+
+    if (!g_shm)
+    {
+        return;
+    }
+
+    if (auto* state = (ThreadSketch*)drmgr_get_tls_field(drcontext, g_tls_index))
+    {
+        state->sketch.add((uint64_t)start, (uint64_t)end, 1, 0);
+        ++state->hits;
+        if (HotMergeInterval <= state->hits ||
+            ((state->hits & 255) == 0 && HotMergePeriodMs <= dr_get_milliseconds() - state->lastMergeMs))
+        {
+            merge_hot_blocks(state);
+            state->lastMergeMs = dr_get_milliseconds();
+        }
+    }
+
+    // 上位 K だけのときはイベントを送らない
+    if (g_topk_only)
+    {
+        return;
     }
 
     BBEvent ev = {};
@@ -139,7 +716,7 @@ static void on_bb(void* drcontext, app_pc start, void* tag, app_pc end)
     EventArgs data;
     data.type = BasicBlockHit;
     data.bb = ev;
-    spsc_push(&g_shm->eventHeader, g_shm->eventBuffer, data);
+    push_event(data);
 }
 
 static app_pc g_exe_start = 0, g_exe_end = 0;
@@ -160,9 +737,34 @@ static bool is_user_module(app_pc pc) {
     return ok;
 }
 
+// ブロックの命令数と長さを送る（ブロックを翻訳し直したときはもう一度送る）
+// 翻訳したスレッドから送るので、on_bb と同じく push_event で他の書き手と順番にする
+static void send_block_define(void* drcontext, instrlist_t* bb, app_pc start, app_pc end)
+{
+    if (!g_shm || g_topk_only)
+    {
+        return;
+    }
+
+    EventArgs data;
+    data.type = BlockDefine;
+    data.block.pid = dr_get_process_id();
+    data.block.app_pc = (uint64_t)start;
+    data.block.app_pc_end = (uint64_t)end;
+    data.block.instructionCount = 0;
+    data.block.byteSize = 0;
+    for (instr_t* instr = instrlist_first_app(bb); instr; instr = instr_get_next_app(instr))
+    {
+        ++data.block.instructionCount;
+        data.block.byteSize += instr_length(drcontext, instr);
+    }
+
+    push_event(data);
+}
+
 static dr_emit_flags_t
-event_bb_insert(void* drcontext, void* tag, instrlist_t* bb, instr_t* /*where*/,
-                bool /*for_trace*/, bool /*translating*/, void* /*user*/)
+event_bb_insert(void* drcontext, void* tag, instrlist_t* bb, instr_t* where,
+                bool /*for_trace*/, bool translating, void* /*user*/)
 {
     instr_t* first = instrlist_first_app(bb);
     if (!first) return DR_EMIT_DEFAULT;
@@ -178,13 +780,29 @@ event_bb_insert(void* drcontext, void* tag, instrlist_t* bb, instr_t* /*where*/,
         return DR_EMIT_DEFAULT;
     }
 
-    app_pc end = instr_get_app_pc(last);
-    int len = instr_length(drcontext, last);
-    app_pc bb_end_excl = end + len;
+    // 挿入イベントは命令ごとに呼ばれるので、ブロックの開始は先頭の命令でだけ入れる
+    if (drmgr_is_first_instr(drcontext, where))
+    {
+        app_pc end = instr_get_app_pc(last);
+        int len = instr_length(drcontext, last);
+        app_pc bb_end_excl = end + len;
 
-    dr_insert_clean_call(drcontext, bb, instrlist_first(bb),
-                         (void*)on_bb, false, 4,
-        OPND_CREATE_INTPTR(drcontext), OPND_CREATE_INTPTR(start), OPND_CREATE_INTPTR(tag), OPND_CREATE_INTPTR(bb_end_excl));
+        dr_insert_clean_call(drcontext, bb, where,
+                             (void*)on_bb, false, 4,
+            OPND_CREATE_INTPTR(drcontext), OPND_CREATE_INTPTR(start), OPND_CREATE_INTPTR(tag), OPND_CREATE_INTPTR(bb_end_excl));
+
+        // 状態の復元のための再翻訳では送らない
+        if (!translating)
+        {
+            send_block_define(drcontext, bb, start, bb_end_excl);
+        }
+    }
+
+    // on_bb でバッファを空けてから、このブロックのアクセスを書く
+    if (g_mem_sample != 0 && instr_is_app(where))
+    {
+        instrument_mem(drcontext, bb, where);
+    }
     return DR_EMIT_DEFAULT;
 }
 
@@ -208,29 +826,29 @@ static void on_module_load(void* drcontext, const module_data_t* info, bool load
     ev.pid = (uint32_t)dr_get_process_id();
     ev.base = (uint64_t)info->start;
     ev.size = (uint64_t)((byte*)info->end - (byte*)info->start);
-    ev.path_len = 0; // まずは送らない（必要なら別経路）
-    EventArgs data;
-    data.type = ModuleAdd;
-    data.mod = ev;
+    ev.path_len = 0;
+    ev.pathIndex = 0;
 
     if (!g_shm)
     {
-        //dr_printf("bbtrace-ipc: on_module_load event dropped !! : g_shm==nullptr \n", base, size, info->full_path);
-        dr_printf("bbtrace-ipc: on_module_load event pending : g_shm==nullptr \n");
-
-        PendingData modData;
-        modData.data = data.mod;
-        modData.modulePath = std::string(info->full_path);
-        modData.data.pathIndex = g_charStart;
-        g_charStart += modData.modulePath.size() + 1;
-        modData.data.path_len = modData.modulePath.size();
-        g_pendingq.push_back(modData);
+        dr_printf("bbtrace-ipc: on_module_load event dropped : g_shm==nullptr \n");
+        return;
     }
-    else
+
+    // パスは文字列領域に詰めて書き、イベントには位置と長さだけを載せる（領域が尽きたらパスは送らない）
+    const uint32_t pathLen = (uint32_t)path.size();
+    const uint32_t pathIndex = g_charStart.fetch_add(pathLen + 1);
+    if (pathIndex + pathLen + 1 <= sizeof(g_shm->strBuffer))
     {
-        dr_printf("bbtrace-ipc: on_module_load event spsc_push : \n");
-        spsc_push(&g_shm->eventHeader, g_shm->eventBuffer, data);
+        memcpy(g_shm->strBuffer + pathIndex, path.c_str(), pathLen + 1);
+        ev.pathIndex = (uint16_t)pathIndex;
+        ev.path_len = pathLen;
     }
+
+    EventArgs data;
+    data.type = ModuleAdd;
+    data.mod = ev;
+    push_event(data);
 }
 
 static void on_module_unload(void* drcontext, const module_data_t* info)
@@ -240,16 +858,42 @@ static void on_module_unload(void* drcontext, const module_data_t* info)
 
 static void on_exit()
 {
+    if (g_collector[0])
+    {
+        stream_close();
+    }
     ipc_close();
+    drmgr_unregister_tls_field(g_tls_index);
+    dr_mutex_destroy(g_hot_lock);
+    if (g_mem_sample != 0)
+    {
+        drmgr_unregister_tls_field(g_mem_tls_index);
+        drutil_exit();
+        drreg_exit();
+    }
     drmgr_exit();
 }
 
 static wchar_t g_channelW[128];
 static void parse_args(int argc, const char* argv[])
 {
-    // 例: --channel=Local\bbtrace_shm_1234-5678-...
+    // 例: --channel Local\bbtrace_shm_1234-5678-...（セッションの名前）
     for (int i = 0; i < argc; ++i) {
-        if (strncmp(argv[i], "--channel", 9) == 0)
+        if (strcmp(argv[i], "--topk-only") == 0)
+        {
+            g_topk_only = true;
+        }
+        else if (strncmp(argv[i], "--mem", 5) == 0 && (argv[i][5] == '\0' || argv[i][5] == '='))
+        {
+            // --mem は 16 バッファに 1 回、--mem=N は N 回に 1 回送る
+            g_mem_sample = (argv[i][5] == '=') ? (uint32_t)strtoul(argv[i] + 6, nullptr, 10) : 16;
+            if (g_mem_sample == 0) g_mem_sample = 1;
+        }
+        else if (strncmp(argv[i], "--collector=", 12) == 0)
+        {
+            strncpy_s(g_collector, argv[i] + 12, _TRUNCATE);
+        }
+        else if (strncmp(argv[i], "--channel", 9) == 0)
         {
             // ANSI→UTF-16 変換：初期化スレッド内でのみ Win32 を使う
             int needed = MultiByteToWideChar(CP_UTF8, 0, argv[i + 1], -1, nullptr, 0);
@@ -265,19 +909,46 @@ DR_EXPORT void dr_client_main(client_id_t, int argc, const char* argv[])
     dr_printf("bbtrace-ipc: dr_client_main\n");
     drmgr_init();
     parse_args(argc, argv);
+
+    // モジュールのロードより前に接続しておけば、イベントを溜めずにそのまま送れる
+    if (g_collector[0])
+    {
+        stream_init(g_collector);
+    }
+    else
+    {
+        ipc_init(g_channelW[0] ? g_channelW : nullptr);
+    }
+    dr_printf("ipc_init done\n");
+
+    g_hot_lock = dr_mutex_create();
+    g_tls_index = drmgr_register_tls_field();
+
+    if (g_mem_sample != 0)
+    {
+        drreg_options_t ops = { sizeof(ops), 3, false };
+        if (drreg_init(&ops) != DRREG_SUCCESS || !drutil_init())
+        {
+            dr_printf("bbtrace-ipc: drreg / drutil init failed, --mem disabled\n");
+            g_mem_sample = 0;
+        }
+        else
+        {
+            g_mem_tls_index = drmgr_register_tls_field();
+        }
+    }
+
     drmgr_register_module_load_event(on_module_load);
     drmgr_register_module_unload_event(on_module_unload);
+    drmgr_register_thread_init_event(on_thread_init);
+    drmgr_register_thread_exit_event(on_thread_exit);
     drmgr_register_exit_event(on_exit);
 
-    dr_create_client_thread([](void*) {
-        const wchar_t* name = (g_channelW[0] ? g_channelW : nullptr);
-        
-        ipc_init(name);
-
-        dr_printf("ipc_init done\n");
-        g_ipc_ready = 1;
-        cmd_loop(nullptr);
-        }, nullptr);
+    dr_create_client_thread(cmd_loop, nullptr);
+    if (g_collector[0] && g_shm)
+    {
+        dr_create_client_thread(stream_loop, nullptr);
+    }
 
     drmgr_register_bb_instrumentation_event(nullptr, event_bb_insert, nullptr);
     dr_printf("bbtrace-ipc: started (pid=%d)\n", dr_get_process_id());
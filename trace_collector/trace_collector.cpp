@@ -0,0 +1,345 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <charconv>
+#include <ctime>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#  include <winsock2.h>
+#  include <ws2tcpip.h>
+#  include <afunix.h>
+using socket_t = SOCKET;
+#else
+#  include <netdb.h>
+#  include <netinet/in.h>
+#  include <netinet/tcp.h>
+#  include <sys/socket.h>
+#  include <sys/un.h>
+#  include <unistd.h>
+using socket_t = int;
+#  define INVALID_SOCKET (-1)
+#  define closesocket close
+#endif
+
+#include "../trace_file.hpp"
+
+// クライアントが --collector で送ってくるイベントを受け取り、プロセス（接続）ごとに .cbtrace に記録する
+// ターゲットのそばで動かしておき、解析は記録したファイルを持ち出して別の場所で行う
+static void print_usage()
+{
+    std::fprintf(stderr,
+        "usage:\n"
+        "  trace_collector --listen=<tcp:host:port|unix:path> [--out=dir] [--codec=zstd|lz4|none] [--level=N]\n"
+        "                  [--record-threads=N] [--max-connections=N]\n"
+        "\n"
+        "  --listen            address the clients connect to (pass the same one to the client as --collector=...)\n"
+        "  --out               directory for <exe>_<date>_pid<N>.cbtrace (default: current directory)\n"
+        "  --max-connections   exit after this many connections have closed (default: run until killed)\n");
+}
+
+struct CollectorOptions
+{
+    std::string listen;
+    std::filesystem::path outDir = ".";
+    TraceRecorderOptions recorder;
+    uint64_t maxConnections = 0;
+};
+
+// "--name=value" の value を取り出す
+static bool option_value(std::string_view arg, std::string_view name, std::string_view& value)
+{
+    if (arg.size() <= name.size() + 1 || !arg.starts_with(name) || arg[name.size()] != '=') return false;
+    value = arg.substr(name.size() + 1);
+    return true;
+}
+
+static bool parse_u64(std::string_view s, uint64_t& out)
+{
+    const auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+    return ec == std::errc() && ptr == s.data() + s.size() && !s.empty();
+}
+
+static bool parse_options(int argc, const char* argv[], CollectorOptions& opt)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string_view arg = argv[i];
+        std::string_view value;
+        uint64_t n = 0;
+        if (option_value(arg, "--listen", value)) opt.listen = value;
+        else if (option_value(arg, "--out", value)) opt.outDir = std::filesystem::path(value);
+        else if (option_value(arg, "--codec", value) && trace_codec::Parse(value, opt.recorder.codec)) {}
+        else if (option_value(arg, "--level", value) && parse_u64(value, n)) opt.recorder.level = (int)n;
+        else if (option_value(arg, "--record-threads", value) && parse_u64(value, n) && 0 < n) opt.recorder.compressorThreads = (uint32_t)n;
+        else if (option_value(arg, "--max-connections", value) && parse_u64(value, n)) opt.maxConnections = n;
+        else
+        {
+            std::fprintf(stderr, "unknown option: %s\n", argv[i]);
+            return false;
+        }
+    }
+    return !opt.listen.empty();
+}
+
+static bool recv_all(socket_t s, void* dst, size_t size)
+{
+    auto* p = static_cast<char*>(dst);
+    while (0 < size)
+    {
+        const int received = recv(s, p, (int)std::min<size_t>(size, 1 << 30), 0);
+        if (received <= 0) return false;
+        p += received;
+        size -= (size_t)received;
+    }
+    return true;
+}
+
+// tcp:host:port（tcp: は省略できる）か unix:path で待ち受ける
+static socket_t open_listener(const std::string& spec)
+{
+    if (spec.starts_with("unix:"))
+    {
+        const std::string path = spec.substr(5);
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (sizeof(addr.sun_path) <= path.size()) return INVALID_SOCKET;
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+        // 前回のソケットファイルが残っていると bind できない
+        std::error_code ec;
+        std::filesystem::remove(path, ec);
+
+        const socket_t s = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (s == INVALID_SOCKET) return INVALID_SOCKET;
+        if (bind(s, (const sockaddr*)&addr, sizeof(addr)) != 0 || listen(s, 16) != 0)
+        {
+            closesocket(s);
+            return INVALID_SOCKET;
+        }
+        return s;
+    }
+
+    const std::string hostPort = spec.starts_with("tcp:") ? spec.substr(4) : spec;
+    const size_t colon = hostPort.rfind(':');
+    if (colon == std::string::npos) return INVALID_SOCKET;
+    const std::string host = hostPort.substr(0, colon);
+    const std::string port = hostPort.substr(colon + 1);
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0) return INVALID_SOCKET;
+
+    socket_t s = INVALID_SOCKET;
+    for (addrinfo* ai = result; ai; ai = ai->ai_next)
+    {
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s == INVALID_SOCKET) continue;
+
+        int reuse = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+        if (bind(s, ai->ai_addr, (int)ai->ai_addrlen) == 0 && listen(s, 16) == 0) break;
+        closesocket(s);
+        s = INVALID_SOCKET;
+    }
+    freeaddrinfo(result);
+    return s;
+}
+
+static std::string timestamp_string()
+{
+    const std::time_t now = std::time(nullptr);
+    std::tm local = {};
+#ifdef _WIN32
+    localtime_s(&local, &now);
+#else
+    localtime_r(&now, &local);
+#endif
+    char buf[32];
+    std::strftime(buf, sizeof(buf), "%Y%m%d_%H%M%S", &local);
+    return buf;
+}
+
+// 接続 1 つ（= プロセス 1 つ）を受け取り切る
+// 記録は exe の ModuleAdd が届いてから（exe のパスが決まってから）開き、それまでのイベントは溜めておく
+static void receive_connection(socket_t s, const CollectorOptions& opt, std::mutex& logMutex)
+{
+    StreamHello hello = {};
+    if (!recv_all(s, &hello, sizeof(hello)) || hello.magic != StreamMagic || hello.eventSize != sizeof(EventArgs))
+    {
+        std::lock_guard lock(logMutex);
+        std::fprintf(stderr, "rejected a connection: bad hello (event size %u, expected %zu)\n", hello.eventSize, sizeof(EventArgs));
+        closesocket(s);
+        return;
+    }
+
+    TraceRecorder recorder;
+    std::filesystem::path recordPath;
+    bool exeSeen = false;
+    std::vector<std::pair<EventArgs, std::string>> pendingEvents;
+    uint64_t droppedPendingCount = 0;
+
+    std::vector<uint8_t> payload;
+    uint64_t eventCount = 0;
+    uint32_t droppedCount = 0;
+    bool ok = true;
+
+    StreamChunkHeader header;
+    while (recv_all(s, &header, sizeof(header)))
+    {
+        // 長さはヘッダの中身と合っていなければ壊れている（クライアントのリングより大きいチャンクも来ない）
+        if (StreamMaxChunkEvents < header.eventCount || StreamMaxChunkStringSize < header.stringSize ||
+            header.payloadSize != (uint64_t)header.eventCount * sizeof(EventArgs) + header.stringSize)
+        {
+            ok = false;
+            break;
+        }
+
+        payload.resize(header.payloadSize);
+        if (!recv_all(s, payload.data(), payload.size()))
+        {
+            ok = false;
+            break;
+        }
+
+        const std::string_view paths(reinterpret_cast<const char*>(payload.data()) + (size_t)header.eventCount * sizeof(EventArgs), header.stringSize);
+        size_t pathCursor = 0;
+        for (uint32_t i = 0; i < header.eventCount; ++i)
+        {
+            EventArgs ev;
+            std::memcpy(&ev, payload.data() + (size_t)i * sizeof(EventArgs), sizeof(EventArgs));
+
+            std::string_view modulePath;
+            if (ev.type == EventType::ModuleAdd)
+            {
+                if (paths.size() < pathCursor + ev.mod.path_len)
+                {
+                    ok = false;
+                    break;
+                }
+                modulePath = paths.substr(pathCursor, ev.mod.path_len);
+                pathCursor += ev.mod.path_len;
+            }
+
+            if (!exeSeen)
+            {
+                if (ev.type != EventType::ModuleAdd || !modulePath.ends_with(".exe"))
+                {
+                    if (pendingEvents.size() < TraceMaxPendingEvents)
+                    {
+                        pendingEvents.emplace_back(ev, std::string(modulePath));
+                    }
+                    else
+                    {
+                        ++droppedPendingCount;
+                    }
+                    continue;
+                }
+
+                exeSeen = true;
+                const size_t nameBegin = modulePath.find_last_of("\\/") + 1;
+                const std::string exeName(modulePath.substr(nameBegin, modulePath.size() - nameBegin - 4));
+                recordPath = opt.outDir / (exeName + "_" + timestamp_string() + "_pid" + std::to_string(hello.pid) + ".cbtrace");
+                if (recorder.open(recordPath, std::string(modulePath), opt.recorder))
+                {
+                    for (const auto& [pendingEvent, pendingPath] : pendingEvents)
+                    {
+                        recorder.append(pendingEvent, pendingPath);
+                    }
+                }
+                else
+                {
+                    std::lock_guard lock(logMutex);
+                    std::fprintf(stderr, "failed to open %s\n", recordPath.string().c_str());
+                }
+                pendingEvents.clear();
+                pendingEvents.shrink_to_fit();
+            }
+
+            recorder.append(ev, modulePath);
+        }
+        if (!ok)
+        {
+            break;
+        }
+
+        eventCount += header.eventCount;
+        droppedCount = header.droppedCount;
+    }
+
+    closesocket(s);
+    recorder.close();
+
+    std::lock_guard lock(logMutex);
+    std::fprintf(stderr, "pid %u: %llu events, %u dropped by the client, %llu dropped before the exe module%s -> %s\n", hello.pid, (unsigned long long)eventCount, droppedCount,
+        (unsigned long long)droppedPendingCount, ok ? "" : ", stream broken", exeSeen ? recordPath.string().c_str() : "(no exe module, not recorded)");
+}
+
+int main(int argc, const char* argv[])
+{
+    CollectorOptions opt;
+    if (!parse_options(argc, argv, opt))
+    {
+        print_usage();
+        return 1;
+    }
+
+    if (!trace_codec::IsAvailable(opt.recorder.codec))
+    {
+        std::fprintf(stderr, "codec %s is not available, recording uncompressed\n", trace_codec::Name(opt.recorder.codec));
+        opt.recorder.codec = TraceCodec::None;
+    }
+
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+    {
+        std::fprintf(stderr, "WSAStartup failed\n");
+        return 2;
+    }
+#endif
+
+    std::error_code ec;
+    std::filesystem::create_directories(opt.outDir, ec);
+
+    const socket_t listener = open_listener(opt.listen);
+    if (listener == INVALID_SOCKET)
+    {
+        std::fprintf(stderr, "failed to listen on %s\n", opt.listen.c_str());
+        return 2;
+    }
+    std::fprintf(stderr, "listening on %s\n", opt.listen.c_str());
+
+    // 接続（プロセス）ごとに受信スレッドを立てる
+    std::mutex logMutex;
+    std::vector<std::thread> connections;
+    for (uint64_t accepted = 0; opt.maxConnections == 0 || accepted < opt.maxConnections; ++accepted)
+    {
+        const socket_t s = accept(listener, nullptr, nullptr);
+        if (s == INVALID_SOCKET)
+        {
+            break;
+        }
+        connections.emplace_back(receive_connection, s, std::cref(opt), std::ref(logMutex));
+    }
+
+    closesocket(listener);
+    for (auto& connection : connections)
+    {
+        connection.join();
+    }
+
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return 0;
+}
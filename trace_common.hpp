@@ -1,6 +1,13 @@
 ﻿#pragma once
+#ifdef _WIN32
 #define NOGDI
 #include <Windows.h>
+#else
+// Windows 以外（trace_generator）ではリングの読み書きに使うバリアだけを用意する
+#include <atomic>
+#include <cstdint>
+#define _ReadWriteBarrier() std::atomic_thread_fence(std::memory_order_acq_rel)
+#endif
 
 #pragma pack(push, 1)
 
@@ -12,6 +19,8 @@ enum EventType : uint16_t
 	BasicBlockHit,
 	ModuleAdd,
 	ModuleDelete,
+	MemoryAccess,
+	BlockDefine,
 };
 
 // type == EV_BB_HIT
@@ -34,6 +43,27 @@ struct ModEvent
 	uint16_t pathIndex;
 };
 
+// type == MemoryAccess（--mem のときだけ。バッファ単位で間引いて送る）
+struct MemEvent
+{
+	uint32_t pid;
+	uint32_t tid;
+	uint64_t app_pc;       // ロード / ストアした命令
+	uint64_t address;      // 実効アドレス
+	uint32_t size;         // アクセスしたバイト数
+	uint32_t isWrite;
+};
+
+// type == BlockDefine（ブロックを計装したときに 1 度送る。BB イベントより先に届く）
+struct BlockDefEvent
+{
+	uint32_t pid;
+	uint32_t instructionCount;  // ブロック内のアプリケーション命令の数
+	uint64_t app_pc;
+	uint64_t app_pc_end;
+	uint32_t byteSize;          // 命令の長さの合計
+};
+
 struct EventArgs
 {
 	uint16_t type; // EV_*
@@ -43,6 +73,8 @@ struct EventArgs
 	{
 		BBEvent bb;
 		ModEvent mod;
+		MemEvent mem;
+		BlockDefEvent block;
 	};
 };
 
@@ -96,6 +128,81 @@ struct ShmHeader
 	uint32_t commandsCapacity;
 };
 
+/////////////////////////////////////
+// 上位 K ブロック：Client -> Viewer
+// クライアントがスレッドごとの Space-Saving スケッチをまとめて定期的に丸ごと書き換える
+
+struct HotBlockEntry
+{
+	uint64_t address;
+	uint64_t endAddress;
+	uint64_t count;
+	uint64_t error;          // count の過大評価の上限
+};
+
+struct HotBlockTable
+{
+	uint32_t sequence;       // シーケンスロック（奇数の間は書き込み中）
+	uint32_t count;
+	uint64_t totalHits;      // スケッチに入れた BB の総数
+	HotBlockEntry entries[64];  // count の降順
+};
+
+/////////////////////////////////////
+
+
+/////////////////////////////////////
+// セッション：Viewer が作り、トレースするプロセス（子プロセスを含む）が 1 つずつ登録する
+// プロセスごとのチャンネル（ShmLayout）も Viewer が MaxProcesses 個まとめて作っておき、
+// クライアントは claimedCount を増やして得た番号のチャンネルを使う
+
+enum SessionEntryState : uint32_t
+{
+	SessionEntryEmpty = 0,
+	SessionEntryReady = 1,   // pid を書き終えた
+};
+
+struct SessionEntry
+{
+	uint32_t state;          // SessionEntryState（pid の後に書く）
+	uint32_t pid;
+};
+
+struct SessionDirectory
+{
+	uint32_t magic;
+	uint32_t maxProcesses;
+	uint32_t claimedCount;   // クライアントが InterlockedIncrement で番号を取る（maxProcesses を超えた分は使わない）
+	uint32_t reserved;
+	SessionEntry entries[16];
+};
+
+/////////////////////////////////////
+
+
+/////////////////////////////////////
+// ソケット：Client -> Collector（--collector のとき、共有メモリの代わりに使う）
+//
+// 接続したら StreamHello を 1 度送り、あとはリングの中身をまとめたチャンクを送り続ける
+//   StreamChunkHeader, EventArgs[eventCount], パス (stringSize バイト)
+// パスはチャンク内の ModuleAdd のパスを順に（path_len バイトずつ、終端なしで）並べたもの
+
+struct StreamHello
+{
+	uint32_t magic;
+	uint32_t pid;
+	uint32_t eventSize;      // sizeof(EventArgs)（食い違っていたら受け取らない）
+	uint32_t reserved;
+};
+
+struct StreamChunkHeader
+{
+	uint32_t payloadSize;    // このヘッダに続くバイト数（eventCount * eventSize + stringSize）
+	uint32_t eventCount;
+	uint32_t stringSize;
+	uint32_t droppedCount;   // クライアントのリングで溢れた累計
+};
+
 /////////////////////////////////////
 
 
@@ -109,4 +216,55 @@ struct ShmLayout
 	RingHeader				commandHeader;
 	Command					commandBuffer[1024];
 	char					strBuffer[16384];
+	HotBlockTable			hotBlocks;
 };
+
+// イベントのリング（書くのはクライアント、読むのはビューアなど 1 つのスレッドだけ）
+// 満杯なら捨てて droppedCount を数える
+inline bool spscPush(RingHeader* h, EventArgs* buf, const EventArgs& v)
+{
+	const uint32_t w = h->writeIndex, r = h->readIndex;
+	const uint32_t next = (w + 1) & (h->capacity - 1);
+	if (next == r)
+	{
+		++h->droppedCount;
+		return false;
+	}
+
+	buf[w] = v;
+	_ReadWriteBarrier();
+	h->writeIndex = next;
+
+	return true;
+}
+
+inline bool spscPop(RingHeader* h, EventArgs* buf, EventArgs& out)
+{
+	const uint32_t r = h->readIndex, w = h->writeIndex;
+	if (r == w)
+	{
+		return false;
+	}
+
+	out = buf[r];
+	_ReadWriteBarrier();
+	h->readIndex = (r + 1) & (h->capacity - 1);
+
+	return true;
+}
+
+constexpr uint32_t ShmMagic = 0x52544252;
+constexpr uint32_t SessionMagic = 0x53544252;
+constexpr uint32_t StreamMagic = 0x4D544252;
+
+// コレクタが受け付ける 1 チャンクの大きさ（壊れたヘッダで巨大な確保をしないため）
+// イベント数はクライアントのリングの容量まで、パスは strBuffer 64 個分まで
+constexpr uint32_t StreamMaxChunkEvents = sizeof(ShmLayout::eventBuffer) / sizeof(EventArgs);
+constexpr uint32_t StreamMaxChunkStringSize = 64 * sizeof(ShmLayout::strBuffer);
+
+// 接続完了を知らせるイベントの名前は、セッションの名前にこれを付けたもの
+// ビューアがセッションと一緒に起動前に作り、クライアントは登録を終えるたびにシグナルにする（自動リセット）
+inline constexpr wchar_t ShmReadyEventSuffix[] = L"_ready";
+
+// 番号 slot のチャンネルの名前（swprintf の書式で、セッションの名前と番号を渡す）
+inline constexpr wchar_t SessionChannelFormat[] = L"%ls_ch%u";
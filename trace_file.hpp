@@ -0,0 +1,1231 @@
+﻿#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "trace_common.hpp"
+
+// 圧縮コーデックは使える実装があるものだけ有効になる
+//   CMake でビルドするツールは、実際にリンクしたものを TRACE_FILE_HAS_ZSTD / TRACE_FILE_HAS_LZ4（0 / 1）で渡す（cmake/trace_codecs.cmake）
+//   渡されなければ、Siv3D から使う場合は Siv3D の Zstd、それ以外は zstd.h / lz4.h があればそれを使う
+#ifndef TRACE_FILE_HAS_ZSTD
+#  if __has_include(<Siv3D/Zstd.hpp>)
+#    define TRACE_FILE_HAS_ZSTD 1
+#    define TRACE_FILE_ZSTD_SIV3D 1
+#  elif __has_include(<zstd.h>)
+#    define TRACE_FILE_HAS_ZSTD 1
+#  else
+#    define TRACE_FILE_HAS_ZSTD 0
+#  endif
+#endif
+
+#ifndef TRACE_FILE_HAS_LZ4
+#  if __has_include(<lz4.h>) && __has_include(<lz4hc.h>)
+#    define TRACE_FILE_HAS_LZ4 1
+#  else
+#    define TRACE_FILE_HAS_LZ4 0
+#  endif
+#endif
+
+#if defined(TRACE_FILE_ZSTD_SIV3D)
+#  include <Siv3D/Zstd.hpp>
+#elif TRACE_FILE_HAS_ZSTD
+#  include <zstd.h>
+#endif
+
+#if TRACE_FILE_HAS_LZ4
+#  include <lz4.h>
+#  include <lz4hc.h>
+#endif
+
+/////////////////////////////////////
+// 記録済みトレースのファイル形式
+//
+//   TraceFileHeader
+//   exe のパス (UTF-8, TraceFileHeader::exePathSize バイト)
+//   { TraceChunkHeader, ペイロード (TraceChunkHeader::storedSize バイト) } * N （チャンクとキーフレーム）
+//   TraceIndexEntry * N
+//   TraceFileFooter
+//
+// ペイロードは EventArgs[eventCount] とモジュールパスの文字列領域 (stringSize バイト) を
+// フィルタ -> コーデックの順に変換したもの
+// ModEvent::pathIndex はチャンク内の文字列領域の先頭からのオフセットを指す
+// チャンクヘッダには展開せずに読み飛ばしを判断するための概要（時間 / アドレス / スレッドの範囲とビット集合）を持つ
+//
+// キーフレームは一定数のチャンクごとに挟む集計済みの状態で、先頭からのブロックごとの累計ヒット数と
+// （BlockDefine で届いた）ブロックの命令数を持つ
+// ヘッダは TraceChunkHeader と同じ形で magic が TraceKeyframeMagic、
+// ペイロードは TraceKeyframeEntry[eventCount]（アドレスの昇順）で、sequence 個目までのチャンクを集計したもの
+// フッタが無い（記録が途中で止まった）ファイルもチャンクヘッダを辿って読める
+
+enum class TraceCodec : uint16_t
+{
+	None = 0,
+	Zstd = 1,
+	Lz4 = 2,
+};
+
+enum class TraceFilter : uint16_t
+{
+	None = 0,
+
+	// BB イベントのタイムスタンプを直前との差分に、終端アドレスをブロック長に置き換えてから
+	// レコードをバイト単位で転置する（同じ位置のバイトが並ぶので圧縮が効きやすい）
+	DeltaShuffle = 1,
+};
+
+#pragma pack(push, 1)
+
+struct TraceFileHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t headerSize;
+	uint32_t eventSize;
+	uint32_t exePathSize;
+	uint32_t reserved;
+};
+
+struct TraceChunkHeader
+{
+	uint32_t magic;
+	TraceCodec codec;
+	TraceFilter filter;
+	uint32_t eventCount;
+	uint32_t stringSize;
+	uint32_t storedSize;
+	uint32_t moduleEventCount;
+
+	// チャンクの通し番号（キーフレームでは集計済みのチャンク数）
+	uint32_t sequence;
+	uint32_t reserved;
+
+	// 以下は BB イベントの概要（BB イベントが無いチャンクでは min > max）
+
+	// BB イベントのタイムスタンプの最小 / 最大（スレッドごとに届く順が前後するので、先頭と末尾のイベントではない）
+	// キーフレームでは、そこまでのチャンクの最大のタイムスタンプ
+	uint64_t firstTimestamp;
+	uint64_t lastTimestamp;
+
+	uint64_t minAddress;
+	uint64_t maxAddress;
+	uint32_t minThreadId;
+	uint32_t maxThreadId;
+
+	// スレッド ID / ブロックの先頭アドレスのハッシュで立てるビット（ブルームフィルタ）
+	uint64_t threadBits;
+	uint64_t blockBits[64];
+};
+
+struct TraceKeyframeEntry
+{
+	uint64_t address;
+	uint64_t endAddress;
+	uint64_t hitCount;
+
+	// BlockDefine がまだ届いていないブロックでは 0
+	uint32_t instructionCount;
+	uint32_t byteSize;
+};
+
+struct TraceIndexEntry
+{
+	uint64_t offset;
+	TraceChunkHeader header;
+};
+
+struct TraceFileFooter
+{
+	uint32_t magic;
+	uint32_t chunkCount;
+	uint64_t indexOffset;
+};
+
+#pragma pack(pop)
+
+constexpr uint32_t TraceFileMagic = 0x43525443;   // "CTRC"
+constexpr uint32_t TraceChunkMagic = 0x4B4E4843;  // "CHNK"
+constexpr uint32_t TraceKeyframeMagic = 0x4659454B; // "KEYF"
+constexpr uint32_t TraceFooterMagic = 0x58444E49; // "INDX"
+constexpr uint32_t TraceFileVersion = 4;
+
+// 読み込み時に受け付ける 1 チャンク（キーフレーム）あたりの展開後の大きさ（壊れたヘッダで巨大な確保をしないため）
+constexpr uint64_t TraceMaxChunkRawBytes = 1ull << 30;
+
+// exe の ModuleAdd が届く（記録先が決まる）までに溜めておくイベント数の上限（超えた分は捨てる）
+constexpr size_t TraceMaxPendingEvents = 1 << 16;
+
+/////////////////////////////////////
+// チャンクの概要
+
+namespace trace_summary
+{
+	inline uint64_t Mix(uint64_t x)
+	{
+		x ^= x >> 33;
+		x *= 0xFF51AFD7ED558CCDull;
+		x ^= x >> 33;
+		x *= 0xC4CEB9FE1A85EC53ull;
+		x ^= x >> 33;
+		return x;
+	}
+
+	constexpr uint32_t BlockBitCount = sizeof(TraceChunkHeader::blockBits) * 8;
+
+	// ブロックごとに 2 ビット立てる
+	inline void BlockBitIndices(uint64_t address, uint32_t& bit0, uint32_t& bit1)
+	{
+		const uint64_t h = Mix(address);
+		bit0 = static_cast<uint32_t>(h % BlockBitCount);
+		bit1 = static_cast<uint32_t>((h >> 32) % BlockBitCount);
+	}
+
+	inline uint64_t ThreadBit(uint32_t tid)
+	{
+		return 1ull << (Mix(tid) % 64);
+	}
+
+	inline void Clear(TraceChunkHeader& header)
+	{
+		header.firstTimestamp = UINT64_MAX;
+		header.lastTimestamp = 0;
+		header.minAddress = UINT64_MAX;
+		header.maxAddress = 0;
+		header.minThreadId = UINT32_MAX;
+		header.maxThreadId = 0;
+		header.threadBits = 0;
+		std::memset(header.blockBits, 0, sizeof(header.blockBits));
+	}
+
+	inline void Add(TraceChunkHeader& header, const BBEvent& bb)
+	{
+		header.firstTimestamp = std::min(header.firstTimestamp, bb.timestamp_us);
+		header.lastTimestamp = std::max(header.lastTimestamp, bb.timestamp_us);
+		header.minAddress = std::min(header.minAddress, bb.app_pc);
+		header.maxAddress = std::max(header.maxAddress, bb.app_pc);
+		header.minThreadId = std::min(header.minThreadId, bb.tid);
+		header.maxThreadId = std::max(header.maxThreadId, bb.tid);
+		header.threadBits |= ThreadBit(bb.tid);
+
+		uint32_t bit0, bit1;
+		BlockBitIndices(bb.app_pc, bit0, bit1);
+		header.blockBits[bit0 / 64] |= 1ull << (bit0 % 64);
+		header.blockBits[bit1 / 64] |= 1ull << (bit1 % 64);
+	}
+
+	// false ならチャンクに含まれないことが確定する
+	inline bool MayContainBlock(const TraceChunkHeader& header, uint64_t address)
+	{
+		if (address < header.minAddress || header.maxAddress < address)
+		{
+			return false;
+		}
+
+		uint32_t bit0, bit1;
+		BlockBitIndices(address, bit0, bit1);
+		return ((header.blockBits[bit0 / 64] >> (bit0 % 64)) & 1) && ((header.blockBits[bit1 / 64] >> (bit1 % 64)) & 1);
+	}
+
+	inline bool MayContainThread(const TraceChunkHeader& header, uint32_t tid)
+	{
+		return header.minThreadId <= tid && tid <= header.maxThreadId && (header.threadBits & ThreadBit(tid));
+	}
+
+	// [beginTimestamp, endTimestamp) と BB イベントの時間範囲が重なるか
+	inline bool MayOverlapTime(const TraceChunkHeader& header, uint64_t beginTimestamp, uint64_t endTimestamp)
+	{
+		return header.minAddress <= header.maxAddress && header.firstTimestamp < endTimestamp && beginTimestamp <= header.lastTimestamp;
+	}
+}
+
+/////////////////////////////////////
+// コーデック / フィルタ
+
+namespace trace_codec
+{
+	inline bool IsAvailable(TraceCodec codec)
+	{
+		switch (codec)
+		{
+		case TraceCodec::None:
+			return true;
+#if TRACE_FILE_HAS_ZSTD
+		case TraceCodec::Zstd:
+			return true;
+#endif
+#if TRACE_FILE_HAS_LZ4
+		case TraceCodec::Lz4:
+			return true;
+#endif
+		default:
+			return false;
+		}
+	}
+
+	inline const char* Name(TraceCodec codec)
+	{
+		switch (codec)
+		{
+		case TraceCodec::None: return "none";
+		case TraceCodec::Zstd: return "zstd";
+		case TraceCodec::Lz4: return "lz4";
+		default: return "unknown";
+		}
+	}
+
+	inline bool Parse(std::string_view name, TraceCodec& out)
+	{
+		for (const auto codec : { TraceCodec::None, TraceCodec::Zstd, TraceCodec::Lz4 })
+		{
+			if (name == Name(codec))
+			{
+				out = codec;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// 失敗した場合は false（呼ぶ側で無圧縮として保存する）
+	inline bool Compress(TraceCodec codec, [[maybe_unused]] int level, const uint8_t* src, size_t size, std::vector<uint8_t>& out)
+	{
+		switch (codec)
+		{
+		case TraceCodec::None:
+			out.assign(src, src + size);
+			return true;
+#if defined(TRACE_FILE_ZSTD_SIV3D)
+		case TraceCodec::Zstd:
+		{
+			s3d::Blob blob;
+			if (!s3d::Zstd::Compress(src, size, blob, level))
+			{
+				return false;
+			}
+			out.assign(blob.data(), blob.data() + blob.size());
+			return true;
+		}
+#elif TRACE_FILE_HAS_ZSTD
+		case TraceCodec::Zstd:
+		{
+			out.resize(ZSTD_compressBound(size));
+			const size_t result = ZSTD_compress(out.data(), out.size(), src, size, level);
+			if (ZSTD_isError(result))
+			{
+				return false;
+			}
+			out.resize(result);
+			return true;
+		}
+#endif
+#if TRACE_FILE_HAS_LZ4
+		case TraceCodec::Lz4:
+		{
+			out.resize(LZ4_compressBound(static_cast<int>(size)));
+			const int result = (level <= 1)
+				? LZ4_compress_default(reinterpret_cast<const char*>(src), reinterpret_cast<char*>(out.data()), static_cast<int>(size), static_cast<int>(out.size()))
+				: LZ4_compress_HC(reinterpret_cast<const char*>(src), reinterpret_cast<char*>(out.data()), static_cast<int>(size), static_cast<int>(out.size()), level);
+			if (result <= 0)
+			{
+				return false;
+			}
+			out.resize(static_cast<size_t>(result));
+			return true;
+		}
+#endif
+		default:
+			return false;
+		}
+	}
+
+	inline bool Decompress(TraceCodec codec, const uint8_t* src, size_t size, uint8_t* dst, size_t rawSize)
+	{
+		switch (codec)
+		{
+		case TraceCodec::None:
+			if (size != rawSize)
+			{
+				return false;
+			}
+			std::memcpy(dst, src, size);
+			return true;
+#if defined(TRACE_FILE_ZSTD_SIV3D)
+		case TraceCodec::Zstd:
+		{
+			s3d::Blob blob;
+			if (!s3d::Zstd::Decompress(src, size, blob) || blob.size() != rawSize)
+			{
+				return false;
+			}
+			std::memcpy(dst, blob.data(), rawSize);
+			return true;
+		}
+#elif TRACE_FILE_HAS_ZSTD
+		case TraceCodec::Zstd:
+			return ZSTD_decompress(dst, rawSize, src, size) == rawSize;
+#endif
+#if TRACE_FILE_HAS_LZ4
+		case TraceCodec::Lz4:
+			return LZ4_decompress_safe(reinterpret_cast<const char*>(src), reinterpret_cast<char*>(dst), static_cast<int>(size), static_cast<int>(rawSize)) == static_cast<int>(rawSize);
+#endif
+		default:
+			return false;
+		}
+	}
+
+	// events をその場で差分化してから dst に転置する
+	inline void EncodeDeltaShuffle(std::vector<EventArgs>& events, uint8_t* dst)
+	{
+		uint64_t prevTimestamp = 0;
+		uint64_t prevAddress = 0;
+		for (auto& ev : events)
+		{
+			if (ev.type == EventType::BasicBlockHit)
+			{
+				const uint64_t timestamp = ev.bb.timestamp_us;
+				ev.bb.timestamp_us = timestamp - prevTimestamp;
+				ev.bb.app_pc_end -= ev.bb.app_pc;
+				prevTimestamp = timestamp;
+			}
+			else if (ev.type == EventType::MemoryAccess)
+			{
+				const uint64_t address = ev.mem.address;
+				ev.mem.address = address - prevAddress;
+				prevAddress = address;
+			}
+		}
+
+		const size_t count = events.size();
+		const auto* src = reinterpret_cast<const uint8_t*>(events.data());
+		for (size_t b = 0; b < sizeof(EventArgs); ++b)
+		{
+			uint8_t* plane = dst + b * count;
+			for (size_t i = 0; i < count; ++i)
+			{
+				plane[i] = src[i * sizeof(EventArgs) + b];
+			}
+		}
+	}
+
+	inline void DecodeDeltaShuffle(const uint8_t* src, size_t count, std::vector<EventArgs>& events)
+	{
+		events.resize(count);
+		auto* dst = reinterpret_cast<uint8_t*>(events.data());
+		for (size_t b = 0; b < sizeof(EventArgs); ++b)
+		{
+			const uint8_t* plane = src + b * count;
+			for (size_t i = 0; i < count; ++i)
+			{
+				dst[i * sizeof(EventArgs) + b] = plane[i];
+			}
+		}
+
+		uint64_t prevTimestamp = 0;
+		uint64_t prevAddress = 0;
+		for (auto& ev : events)
+		{
+			if (ev.type == EventType::BasicBlockHit)
+			{
+				ev.bb.timestamp_us += prevTimestamp;
+				ev.bb.app_pc_end += ev.bb.app_pc;
+				prevTimestamp = ev.bb.timestamp_us;
+			}
+			else if (ev.type == EventType::MemoryAccess)
+			{
+				ev.mem.address += prevAddress;
+				prevAddress = ev.mem.address;
+			}
+		}
+	}
+}
+
+/////////////////////////////////////
+// 書き込み
+
+struct TraceRecorderOptions
+{
+	TraceCodec codec = TraceCodec::Zstd;
+	int level = 3;
+	TraceFilter filter = TraceFilter::DeltaShuffle;
+
+	// 1 チャンクに詰めるイベント数
+	uint32_t eventsPerChunk = 1u << 16;
+
+	uint32_t compressorThreads = 1;
+
+	// 圧縮待ちのチャンクがこれを超えたら、記録側を止めないように append() を呼んだスレッドで無圧縮のまま書き出す
+	// 圧縮が追いつく速さの目安は README の trace_generator の節を参照
+	uint32_t maxPendingChunks = 8;
+
+	// このチャンク数ごとにキーフレームを書く（0 なら書かない）
+	uint32_t keyframeInterval = 16;
+};
+
+// イベントをチャンクにまとめ、バックグラウンドのスレッドで圧縮してから順番に書き出す
+// append() は 1 つのスレッドからだけ呼ぶ
+class TraceRecorder
+{
+public:
+
+	TraceRecorder() = default;
+
+	TraceRecorder(const TraceRecorder&) = delete;
+
+	TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+	~TraceRecorder()
+	{
+		close();
+	}
+
+	bool open(const std::filesystem::path& path, const std::string& exePathUtf8, const TraceRecorderOptions& options)
+	{
+		close();
+
+		m_options = options;
+		if (!trace_codec::IsAvailable(m_options.codec))
+		{
+			m_options.codec = trace_codec::IsAvailable(TraceCodec::Zstd) ? TraceCodec::Zstd : TraceCodec::None;
+		}
+		// 読み込み側の上限に収まるように（残りはモジュールパスの文字列に空けておく）
+		m_options.eventsPerChunk = std::clamp(m_options.eventsPerChunk, 1u, static_cast<uint32_t>(TraceMaxChunkRawBytes / 2 / sizeof(EventArgs)));
+		m_options.compressorThreads = std::max(1u, m_options.compressorThreads);
+		m_options.maxPendingChunks = std::max(1u, m_options.maxPendingChunks);
+
+		m_file.open(path, std::ios::binary | std::ios::trunc);
+		if (!m_file)
+		{
+			m_file.close();
+			return false;
+		}
+
+		TraceFileHeader header = {};
+		header.magic = TraceFileMagic;
+		header.version = TraceFileVersion;
+		header.headerSize = sizeof(TraceFileHeader);
+		header.eventSize = sizeof(EventArgs);
+		header.exePathSize = static_cast<uint32_t>(exePathUtf8.size());
+		m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		m_file.write(exePathUtf8.data(), exePathUtf8.size());
+		m_offset = sizeof(header) + exePathUtf8.size();
+
+		m_stopRequest = false;
+		m_nextSequence = 0;
+		m_nextWriteSequence = 0;
+		m_blockHits.clear();
+		m_writtenChunks = 0;
+		m_chunksSinceKeyframe = 0;
+		m_keyframeTimestamp = 0;
+		m_rawBytes = 0;
+		m_storedBytes = 0;
+		m_uncompressedChunks = 0;
+		m_index.clear();
+		for (uint32_t i = 0; i < m_options.compressorThreads; ++i)
+		{
+			m_compressors.emplace_back([this]() { compressorMain(); });
+		}
+
+		m_open = true;
+		return true;
+	}
+
+	// m_file は圧縮スレッドが書き込むので、開いているかどうかは別に持つ
+	bool isOpen() const
+	{
+		return m_open;
+	}
+
+	const TraceRecorderOptions& options() const
+	{
+		return m_options;
+	}
+
+	// ModuleAdd の場合は modulePath にパスを渡す
+	void append(const EventArgs& ev, std::string_view modulePath = {})
+	{
+		if (!isOpen())
+		{
+			return;
+		}
+
+		EventArgs copied = ev;
+		if (ev.type == EventType::ModuleAdd)
+		{
+			if (UINT16_MAX < m_strings.size() + modulePath.size() + 1)
+			{
+				seal();
+			}
+
+			copied.mod.pathIndex = static_cast<uint16_t>(m_strings.size());
+			copied.mod.path_len = static_cast<uint32_t>(modulePath.size());
+			m_strings.append(modulePath);
+			m_strings.push_back('\0');
+		}
+
+		m_events.push_back(copied);
+		if (m_options.eventsPerChunk <= m_events.size())
+		{
+			seal();
+		}
+	}
+
+	// 溜まっている分をチャンクにして圧縮待ちに積む
+	void seal()
+	{
+		if (m_events.empty())
+		{
+			return;
+		}
+
+		PendingChunk chunk;
+		chunk.sequence = m_nextSequence++;
+		chunk.header.magic = TraceChunkMagic;
+		chunk.header.sequence = static_cast<uint32_t>(chunk.sequence);
+		chunk.header.codec = m_options.codec;
+		chunk.header.filter = m_options.filter;
+		chunk.header.eventCount = static_cast<uint32_t>(m_events.size());
+		chunk.header.stringSize = static_cast<uint32_t>(m_strings.size());
+		chunk.events = std::move(m_events);
+		chunk.strings = std::move(m_strings);
+
+		m_events = {};
+		m_events.reserve(m_options.eventsPerChunk);
+		m_strings = {};
+
+		{
+			std::lock_guard lock(m_queueMutex);
+			if (m_queue.size() < m_options.maxPendingChunks)
+			{
+				m_queue.push_back(std::move(chunk));
+				m_queueCondition.notify_one();
+				return;
+			}
+		}
+
+		// 圧縮が追いつかないので、圧縮待ちに積まずにここで無圧縮のまま書き出す
+		if (chunk.header.codec != TraceCodec::None)
+		{
+			chunk.header.codec = TraceCodec::None;
+			++m_uncompressedChunks;
+		}
+		EncodedChunk encoded = Encode(chunk, 0);
+
+		// 前のチャンクの圧縮が終わるまで書き出せないので、その間に溜まる分も maxPendingChunks までにする
+		std::unique_lock lock(m_writeMutex);
+		m_writeCondition.wait(lock, [&]() { return m_encoded.size() < m_options.maxPendingChunks; });
+		m_encoded.emplace(chunk.sequence, std::move(encoded));
+		writeEncoded();
+	}
+
+	// 残りを書き出し、インデックスとフッタを付けて閉じる
+	void close()
+	{
+		if (!isOpen())
+		{
+			return;
+		}
+
+		seal();
+
+		{
+			std::lock_guard lock(m_queueMutex);
+			m_stopRequest = true;
+		}
+		m_queueCondition.notify_all();
+
+		for (auto& compressor : m_compressors)
+		{
+			compressor.join();
+		}
+		m_compressors.clear();
+
+		// 最後の状態にすぐ飛べるように末尾にもキーフレームを置く
+		if (0 < m_chunksSinceKeyframe)
+		{
+			writeKeyframe();
+		}
+
+		const uint64_t indexOffset = m_offset;
+		for (const auto& entry : m_index)
+		{
+			m_file.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+		}
+
+		TraceFileFooter footer = {};
+		footer.magic = TraceFooterMagic;
+		footer.chunkCount = static_cast<uint32_t>(m_index.size());
+		footer.indexOffset = indexOffset;
+		m_file.write(reinterpret_cast<const char*>(&footer), sizeof(footer));
+		m_file.close();
+		m_open = false;
+	}
+
+	// 圧縮前 / 圧縮後のバイト数（書き出し済みのチャンク分）
+	uint64_t rawBytes() const
+	{
+		return m_rawBytes;
+	}
+
+	uint64_t storedBytes() const
+	{
+		return m_storedBytes;
+	}
+
+	// 圧縮が追いつかずに無圧縮で書き出したチャンクの数
+	uint64_t uncompressedChunks() const
+	{
+		return m_uncompressedChunks;
+	}
+
+private:
+
+	struct PendingChunk
+	{
+		uint64_t sequence = 0;
+		TraceChunkHeader header = {};
+		std::vector<EventArgs> events;
+		std::string strings;
+	};
+
+	struct EncodedChunk
+	{
+		TraceChunkHeader header = {};
+		std::vector<uint8_t> payload;
+		uint64_t rawSize = 0;
+
+		// キーフレーム用のチャンク内のブロックごとのヒット数
+		std::unordered_map<uint64_t, TraceKeyframeEntry> blockHits;
+	};
+
+	static EncodedChunk Encode(PendingChunk& chunk, int level)
+	{
+		EncodedChunk encoded;
+		encoded.header = chunk.header;
+
+		// 概要はフィルタで書き換える前のイベントから作る
+		trace_summary::Clear(encoded.header);
+		for (const auto& ev : chunk.events)
+		{
+			if (ev.type == EventType::BasicBlockHit)
+			{
+				trace_summary::Add(encoded.header, ev.bb);
+				auto& hits = encoded.blockHits.try_emplace(ev.bb.app_pc, TraceKeyframeEntry{ ev.bb.app_pc, 0, 0, 0, 0 }).first->second;
+				hits.endAddress = std::max(hits.endAddress, ev.bb.app_pc_end);
+				++hits.hitCount;
+			}
+			else if (ev.type == EventType::BlockDefine)
+			{
+				auto& hits = encoded.blockHits.try_emplace(ev.block.app_pc, TraceKeyframeEntry{ ev.block.app_pc, 0, 0, 0, 0 }).first->second;
+				hits.endAddress = std::max(hits.endAddress, ev.block.app_pc_end);
+				hits.instructionCount = ev.block.instructionCount;
+				hits.byteSize = ev.block.byteSize;
+			}
+			else if (ev.type == EventType::ModuleAdd || ev.type == EventType::ModuleDelete)
+			{
+				++encoded.header.moduleEventCount;
+			}
+		}
+
+		const size_t eventBytes = chunk.events.size() * sizeof(EventArgs);
+		std::vector<uint8_t> raw(eventBytes + chunk.strings.size());
+		if (chunk.header.filter == TraceFilter::DeltaShuffle)
+		{
+			trace_codec::EncodeDeltaShuffle(chunk.events, raw.data());
+		}
+		else
+		{
+			std::memcpy(raw.data(), chunk.events.data(), eventBytes);
+		}
+		std::memcpy(raw.data() + eventBytes, chunk.strings.data(), chunk.strings.size());
+		encoded.rawSize = raw.size();
+
+		if (!trace_codec::Compress(encoded.header.codec, level, raw.data(), raw.size(), encoded.payload))
+		{
+			encoded.header.codec = TraceCodec::None;
+			encoded.payload = std::move(raw);
+		}
+		encoded.header.storedSize = static_cast<uint32_t>(encoded.payload.size());
+
+		return encoded;
+	}
+
+	void compressorMain()
+	{
+		for (;;)
+		{
+			PendingChunk chunk;
+			{
+				std::unique_lock lock(m_queueMutex);
+				m_queueCondition.wait(lock, [&]() { return m_stopRequest || !m_queue.empty(); });
+				if (m_queue.empty())
+				{
+					break;
+				}
+
+				chunk = std::move(m_queue.front());
+				m_queue.pop_front();
+			}
+
+			EncodedChunk encoded = Encode(chunk, m_options.level);
+
+			std::lock_guard lock(m_writeMutex);
+			m_encoded.emplace(chunk.sequence, std::move(encoded));
+			writeEncoded();
+		}
+	}
+
+	// 圧縮は並列に終わるので、書き出しは sequence の順に並べ直す（m_writeMutex を取って呼ぶ）
+	void writeEncoded()
+	{
+		for (auto it = m_encoded.find(m_nextWriteSequence); it != m_encoded.end(); it = m_encoded.find(m_nextWriteSequence))
+		{
+			write(it->second);
+			m_encoded.erase(it);
+			++m_nextWriteSequence;
+		}
+		m_writeCondition.notify_all();
+	}
+
+	void write(const EncodedChunk& chunk)
+	{
+		writeRecord(chunk.header, chunk.payload);
+		m_rawBytes += chunk.rawSize;
+		++m_writtenChunks;
+
+		// 書き出しは sequence の順なので、ここで累計すれば先頭からの状態になる
+		for (const auto& [address, hits] : chunk.blockHits)
+		{
+			auto& total = m_blockHits.try_emplace(address, TraceKeyframeEntry{ address, 0, 0, 0, 0 }).first->second;
+			total.endAddress = std::max(total.endAddress, hits.endAddress);
+			total.hitCount += hits.hitCount;
+			if (hits.instructionCount != 0)
+			{
+				total.instructionCount = hits.instructionCount;
+				total.byteSize = hits.byteSize;
+			}
+		}
+		if (chunk.header.minAddress <= chunk.header.maxAddress)
+		{
+			m_keyframeTimestamp = std::max(m_keyframeTimestamp, chunk.header.lastTimestamp);
+		}
+
+		++m_chunksSinceKeyframe;
+		if (0 < m_options.keyframeInterval && m_options.keyframeInterval <= m_chunksSinceKeyframe)
+		{
+			writeKeyframe();
+		}
+	}
+
+	void writeKeyframe()
+	{
+		std::vector<TraceKeyframeEntry> entries;
+		entries.reserve(m_blockHits.size());
+		for (const auto& [address, hits] : m_blockHits)
+		{
+			entries.push_back(hits);
+		}
+		std::sort(entries.begin(), entries.end(), [](const TraceKeyframeEntry& a, const TraceKeyframeEntry& b) { return a.address < b.address; });
+
+		TraceChunkHeader header = {};
+		header.magic = TraceKeyframeMagic;
+		header.codec = m_options.codec;
+		header.filter = TraceFilter::None;
+		header.eventCount = static_cast<uint32_t>(entries.size());
+		header.sequence = m_writtenChunks;
+		trace_summary::Clear(header);
+		header.firstTimestamp = m_keyframeTimestamp;
+		header.lastTimestamp = m_keyframeTimestamp;
+
+		const auto* raw = reinterpret_cast<const uint8_t*>(entries.data());
+		const size_t rawSize = entries.size() * sizeof(TraceKeyframeEntry);
+		std::vector<uint8_t> payload;
+		if (!trace_codec::Compress(header.codec, m_options.level, raw, rawSize, payload))
+		{
+			header.codec = TraceCodec::None;
+			payload.assign(raw, raw + rawSize);
+		}
+		header.storedSize = static_cast<uint32_t>(payload.size());
+
+		writeRecord(header, payload);
+		m_chunksSinceKeyframe = 0;
+	}
+
+	void writeRecord(const TraceChunkHeader& header, const std::vector<uint8_t>& payload)
+	{
+		m_index.push_back(TraceIndexEntry{ m_offset, header });
+		m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		m_file.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+		m_offset += sizeof(header) + payload.size();
+		m_storedBytes += payload.size();
+	}
+
+	TraceRecorderOptions m_options;
+	std::atomic<bool> m_open = false;
+
+	// append 側
+	std::vector<EventArgs> m_events;
+	std::string m_strings;
+	uint64_t m_nextSequence = 0;
+
+	// 圧縮待ち
+	std::mutex m_queueMutex;
+	std::condition_variable m_queueCondition;
+	std::deque<PendingChunk> m_queue;
+	bool m_stopRequest = false;
+	std::vector<std::thread> m_compressors;
+
+	// 書き出し
+	std::mutex m_writeMutex;
+	std::condition_variable m_writeCondition;
+	std::map<uint64_t, EncodedChunk> m_encoded;
+	uint64_t m_nextWriteSequence = 0;
+	std::ofstream m_file;
+	uint64_t m_offset = 0;
+	std::vector<TraceIndexEntry> m_index;
+	std::atomic<uint64_t> m_rawBytes = 0;
+	std::atomic<uint64_t> m_storedBytes = 0;
+	std::atomic<uint64_t> m_uncompressedChunks = 0;
+
+	// キーフレーム用の累計
+	std::unordered_map<uint64_t, TraceKeyframeEntry> m_blockHits;
+	uint32_t m_writtenChunks = 0;
+	uint32_t m_chunksSinceKeyframe = 0;
+	uint64_t m_keyframeTimestamp = 0;
+};
+
+/////////////////////////////////////
+// 読み込み
+
+struct DecodedChunk
+{
+	std::vector<EventArgs> events;
+	std::string strings;
+
+	std::string_view modulePath(const ModEvent& mod) const
+	{
+		if (strings.size() < static_cast<size_t>(mod.pathIndex) + mod.path_len)
+		{
+			return {};
+		}
+		return std::string_view(strings.data() + mod.pathIndex, mod.path_len);
+	}
+};
+
+// チャンク単位でランダムアクセスできるトレースファイル
+// readChunk() は複数のスレッドから同時に呼べる（ファイルの読み出しだけ排他し、展開は並列に行う）
+class TraceReader
+{
+public:
+
+	bool open(const std::filesystem::path& path)
+	{
+		m_chunks.clear();
+		m_keyframes.clear();
+		m_fileSize = 0;
+		m_file.close();
+		m_file.clear();
+
+		m_file.open(path, std::ios::binary);
+		if (!m_file)
+		{
+			return false;
+		}
+
+		TraceFileHeader header = {};
+		if (!readAt(0, &header, sizeof(header)) || header.magic != TraceFileMagic ||
+			header.version != TraceFileVersion || header.eventSize != sizeof(EventArgs))
+		{
+			return false;
+		}
+
+		m_file.seekg(0, std::ios::end);
+		const uint64_t fileSize = static_cast<uint64_t>(m_file.tellg());
+		m_fileSize = fileSize;
+
+		if (fileSize < static_cast<uint64_t>(header.headerSize) + header.exePathSize)
+		{
+			return false;
+		}
+		m_exePath.resize(header.exePathSize);
+		if (!readAt(header.headerSize, m_exePath.data(), m_exePath.size()))
+		{
+			return false;
+		}
+
+		// フッタのインデックスを使う（インデックスや指す先がファイルに収まらなければ壊れているとみなす）
+		TraceFileFooter footer = {};
+		if (sizeof(footer) <= fileSize && readAt(fileSize - sizeof(footer), &footer, sizeof(footer)) && footer.magic == TraceFooterMagic)
+		{
+			const uint64_t indexEnd = fileSize - sizeof(footer);
+			if (indexEnd < footer.indexOffset || (indexEnd - footer.indexOffset) / sizeof(TraceIndexEntry) < footer.chunkCount)
+			{
+				return false;
+			}
+
+			std::vector<TraceIndexEntry> index(footer.chunkCount);
+			if (readAt(footer.indexOffset, index.data(), index.size() * sizeof(TraceIndexEntry)))
+			{
+				for (const auto& entry : index)
+				{
+					if (!isValidEntry(entry))
+					{
+						m_chunks.clear();
+						m_keyframes.clear();
+						return false;
+					}
+					addIndexEntry(entry);
+				}
+				return true;
+			}
+		}
+
+		// フッタが無い場合は先頭からチャンクヘッダを辿る
+		uint64_t offset = header.headerSize + header.exePathSize;
+		TraceChunkHeader chunkHeader = {};
+		while (offset + sizeof(chunkHeader) <= fileSize && readAt(offset, &chunkHeader, sizeof(chunkHeader)) &&
+			(chunkHeader.magic == TraceChunkMagic || chunkHeader.magic == TraceKeyframeMagic))
+		{
+			// 途中で止まった記録の末尾は読まない
+			const TraceIndexEntry entry{ offset, chunkHeader };
+			if (!isValidEntry(entry))
+			{
+				break;
+			}
+			addIndexEntry(entry);
+			offset += sizeof(chunkHeader) + chunkHeader.storedSize;
+		}
+
+		return true;
+	}
+
+	const std::string& exePath() const
+	{
+		return m_exePath;
+	}
+
+	size_t chunkCount() const
+	{
+		return m_chunks.size();
+	}
+
+	const TraceChunkHeader& chunkHeader(size_t index) const
+	{
+		return m_chunks[index].header;
+	}
+
+	size_t keyframeCount() const
+	{
+		return m_keyframes.size();
+	}
+
+	const TraceChunkHeader& keyframeHeader(size_t index) const
+	{
+		return m_keyframes[index].header;
+	}
+
+	// timestamp 以前の状態を持つ最後のキーフレーム（無ければ SIZE_MAX）
+	size_t findKeyframe(uint64_t timestamp) const
+	{
+		const auto it = std::upper_bound(m_keyframes.begin(), m_keyframes.end(), timestamp,
+			[](uint64_t t, const TraceIndexEntry& entry) { return t < entry.header.lastTimestamp; });
+		return (it == m_keyframes.begin()) ? SIZE_MAX : static_cast<size_t>(it - m_keyframes.begin()) - 1;
+	}
+
+	bool readKeyframe(size_t index, std::vector<TraceKeyframeEntry>& out)
+	{
+		const TraceIndexEntry& entry = m_keyframes[index];
+		const TraceChunkHeader& header = entry.header;
+		if (!isValidEntry(entry))
+		{
+			return false;
+		}
+
+		std::vector<uint8_t> stored(header.storedSize);
+		if (!readAt(entry.offset + sizeof(TraceChunkHeader), stored.data(), stored.size()))
+		{
+			return false;
+		}
+
+		out.resize(header.eventCount);
+		return trace_codec::Decompress(header.codec, stored.data(), stored.size(), reinterpret_cast<uint8_t*>(out.data()), out.size() * sizeof(TraceKeyframeEntry));
+	}
+
+	bool readChunk(size_t index, DecodedChunk& out)
+	{
+		const TraceIndexEntry& entry = m_chunks[index];
+		const TraceChunkHeader& header = entry.header;
+		if (!isValidEntry(entry))
+		{
+			return false;
+		}
+
+		std::vector<uint8_t> stored(header.storedSize);
+		if (!readAt(entry.offset + sizeof(TraceChunkHeader), stored.data(), stored.size()))
+		{
+			return false;
+		}
+
+		const size_t eventBytes = static_cast<size_t>(header.eventCount) * sizeof(EventArgs);
+		std::vector<uint8_t> raw(eventBytes + header.stringSize);
+		if (!trace_codec::Decompress(header.codec, stored.data(), stored.size(), raw.data(), raw.size()))
+		{
+			return false;
+		}
+
+		if (header.filter == TraceFilter::DeltaShuffle)
+		{
+			trace_codec::DecodeDeltaShuffle(raw.data(), header.eventCount, out.events);
+		}
+		else
+		{
+			out.events.resize(header.eventCount);
+			std::memcpy(out.events.data(), raw.data(), eventBytes);
+		}
+		out.strings.assign(reinterpret_cast<const char*>(raw.data()) + eventBytes, header.stringSize);
+
+		return true;
+	}
+
+	// 全チャンクを先頭から順に func(chunkIndex, chunk) に渡す（次のチャンクの展開は func と並行して行う）
+	// 読めないチャンクがあればそこで止めて false を返す（後続のチャンクだけ集計しても結果が合わないため）
+	bool forEachChunk(const std::function<void(size_t, const DecodedChunk&)>& func)
+	{
+		const auto load = [this](size_t index)
+			{
+				std::optional<DecodedChunk> chunk{ std::in_place };
+				if (!readChunk(index, *chunk))
+				{
+					chunk.reset();
+				}
+				return chunk;
+			};
+
+		std::future<std::optional<DecodedChunk>> next;
+		if (0 < chunkCount())
+		{
+			next = std::async(std::launch::async, load, 0);
+		}
+
+		for (size_t i = 0; i < chunkCount(); ++i)
+		{
+			const std::optional<DecodedChunk> chunk = next.get();
+			if (!chunk)
+			{
+				return false;
+			}
+
+			if (i + 1 < chunkCount())
+			{
+				next = std::async(std::launch::async, load, i + 1);
+			}
+
+			func(i, *chunk);
+		}
+		return true;
+	}
+
+	// chunkIndices のチャンクを threadCount 本のスレッドで展開し、func(chunkIndex, chunk) を呼ぶ
+	// func は複数のスレッドから同時に呼ばれる
+	// 読めなかったチャンクは func に渡さず、その数を返す
+	size_t forEachChunkParallel(const std::vector<size_t>& chunkIndices, size_t threadCount,
+		const std::function<void(size_t, const DecodedChunk&)>& func)
+	{
+		std::atomic<size_t> next = 0;
+		std::atomic<size_t> failed = 0;
+		const auto worker = [&]()
+			{
+				DecodedChunk chunk;
+				for (size_t i = next++; i < chunkIndices.size(); i = next++)
+				{
+					if (readChunk(chunkIndices[i], chunk))
+					{
+						func(chunkIndices[i], chunk);
+					}
+					else
+					{
+						++failed;
+					}
+				}
+			};
+
+		threadCount = std::max<size_t>(1, std::min(threadCount, chunkIndices.size()));
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < threadCount; ++i)
+		{
+			threads.emplace_back(worker);
+		}
+		worker();
+
+		for (auto& thread : threads)
+		{
+			thread.join();
+		}
+		return failed;
+	}
+
+	static size_t DefaultThreadCount()
+	{
+		return std::max<size_t>(1, std::thread::hardware_concurrency());
+	}
+
+private:
+
+	// ペイロードがファイルに収まり、展開後の大きさが上限以内か
+	bool isValidEntry(const TraceIndexEntry& entry) const
+	{
+		const TraceChunkHeader& header = entry.header;
+		if (m_fileSize < sizeof(TraceChunkHeader) || m_fileSize - sizeof(TraceChunkHeader) < entry.offset ||
+			m_fileSize - sizeof(TraceChunkHeader) - entry.offset < header.storedSize)
+		{
+			return false;
+		}
+
+		const uint64_t rawSize = (header.magic == TraceKeyframeMagic)
+			? static_cast<uint64_t>(header.eventCount) * sizeof(TraceKeyframeEntry)
+			: static_cast<uint64_t>(header.eventCount) * sizeof(EventArgs) + header.stringSize;
+		return rawSize <= TraceMaxChunkRawBytes;
+	}
+
+	void addIndexEntry(const TraceIndexEntry& entry)
+	{
+		// キーフレームは集計したチャンクより後に書かれるので、途中で止まった記録でも対応するチャンクは揃っている
+		if (entry.header.magic == TraceKeyframeMagic)
+		{
+			m_keyframes.push_back(entry);
+		}
+		else
+		{
+			m_chunks.push_back(entry);
+		}
+	}
+
+	bool readAt(uint64_t offset, void* dst, size_t size)
+	{
+		std::lock_guard lock(m_fileMutex);
+		m_file.clear();
+		m_file.seekg(static_cast<std::streamoff>(offset));
+		m_file.read(static_cast<char*>(dst), static_cast<std::streamsize>(size));
+		return static_cast<size_t>(m_file.gcount()) == size;
+	}
+
+	std::mutex m_fileMutex;
+	std::ifstream m_file;
+	uint64_t m_fileSize = 0;
+	std::string m_exePath;
+	std::vector<TraceIndexEntry> m_chunks;
+	std::vector<TraceIndexEntry> m_keyframes;
+};
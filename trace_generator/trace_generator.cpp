@@ -0,0 +1,593 @@
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../trace_file.hpp"
+
+// 合成したイベント列をリング（ShmLayout）や記録ファイルに流し込む負荷試験用のツール
+// DynamoRIO も Windows の exe も使わずに、受け取る側（リングの読み取り / 記録 / 解析）を実際以上のレートで試す
+// 同じシードと設定からは同じイベント列ができる（リングで溢れて捨てた分を除く）
+static void print_usage()
+{
+    std::fprintf(stderr,
+        "usage:\n"
+        "  trace_generator [--out=<trace>] [--ring] [--sweep] [--seed=N] [--events=N] [--rate=N]\n"
+        "                  [--threads=N] [--blocks=N] [--loops=N] [--body=N] [--iterations=N] [--depth=N] [--quantum=N]\n"
+        "                  [--codec=zstd|lz4|none] [--level=N] [--record-threads=N] [--max-drop=ratio]\n"
+        "\n"
+        "  --out          record the events to this .cbtrace (default: count only)\n"
+        "  --ring         pass the events through a ShmLayout ring read by another thread, like the viewer does\n"
+        "  --sweep        with --ring, double the rate from --rate (default 1000000) until the ring drops events\n"
+        "  --rate         target events per second over all threads (default: as fast as possible)\n"
+        "  --blocks       number of distinct basic blocks in the synthetic exe\n"
+        "  --loops        number of loops; each loop runs --body blocks about --iterations times\n"
+        "  --depth        loop nesting depth (a loop may run a loop of the next level inside its body)\n"
+        "  --quantum      events a thread emits before the next thread (interleaving of threads in the stream)\n");
+}
+
+struct GeneratorOptions
+{
+    uint64_t seed = 1;
+    uint64_t events = 10'000'000;
+    uint64_t rate = 0;
+
+    uint32_t threads = 4;
+    uint32_t blocks = 4096;
+    uint32_t loops = 64;
+    uint32_t body = 8;
+    uint32_t iterations = 100;
+    uint32_t depth = 2;
+    uint32_t quantum = 16;
+
+    bool ring = false;
+    bool sweep = false;
+    double maxDrop = 0.001;
+
+    std::string outPath;
+    TraceRecorderOptions recorder;
+};
+
+static bool option_value(std::string_view arg, std::string_view name, std::string_view& value)
+{
+    if (arg.size() <= name.size() + 1 || !arg.starts_with(name) || arg[name.size()] != '=') return false;
+    value = arg.substr(name.size() + 1);
+    return true;
+}
+
+static bool parse_u64(std::string_view s, uint64_t& out)
+{
+    const auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+    return ec == std::errc() && ptr == s.data() + s.size() && !s.empty();
+}
+
+static bool parse_options(int argc, const char* argv[], GeneratorOptions& opt)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string_view arg = argv[i];
+        std::string_view value;
+        uint64_t n = 0;
+        if (arg == "--ring") opt.ring = true;
+        else if (arg == "--sweep") opt.sweep = true;
+        else if (option_value(arg, "--out", value)) opt.outPath = value;
+        else if (option_value(arg, "--seed", value) && parse_u64(value, n)) opt.seed = n;
+        else if (option_value(arg, "--events", value) && parse_u64(value, n) && 0 < n) opt.events = n;
+        else if (option_value(arg, "--rate", value) && parse_u64(value, n)) opt.rate = n;
+        else if (option_value(arg, "--threads", value) && parse_u64(value, n) && 0 < n) opt.threads = (uint32_t)n;
+        else if (option_value(arg, "--blocks", value) && parse_u64(value, n) && 0 < n) opt.blocks = (uint32_t)n;
+        else if (option_value(arg, "--loops", value) && parse_u64(value, n) && 0 < n) opt.loops = (uint32_t)n;
+        else if (option_value(arg, "--body", value) && parse_u64(value, n) && 0 < n) opt.body = (uint32_t)n;
+        else if (option_value(arg, "--iterations", value) && parse_u64(value, n) && 0 < n) opt.iterations = (uint32_t)n;
+        else if (option_value(arg, "--depth", value) && parse_u64(value, n) && 0 < n) opt.depth = (uint32_t)n;
+        else if (option_value(arg, "--quantum", value) && parse_u64(value, n) && 0 < n) opt.quantum = (uint32_t)n;
+        else if (option_value(arg, "--codec", value) && trace_codec::Parse(value, opt.recorder.codec)) {}
+        else if (option_value(arg, "--level", value) && parse_u64(value, n)) opt.recorder.level = (int)n;
+        else if (option_value(arg, "--record-threads", value) && parse_u64(value, n) && 0 < n) opt.recorder.compressorThreads = (uint32_t)n;
+        else if (option_value(arg, "--max-drop", value)) opt.maxDrop = std::strtod(std::string(value).c_str(), nullptr);
+        else
+        {
+            std::fprintf(stderr, "unknown option: %s\n", argv[i]);
+            return false;
+        }
+    }
+    return !opt.sweep || opt.ring;
+}
+
+/////////////////////////////////////
+// 合成プログラム
+
+// 標準の分布はライブラリごとに結果が違うので、乱数も範囲への変換も自前で持つ
+struct SplitMix64
+{
+    uint64_t state;
+
+    uint64_t next()
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    // [0, n)
+    uint32_t below(uint32_t n)
+    {
+        return (uint32_t)(((next() >> 32) * n) >> 32);
+    }
+
+    // [0, n) で小さい値ほど出やすい（実行の大半が一部のブロック / ループに集まる）
+    uint32_t skewed(uint32_t n)
+    {
+        const double u = (double)(next() >> 11) * (1.0 / 9007199254740992.0);
+        return std::min(n - 1, (uint32_t)(u * u * u * n));
+    }
+};
+
+constexpr uint64_t ExeBase = 0x140000000ull;
+constexpr uint64_t StartTimestamp = 1'000'000;
+constexpr char ExePath[] = "C:\\synthetic\\generated.exe";
+
+struct SyntheticBlock
+{
+    uint64_t address;
+    uint32_t instructionCount;
+    uint32_t byteSize;
+};
+
+struct SyntheticLoop
+{
+    // 0 以上はブロック、負の値 -1 - k はループ k を中で回す
+    std::vector<int32_t> body;
+    uint32_t iterations;
+};
+
+struct SyntheticProgram
+{
+    std::vector<SyntheticBlock> blocks;
+    std::vector<SyntheticLoop> loops;
+    double meanInstructions = 1.0;
+};
+
+// ループ i は深さ i % depth にあり、次の深さのループだけを中で回せる
+static SyntheticProgram build_program(const GeneratorOptions& opt)
+{
+    SplitMix64 rng{ opt.seed };
+    SyntheticProgram program;
+
+    uint64_t address = ExeBase + 0x1000;
+    uint64_t instructions = 0;
+    program.blocks.reserve(opt.blocks);
+    for (uint32_t i = 0; i < opt.blocks; ++i)
+    {
+        const uint32_t instructionCount = 1 + rng.below(24);
+        const uint32_t byteSize = instructionCount * 3 + rng.below(instructionCount * 2 + 1);
+        program.blocks.push_back(SyntheticBlock{ address, instructionCount, byteSize });
+        address += byteSize;
+        instructions += instructionCount;
+    }
+    program.meanInstructions = (double)instructions / opt.blocks;
+
+    program.loops.resize(opt.loops);
+    for (uint32_t i = 0; i < opt.loops; ++i)
+    {
+        SyntheticLoop& loop = program.loops[i];
+        loop.iterations = std::max(1u, opt.iterations / 2 + rng.below(opt.iterations + 1));
+        for (uint32_t k = 0; k < opt.body; ++k)
+        {
+            loop.body.push_back((int32_t)rng.skewed(opt.blocks));
+        }
+
+        // 次の深さのループを本体のどこかで回す
+        const uint32_t level = i % opt.depth;
+        if (level + 1 < opt.depth && rng.below(2) == 0)
+        {
+            std::vector<uint32_t> inner;
+            for (uint32_t j = 0; j < opt.loops; ++j)
+            {
+                if (j % opt.depth == level + 1) inner.push_back(j);
+            }
+            if (!inner.empty())
+            {
+                const uint32_t target = inner[rng.below((uint32_t)inner.size())];
+                loop.body.insert(loop.body.begin() + rng.below((uint32_t)loop.body.size() + 1), -1 - (int32_t)target);
+            }
+        }
+    }
+
+    return program;
+}
+
+// 1 スレッド分の実行（ループのスタックを辿ってブロックを 1 つずつ出す）
+class SyntheticThread
+{
+public:
+
+    SyntheticThread(const SyntheticProgram& program, uint32_t depth, uint64_t seed, uint32_t tid, double nsPerInstruction)
+        : m_program(program)
+        , m_depth(depth)
+        , m_rng{ seed }
+        , m_tid(tid)
+        , m_nsPerInstruction(nsPerInstruction)
+    {
+    }
+
+    uint32_t tid() const
+    {
+        return m_tid;
+    }
+
+    uint32_t nextBlock()
+    {
+        for (;;)
+        {
+            if (m_stack.empty())
+            {
+                // 外側のループ（深さ 0 のループ 0, depth, 2 * depth, ...）を選び直す
+                const uint32_t outerCount = ((uint32_t)m_program.loops.size() + m_depth - 1) / m_depth;
+                const uint32_t loop = m_rng.skewed(outerCount) * m_depth;
+                m_stack.push_back(Frame{ loop, m_program.loops[loop].iterations, 0 });
+            }
+
+            Frame& frame = m_stack.back();
+            const SyntheticLoop& loop = m_program.loops[frame.loop];
+            if (frame.position == loop.body.size())
+            {
+                frame.position = 0;
+                if (--frame.remaining == 0)
+                {
+                    m_stack.pop_back();
+                }
+                continue;
+            }
+
+            const int32_t item = loop.body[frame.position++];
+            if (item < 0)
+            {
+                const uint32_t inner = (uint32_t)(-1 - item);
+                m_stack.push_back(Frame{ inner, m_program.loops[inner].iterations, 0 });
+                continue;
+            }
+
+            // 時刻はブロックの命令数に比例して進める
+            m_clockNs += m_nsPerInstruction * m_program.blocks[item].instructionCount;
+            return (uint32_t)item;
+        }
+    }
+
+    uint64_t timestamp() const
+    {
+        return StartTimestamp + (uint64_t)(m_clockNs / 1000.0);
+    }
+
+private:
+
+    struct Frame
+    {
+        uint32_t loop;
+        uint32_t remaining;
+        size_t position;
+    };
+
+    const SyntheticProgram& m_program;
+    uint32_t m_depth;
+    SplitMix64 m_rng;
+    uint32_t m_tid;
+    double m_nsPerInstruction;
+    double m_clockNs = 0;
+    std::vector<Frame> m_stack;
+};
+
+// スレッドを quantum 個ずつ交互に進め、クライアントと同じ順序（モジュール -> ブロックの定義 -> ヒット）でイベントを渡す
+class EventGenerator
+{
+public:
+
+    EventGenerator(const SyntheticProgram& program, const GeneratorOptions& opt)
+        : m_program(program)
+        , m_quantum(opt.quantum)
+        , m_defined(program.blocks.size(), false)
+    {
+        // タイムスタンプは --rate（指定が無ければ 1 秒に 1000 万イベント）で進める
+        const double nominalRate = (0 < opt.rate) ? (double)opt.rate : 1e7;
+        const double nsPerInstruction = 1e9 * opt.threads / nominalRate / program.meanInstructions;
+        for (uint32_t t = 0; t < opt.threads; ++t)
+        {
+            m_threads.emplace_back(program, opt.depth, opt.seed ^ (0xA0761D6478BD642Full * (t + 1)), 1000 + t * 4, nsPerInstruction);
+        }
+    }
+
+    // emit(const EventArgs&, std::string_view modulePath)
+    template <class Emit>
+    void next(Emit&& emit)
+    {
+        if (!m_moduleSent)
+        {
+            EventArgs ev = {};
+            ev.type = EventType::ModuleAdd;
+            ev.mod.pid = 1;
+            ev.mod.base = ExeBase;
+            ev.mod.size = m_program.blocks.back().address + m_program.blocks.back().byteSize - ExeBase;
+            ev.mod.path_len = (uint32_t)std::strlen(ExePath);
+            emit(ev, std::string_view(ExePath));
+            m_moduleSent = true;
+            return;
+        }
+
+        SyntheticThread& thread = m_threads[m_current];
+        if (++m_emittedInQuantum == m_quantum)
+        {
+            m_emittedInQuantum = 0;
+            m_current = (m_current + 1) % m_threads.size();
+        }
+
+        const uint32_t id = thread.nextBlock();
+        const SyntheticBlock& block = m_program.blocks[id];
+        if (!m_defined[id])
+        {
+            m_defined[id] = true;
+            EventArgs def = {};
+            def.type = EventType::BlockDefine;
+            def.block.pid = 1;
+            def.block.instructionCount = block.instructionCount;
+            def.block.app_pc = block.address;
+            def.block.app_pc_end = block.address + block.byteSize;
+            def.block.byteSize = block.byteSize;
+            emit(def, std::string_view());
+        }
+
+        EventArgs ev = {};
+        ev.type = EventType::BasicBlockHit;
+        ev.bb.pid = 1;
+        ev.bb.tid = thread.tid();
+        ev.bb.timestamp_us = thread.timestamp();
+        ev.bb.app_pc = block.address;
+        ev.bb.app_pc_end = block.address + block.byteSize;
+        emit(ev, std::string_view());
+    }
+
+private:
+
+    const SyntheticProgram& m_program;
+    std::vector<SyntheticThread> m_threads;
+    uint32_t m_quantum;
+    uint32_t m_emittedInQuantum = 0;
+    size_t m_current = 0;
+    std::vector<bool> m_defined;
+    bool m_moduleSent = false;
+};
+
+/////////////////////////////////////
+// 実行
+
+struct RunResult
+{
+    uint64_t targetRate = 0;
+    uint64_t produced = 0;
+    uint64_t consumed = 0;
+    uint64_t dropped = 0;
+    uint32_t maxRingFill = 0;
+    double seconds = 0;
+    uint64_t rawBytes = 0;
+    uint64_t storedBytes = 0;
+    uint64_t uncompressedChunks = 0;
+};
+
+// rate が 0 でなければ、1024 イベントごとに予定の時刻まで待つ
+class Pacer
+{
+public:
+
+    explicit Pacer(uint64_t rate)
+        : m_rate(rate)
+        , m_start(std::chrono::steady_clock::now())
+    {
+    }
+
+    void tick(uint64_t produced)
+    {
+        if (m_rate == 0 || (produced & 1023) != 0)
+        {
+            return;
+        }
+        std::this_thread::sleep_until(m_start + std::chrono::duration<double>((double)produced / m_rate));
+    }
+
+private:
+
+    uint64_t m_rate;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+static RunResult run(const SyntheticProgram& program, const GeneratorOptions& opt, uint64_t rate)
+{
+    RunResult result;
+    result.targetRate = rate;
+
+    TraceRecorder recorder;
+    if (!opt.outPath.empty() && !recorder.open(opt.outPath, ExePath, opt.recorder))
+    {
+        std::fprintf(stderr, "failed to open %s\n", opt.outPath.c_str());
+        return result;
+    }
+
+    GeneratorOptions runOpt = opt;
+    runOpt.rate = rate;
+    EventGenerator generator(program, runOpt);
+    Pacer pacer(rate);
+
+    const auto start = std::chrono::steady_clock::now();
+    if (!opt.ring)
+    {
+        // 記録側を直接呼ぶ（取りこぼしは無い）
+        while (result.produced < opt.events)
+        {
+            generator.next([&](const EventArgs& ev, std::string_view modulePath)
+                {
+                    recorder.append(ev, modulePath);
+                    ++result.produced;
+                });
+            pacer.tick(result.produced);
+        }
+        result.consumed = result.produced;
+    }
+    else
+    {
+        // 0 で埋めてからクライアントが開いたときと同じ状態にする
+        const auto shm = std::make_unique<ShmLayout>();
+        std::memset(shm.get(), 0, sizeof(ShmLayout));
+        shm->header.magic = ShmMagic;
+        shm->header.eventsCapacity = (uint32_t)std::size(shm->eventBuffer);
+        shm->eventHeader.capacity = shm->header.eventsCapacity;
+
+        // ビューアの読み取りスレッドと同じく、空になるまで読んでから 1ms 休む
+        std::atomic<bool> producing = true;
+        std::thread consumer([&]()
+            {
+                for (;;)
+                {
+                    const bool finished = !producing;
+
+                    const RingHeader& h = shm->eventHeader;
+                    result.maxRingFill = std::max(result.maxRingFill, (h.writeIndex - h.readIndex) & (h.capacity - 1));
+
+                    EventArgs ev;
+                    bool received = false;
+                    while (spscPop(&shm->eventHeader, shm->eventBuffer, ev))
+                    {
+                        std::string_view modulePath;
+                        if (ev.type == EventType::ModuleAdd)
+                        {
+                            modulePath = std::string_view(&shm->strBuffer[ev.mod.pathIndex], ev.mod.path_len);
+                        }
+                        recorder.append(ev, modulePath);
+                        ++result.consumed;
+                        received = true;
+                    }
+
+                    if (finished)
+                    {
+                        break;
+                    }
+                    if (!received)
+                    {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    }
+                }
+            });
+
+        uint32_t charStart = 0;
+        while (result.produced < opt.events)
+        {
+            generator.next([&](const EventArgs& ev, std::string_view modulePath)
+                {
+                    EventArgs pushed = ev;
+                    if (ev.type == EventType::ModuleAdd)
+                    {
+                        std::memcpy(&shm->strBuffer[charStart], modulePath.data(), modulePath.size());
+                        pushed.mod.pathIndex = (uint16_t)charStart;
+                        charStart += (uint32_t)modulePath.size();
+                    }
+                    spscPush(&shm->eventHeader, shm->eventBuffer, pushed);
+                    ++result.produced;
+                });
+            pacer.tick(result.produced);
+        }
+
+        producing = false;
+        consumer.join();
+        result.dropped = shm->eventHeader.droppedCount;
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    recorder.close();
+    result.rawBytes = recorder.rawBytes();
+    result.storedBytes = recorder.storedBytes();
+    result.uncompressedChunks = recorder.uncompressedChunks();
+    return result;
+}
+
+static std::string result_json(const RunResult& result, bool ring)
+{
+    char buf[512];
+    std::snprintf(buf, sizeof(buf),
+        "{ \"target_rate\": %llu, \"events\": %llu, \"seconds\": %.6f, \"events_per_s\": %.0f",
+        (unsigned long long)result.targetRate, (unsigned long long)result.produced, result.seconds,
+        (0 < result.seconds) ? result.produced / result.seconds : 0.0);
+    std::string out = buf;
+    if (ring)
+    {
+        std::snprintf(buf, sizeof(buf), ", \"consumed\": %llu, \"dropped\": %llu, \"max_ring_fill\": %u",
+            (unsigned long long)result.consumed, (unsigned long long)result.dropped, result.maxRingFill);
+        out += buf;
+    }
+    if (0 < result.rawBytes)
+    {
+        std::snprintf(buf, sizeof(buf), ", \"raw_bytes\": %llu, \"stored_bytes\": %llu, \"uncompressed_chunks\": %llu",
+            (unsigned long long)result.rawBytes, (unsigned long long)result.storedBytes, (unsigned long long)result.uncompressedChunks);
+        out += buf;
+    }
+    return out + " }";
+}
+
+int main(int argc, const char* argv[])
+{
+    GeneratorOptions opt;
+    if (!parse_options(argc, argv, opt))
+    {
+        print_usage();
+        return 1;
+    }
+
+    if (!opt.outPath.empty() && !trace_codec::IsAvailable(opt.recorder.codec))
+    {
+        std::fprintf(stderr, "codec %s is not available, recording uncompressed\n", trace_codec::Name(opt.recorder.codec));
+        opt.recorder.codec = TraceCodec::None;
+    }
+
+    const SyntheticProgram program = build_program(opt);
+
+    std::string out = "{\n";
+    out += "  \"seed\": " + std::to_string(opt.seed) + ",\n";
+    out += "  \"threads\": " + std::to_string(opt.threads) + ", \"blocks\": " + std::to_string(opt.blocks) + ", \"loops\": " + std::to_string(opt.loops) + ",\n";
+    out += std::string("  \"mode\": \"") + (opt.ring ? "ring" : "direct") + "\", \"record\": " + (opt.outPath.empty() ? "false" : "true") + ",\n";
+
+    if (!opt.sweep)
+    {
+        out += "  \"result\": " + result_json(run(program, opt, opt.rate), opt.ring) + "\n}\n";
+        std::fwrite(out.data(), 1, out.size(), stdout);
+        return 0;
+    }
+
+    // 捨てたイベントが max-drop を超えるか、生成が目標のレートに届かなくなるまで倍にしていく
+    uint64_t saturation = 0;
+    out += "  \"sweep\": [";
+    for (uint64_t rate = (0 < opt.rate) ? opt.rate : 1'000'000; ; rate *= 2)
+    {
+        const RunResult result = run(program, opt, rate);
+        out += (rate == opt.rate || (opt.rate == 0 && rate == 1'000'000)) ? "\n    " : ",\n    ";
+        out += result_json(result, true);
+        std::fprintf(stderr, "rate %llu: %llu dropped\n", (unsigned long long)rate, (unsigned long long)result.dropped);
+
+        const bool dropped = opt.maxDrop * result.produced < (double)result.dropped;
+        const bool behind = (0 < result.seconds) && result.produced / result.seconds < rate * 0.95;
+        if (dropped || behind)
+        {
+            break;
+        }
+        saturation = rate;
+    }
+    out += "\n  ],\n";
+    out += "  \"saturation_rate\": " + std::to_string(saturation) + "\n}\n";
+    std::fwrite(out.data(), 1, out.size(), stdout);
+    return 0;
+}
@@ -0,0 +1,562 @@
+﻿#pragma once
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "trace_file.hpp"
+
+/////////////////////////////////////
+// ブロックごとのコスト
+
+struct BlockCost
+{
+	uint64_t endAddress = 0;
+	uint64_t hitCount = 0;
+
+	// 同じスレッドで次のブロックが実行されるまでの時間の合計（ブロック自身の実行時間の近似）
+	uint64_t timeUs = 0;
+
+	// BlockDefine によるブロックの命令数と長さ（届いていなければ 0）
+	uint32_t instructionCount = 0;
+	uint32_t byteSize = 0;
+
+	// 実行した命令数（時間と違って実行ごとにぶれない）
+	uint64_t instructions() const
+	{
+		return hitCount * instructionCount;
+	}
+};
+
+// トレースを先頭から 1 度だけ読んでブロック（先頭アドレス）ごとのコストを集計する
+// 次のチャンクの展開は集計と並行して行う。読めないチャンクがあれば false を返す
+inline bool CollectBlockCosts(TraceReader& reader, std::unordered_map<uint64_t, BlockCost>& costs)
+{
+	struct LastHit
+	{
+		uint64_t timestamp = 0;
+		uint64_t address = 0;
+	};
+
+	costs.clear();
+	std::unordered_map<uint32_t, LastHit> lastHits;
+
+	return reader.forEachChunk([&](size_t, const DecodedChunk& chunk)
+	{
+		for (const auto& ev : chunk.events)
+		{
+			if (ev.type == EventType::BlockDefine)
+			{
+				BlockCost& cost = costs[ev.block.app_pc];
+				cost.endAddress = std::max(cost.endAddress, ev.block.app_pc_end);
+				cost.instructionCount = ev.block.instructionCount;
+				cost.byteSize = ev.block.byteSize;
+				continue;
+			}
+
+			if (ev.type != EventType::BasicBlockHit)
+			{
+				continue;
+			}
+
+			const BBEvent& bb = ev.bb;
+			BlockCost& cost = costs[bb.app_pc];
+			cost.endAddress = std::max(cost.endAddress, bb.app_pc_end);
+			++cost.hitCount;
+
+			auto [it, inserted] = lastHits.try_emplace(bb.tid, LastHit{ bb.timestamp_us, bb.app_pc });
+			if (!inserted)
+			{
+				if (it->second.timestamp <= bb.timestamp_us)
+				{
+					costs[it->second.address].timeUs += bb.timestamp_us - it->second.timestamp;
+				}
+				it->second = LastHit{ bb.timestamp_us, bb.app_pc };
+			}
+		}
+	});
+}
+
+/////////////////////////////////////
+// ソース行ごとのプロファイル
+//
+// アドレスはビルドごとに変わるので、比較はシンボル解決した結果（ファイル / 行 / 関数）で行う
+// CSV に書き出しておけば、古いビルドの exe / PDB が無くても比較できる
+
+struct ProfileEntry
+{
+	// UTF-8
+	std::string file;
+
+	// 1 始まりの行
+	uint32_t beginLine = 0;
+	uint32_t endLine = 0;
+
+	std::string function;
+
+	uint64_t hitCount = 0;
+	uint64_t timeUs = 0;
+
+	// 実行した命令数（命令数の無い古いトレースのプロファイルでは 0）
+	uint64_t instructions = 0;
+};
+
+class Profile
+{
+public:
+
+	// 同じファイル / 開始行のエントリは合算する
+	void add(const ProfileEntry& entry)
+	{
+		const auto [it, inserted] = m_index.try_emplace(entry.file + '\n' + std::to_string(entry.beginLine), m_entries.size());
+		if (inserted)
+		{
+			m_entries.push_back(entry);
+			return;
+		}
+
+		ProfileEntry& merged = m_entries[it->second];
+		merged.endLine = std::max(merged.endLine, entry.endLine);
+		merged.hitCount += entry.hitCount;
+		merged.timeUs += entry.timeUs;
+		merged.instructions += entry.instructions;
+		if (merged.function.empty())
+		{
+			merged.function = entry.function;
+		}
+	}
+
+	const std::vector<ProfileEntry>& entries() const
+	{
+		return m_entries;
+	}
+
+	bool writeCsv(const std::filesystem::path& path) const
+	{
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		if (!file)
+		{
+			return false;
+		}
+
+		file << "file,begin_line,end_line,function,hits,time_us,instructions\n";
+		for (const auto& entry : m_entries)
+		{
+			file << Quote(entry.file) << ',' << entry.beginLine << ',' << entry.endLine << ','
+				<< Quote(entry.function) << ',' << entry.hitCount << ',' << entry.timeUs << ',' << entry.instructions << '\n';
+		}
+		return static_cast<bool>(file);
+	}
+
+	bool readCsv(const std::filesystem::path& path)
+	{
+		std::ifstream file(path, std::ios::binary);
+		if (!file)
+		{
+			return false;
+		}
+
+		std::string line;
+		std::getline(file, line);
+		if (!line.starts_with("file,"))
+		{
+			return false;
+		}
+
+		std::vector<std::string> fields;
+		while (std::getline(file, line))
+		{
+			if (!line.empty() && line.back() == '\r')
+			{
+				line.pop_back();
+			}
+
+			if (line.empty())
+			{
+				continue;
+			}
+
+			// instructions の列が無い 6 列のものは以前のプロファイル
+			if (!SplitCsv(line, fields) || (fields.size() != 6 && fields.size() != 7))
+			{
+				return false;
+			}
+
+			ProfileEntry entry;
+			entry.file = fields[0];
+			entry.beginLine = static_cast<uint32_t>(std::strtoul(fields[1].c_str(), nullptr, 10));
+			entry.endLine = static_cast<uint32_t>(std::strtoul(fields[2].c_str(), nullptr, 10));
+			entry.function = fields[3];
+			entry.hitCount = std::strtoull(fields[4].c_str(), nullptr, 10);
+			entry.timeUs = std::strtoull(fields[5].c_str(), nullptr, 10);
+			if (fields.size() == 7)
+			{
+				entry.instructions = std::strtoull(fields[6].c_str(), nullptr, 10);
+			}
+			add(entry);
+		}
+
+		return true;
+	}
+
+private:
+
+	static std::string Quote(const std::string& s)
+	{
+		std::string out = "\"";
+		for (const char ch : s)
+		{
+			if (ch == '"')
+			{
+				out.push_back('"');
+			}
+			out.push_back(ch);
+		}
+		out.push_back('"');
+		return out;
+	}
+
+	// 改行を含むフィールドは扱わない（パスと関数名だけなので）
+	static bool SplitCsv(std::string_view line, std::vector<std::string>& fields)
+	{
+		fields.clear();
+		size_t pos = 0;
+		for (;;)
+		{
+			std::string field;
+			if (pos < line.size() && line[pos] == '"')
+			{
+				for (++pos; ; ++pos)
+				{
+					if (line.size() <= pos)
+					{
+						return false;
+					}
+
+					if (line[pos] == '"')
+					{
+						if (pos + 1 < line.size() && line[pos + 1] == '"')
+						{
+							field.push_back('"');
+							++pos;
+						}
+						else
+						{
+							++pos;
+							break;
+						}
+					}
+					else
+					{
+						field.push_back(line[pos]);
+					}
+				}
+			}
+			else
+			{
+				const size_t end = std::min(line.find(',', pos), line.size());
+				field.assign(line.substr(pos, end - pos));
+				pos = end;
+			}
+
+			fields.push_back(std::move(field));
+			if (line.size() <= pos)
+			{
+				return true;
+			}
+
+			if (line[pos] != ',')
+			{
+				return false;
+			}
+			++pos;
+		}
+	}
+
+	std::vector<ProfileEntry> m_entries;
+
+	// "file\nbeginLine" -> m_entries の添字
+	std::unordered_map<std::string, size_t> m_index;
+};
+
+/////////////////////////////////////
+// 2 つのプロファイルの差分
+
+struct DiffRow
+{
+	// ファイルは両方のプロファイルに共通するルートからの相対パス
+	std::string file;
+
+	// 関数単位の行では 0
+	uint32_t line = 0;
+
+	std::string function;
+
+	uint64_t hitsA = 0;
+	uint64_t hitsB = 0;
+	uint64_t timeA = 0;
+	uint64_t timeB = 0;
+	uint64_t instructionsA = 0;
+	uint64_t instructionsB = 0;
+
+	int64_t deltaHits() const
+	{
+		return static_cast<int64_t>(hitsB) - static_cast<int64_t>(hitsA);
+	}
+
+	int64_t deltaTime() const
+	{
+		return static_cast<int64_t>(timeB) - static_cast<int64_t>(timeA);
+	}
+
+	int64_t deltaInstructions() const
+	{
+		return static_cast<int64_t>(instructionsB) - static_cast<int64_t>(instructionsA);
+	}
+};
+
+struct ProfileDiff
+{
+	// 両方に命令数があれば命令数の、無ければ時間の変化量の大きい順（同じなら回数の変化量の大きい順）
+	std::vector<DiffRow> lines;
+	std::vector<DiffRow> functions;
+};
+
+namespace trace_profile_detail
+{
+	// 大文字小文字と区切り文字の違いを無視する
+	inline std::string NormalizePath(std::string_view path)
+	{
+		std::string result(path);
+		for (auto& ch : result)
+		{
+			ch = (ch == '\\') ? '/' : static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+		}
+		return result;
+	}
+
+	// プロファイル内のファイルに共通するディレクトリを取り除く（表示と、対応の取れないファイルの識別に使う）
+	inline std::vector<std::string> RelativePaths(const Profile& profile)
+	{
+		std::vector<std::string> paths;
+		paths.reserve(profile.entries().size());
+		for (const auto& entry : profile.entries())
+		{
+			paths.push_back(NormalizePath(entry.file));
+		}
+
+		if (paths.empty())
+		{
+			return paths;
+		}
+
+		size_t prefix = paths[0].size();
+		for (const auto& path : paths)
+		{
+			prefix = std::min(prefix, static_cast<size_t>(std::mismatch(paths[0].begin(), paths[0].begin() + std::min(prefix, path.size()), path.begin()).first - paths[0].begin()));
+		}
+		prefix = paths[0].rfind('/', (prefix == 0) ? 0 : prefix - 1);
+		prefix = (prefix == std::string::npos) ? 0 : prefix + 1;
+
+		for (auto& path : paths)
+		{
+			path.erase(0, prefix);
+		}
+		return paths;
+	}
+
+	// 末尾の何階層か（ファイル名を含む） -> その末尾を持つファイルの添字（複数あれば SIZE_MAX）
+	// キーは paths を指すので、paths より長く使わない
+	inline std::unordered_map<std::string_view, size_t> IndexSuffixes(const std::vector<std::string>& paths)
+	{
+		std::unordered_map<std::string_view, size_t> index;
+		for (size_t i = 0; i < paths.size(); ++i)
+		{
+			const std::string_view path = paths[i];
+			for (size_t begin = 0; ; ++begin)
+			{
+				const auto [it, inserted] = index.try_emplace(path.substr(begin), i);
+				if (!inserted && it->second != i)
+				{
+					it->second = SIZE_MAX;
+				}
+
+				begin = path.find('/', begin);
+				if (begin == std::string_view::npos)
+				{
+					break;
+				}
+			}
+		}
+		return index;
+	}
+
+	// 一番長く末尾が一致する相手が 1 つに決まるときだけ、その添字を返す
+	inline size_t BestSuffixMatch(std::string_view path, const std::unordered_map<std::string_view, size_t>& candidates)
+	{
+		// 長い末尾から引くので、最初に見つかったものが一番長く一致する
+		for (size_t begin = 0; ; ++begin)
+		{
+			if (const auto it = candidates.find(path.substr(begin)); it != candidates.end())
+			{
+				return it->second;
+			}
+
+			begin = path.find('/', begin);
+			if (begin == std::string_view::npos)
+			{
+				return SIZE_MAX;
+			}
+		}
+	}
+
+	// チェックアウト先や、片方にしか無いディレクトリがあっても揃うように、2 つのプロファイルのファイルを末尾の一致で対応付ける
+	// お互いに相手が一番長く一致する（同じ長さの候補が他に無い）組だけを同じファイルとみなし、B 側も A 側の相対パスに揃える
+	inline std::pair<std::vector<std::string>, std::vector<std::string>> MatchPaths(const Profile& a, const Profile& b)
+	{
+		std::pair<std::vector<std::string>, std::vector<std::string>> result{ RelativePaths(a), RelativePaths(b) };
+
+		const auto uniqueFiles = [](const Profile& profile, std::vector<std::string>& files)
+			{
+				std::unordered_map<std::string, size_t> indices;
+				std::vector<size_t> fileOf;
+				fileOf.reserve(profile.entries().size());
+				for (const auto& entry : profile.entries())
+				{
+					std::string path = NormalizePath(entry.file);
+					const auto [it, inserted] = indices.try_emplace(path, files.size());
+					if (inserted)
+					{
+						files.push_back(std::move(path));
+					}
+					fileOf.push_back(it->second);
+				}
+				return fileOf;
+			};
+
+		std::vector<std::string> filesA;
+		std::vector<std::string> filesB;
+		const std::vector<size_t> fileOfA = uniqueFiles(a, filesA);
+		const std::vector<size_t> fileOfB = uniqueFiles(b, filesB);
+
+		// ファイルごとの相対パス（A 側）
+		std::vector<std::string> relativeA(filesA.size());
+		for (size_t i = 0; i < fileOfA.size(); ++i)
+		{
+			relativeA[fileOfA[i]] = result.first[i];
+		}
+
+		const auto suffixesA = IndexSuffixes(filesA);
+		const auto suffixesB = IndexSuffixes(filesB);
+		std::vector<size_t> matchOfB(filesB.size(), SIZE_MAX);
+		for (size_t i = 0; i < filesB.size(); ++i)
+		{
+			const size_t match = BestSuffixMatch(filesB[i], suffixesA);
+			if (match != SIZE_MAX && BestSuffixMatch(filesA[match], suffixesB) == i)
+			{
+				matchOfB[i] = match;
+			}
+		}
+
+		for (size_t i = 0; i < fileOfB.size(); ++i)
+		{
+			const size_t match = matchOfB[fileOfB[i]];
+			if (match != SIZE_MAX)
+			{
+				result.second[i] = relativeA[match];
+			}
+		}
+		return result;
+	}
+
+	inline bool HasInstructions(const Profile& profile)
+	{
+		return std::any_of(profile.entries().begin(), profile.entries().end(), [](const ProfileEntry& entry) { return entry.instructions != 0; });
+	}
+
+	inline void SortByDelta(std::vector<DiffRow>& rows, bool byInstructions)
+	{
+		std::sort(rows.begin(), rows.end(), [byInstructions](const DiffRow& a, const DiffRow& b)
+			{
+				const uint64_t instructionsA = static_cast<uint64_t>(std::abs(a.deltaInstructions()));
+				const uint64_t instructionsB = static_cast<uint64_t>(std::abs(b.deltaInstructions()));
+				if (byInstructions && instructionsA != instructionsB)
+				{
+					return instructionsA > instructionsB;
+				}
+
+				const uint64_t timeA = static_cast<uint64_t>(std::abs(a.deltaTime()));
+				const uint64_t timeB = static_cast<uint64_t>(std::abs(b.deltaTime()));
+				if (timeA != timeB)
+				{
+					return timeA > timeB;
+				}
+				return std::abs(a.deltaHits()) > std::abs(b.deltaHits());
+			});
+	}
+}
+
+// 行は（末尾の一致で揃えたパス, 開始行）、関数は（揃えたパス, 名前）で対応付ける
+inline ProfileDiff DiffProfiles(const Profile& a, const Profile& b)
+{
+	std::unordered_map<std::string, DiffRow> lines;
+	std::unordered_map<std::string, DiffRow> functions;
+
+	const auto accumulate = [&](const Profile& profile, const std::vector<std::string>& paths, bool isA)
+		{
+			for (size_t i = 0; i < profile.entries().size(); ++i)
+			{
+				const ProfileEntry& entry = profile.entries()[i];
+
+				DiffRow& line = lines[paths[i] + '\n' + std::to_string(entry.beginLine)];
+				line.file = paths[i];
+				line.line = entry.beginLine;
+				if (line.function.empty())
+				{
+					line.function = entry.function;
+				}
+				(isA ? line.hitsA : line.hitsB) += entry.hitCount;
+				(isA ? line.timeA : line.timeB) += entry.timeUs;
+				(isA ? line.instructionsA : line.instructionsB) += entry.instructions;
+
+				if (!entry.function.empty())
+				{
+					// 別のファイルにある同じ名前の関数（static 関数など）を混ぜない
+					DiffRow& function = functions[paths[i] + '\n' + entry.function];
+					function.file = paths[i];
+					function.function = entry.function;
+					(isA ? function.hitsA : function.hitsB) += entry.hitCount;
+					(isA ? function.timeA : function.timeB) += entry.timeUs;
+					(isA ? function.instructionsA : function.instructionsB) += entry.instructions;
+				}
+			}
+		};
+
+	const auto [pathsA, pathsB] = trace_profile_detail::MatchPaths(a, b);
+	accumulate(a, pathsA, true);
+	accumulate(b, pathsB, false);
+
+	ProfileDiff diff;
+	diff.lines.reserve(lines.size());
+	for (auto& [key, row] : lines)
+	{
+		diff.lines.push_back(std::move(row));
+	}
+	diff.functions.reserve(functions.size());
+	for (auto& [key, row] : functions)
+	{
+		diff.functions.push_back(std::move(row));
+	}
+
+	// 命令数は時間と違って計測ごとにぶれないので、両方にあればそちらで並べる
+	const bool byInstructions = trace_profile_detail::HasInstructions(a) && trace_profile_detail::HasInstructions(b);
+	trace_profile_detail::SortByDelta(diff.lines, byInstructions);
+	trace_profile_detail::SortByDelta(diff.functions, byInstructions);
+	return diff;
+}
@@ -0,0 +1,280 @@
+﻿#pragma once
+#include <algorithm>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include "trace_file.hpp"
+
+// 記録済みトレースに現れたモジュール
+struct TraceModule
+{
+	uint32_t pid = 0;
+	uint64_t base = 0;
+	uint64_t size = 0;
+	std::string path;
+
+	bool isExe() const
+	{
+		return path.ends_with(".exe") || path.ends_with(".EXE");
+	}
+
+	bool inRange(uint64_t address) const
+	{
+		return base <= address && address < base + size;
+	}
+};
+
+struct TraceQuery
+{
+	// BB イベントのタイムスタンプ [beginTimestamp, endTimestamp)
+	uint64_t beginTimestamp = 0;
+	uint64_t endTimestamp = UINT64_MAX;
+
+	std::optional<uint32_t> threadId;
+
+	// ブロックの先頭アドレス（空なら全ブロック）
+	std::vector<uint64_t> blocks;
+};
+
+struct BlockHitSummary
+{
+	uint64_t address = 0;
+	uint64_t endAddress = 0;
+	uint64_t hitCount = 0;
+	uint64_t firstTimestamp = UINT64_MAX;
+	uint64_t lastTimestamp = 0;
+
+	// firstTimestamp に実行したスレッド
+	uint32_t firstThreadId = 0;
+
+	void add(const BBEvent& bb)
+	{
+		endAddress = std::max(endAddress, bb.app_pc_end);
+		++hitCount;
+		if (bb.timestamp_us < firstTimestamp)
+		{
+			firstTimestamp = bb.timestamp_us;
+			firstThreadId = bb.tid;
+		}
+		lastTimestamp = std::max(lastTimestamp, bb.timestamp_us);
+	}
+
+	void merge(const BlockHitSummary& other)
+	{
+		endAddress = std::max(endAddress, other.endAddress);
+		hitCount += other.hitCount;
+		if (other.firstTimestamp < firstTimestamp)
+		{
+			firstTimestamp = other.firstTimestamp;
+			firstThreadId = other.firstThreadId;
+		}
+		lastTimestamp = std::max(lastTimestamp, other.lastTimestamp);
+	}
+};
+
+struct TraceQueryResult
+{
+	// アドレスの昇順
+	std::vector<BlockHitSummary> blocks;
+
+	uint64_t matchedEvents = 0;
+
+	size_t totalChunks = 0;
+	size_t scannedChunks = 0;
+
+	// 壊れていて読めなかったチャンク（集計に含まれない）
+	size_t failedChunks = 0;
+};
+
+// 時間 / スレッド / ブロックで絞り込んでブロックごとのヒットを集計する
+// チャンクヘッダの概要で対象になり得ないチャンクを読み飛ばし、残りを並列に展開して走査する
+class TraceQueryEngine
+{
+public:
+
+	explicit TraceQueryEngine(TraceReader& reader)
+		: m_reader(reader)
+	{
+	}
+
+	// BB イベントの最初と最後のタイムスタンプ（BB イベントが無ければ 0）
+	uint64_t firstTimestamp() const
+	{
+		uint64_t result = UINT64_MAX;
+		for (size_t i = 0; i < m_reader.chunkCount(); ++i)
+		{
+			const auto& header = m_reader.chunkHeader(i);
+			if (header.minAddress <= header.maxAddress)
+			{
+				result = std::min(result, header.firstTimestamp);
+			}
+		}
+		return (result == UINT64_MAX) ? 0 : result;
+	}
+
+	uint64_t lastTimestamp() const
+	{
+		uint64_t result = 0;
+		for (size_t i = 0; i < m_reader.chunkCount(); ++i)
+		{
+			const auto& header = m_reader.chunkHeader(i);
+			if (header.minAddress <= header.maxAddress)
+			{
+				result = std::max(result, header.lastTimestamp);
+			}
+		}
+		return result;
+	}
+
+	// モジュールイベントを含むチャンクだけを読む
+	const std::vector<TraceModule>& modules()
+	{
+		if (m_modulesLoaded)
+		{
+			return m_modules;
+		}
+
+		DecodedChunk chunk;
+		for (size_t i = 0; i < m_reader.chunkCount(); ++i)
+		{
+			if (m_reader.chunkHeader(i).moduleEventCount == 0 || !m_reader.readChunk(i, chunk))
+			{
+				continue;
+			}
+
+			for (const auto& ev : chunk.events)
+			{
+				if (ev.type == EventType::ModuleAdd)
+				{
+					m_modules.push_back(TraceModule{ ev.mod.pid, ev.mod.base, ev.mod.size, std::string(chunk.modulePath(ev.mod)) });
+				}
+			}
+		}
+
+		m_modulesLoaded = true;
+		return m_modules;
+	}
+
+	std::optional<TraceModule> exeModule()
+	{
+		for (const auto& module : modules())
+		{
+			if (module.isExe())
+			{
+				return module;
+			}
+		}
+		return std::nullopt;
+	}
+
+	// 概要から対象になり得るチャンクを選ぶ
+	std::vector<size_t> selectChunks(const TraceQuery& query) const
+	{
+		std::vector<size_t> result;
+		for (size_t i = 0; i < m_reader.chunkCount(); ++i)
+		{
+			const auto& header = m_reader.chunkHeader(i);
+			if (!trace_summary::MayOverlapTime(header, query.beginTimestamp, query.endTimestamp))
+			{
+				continue;
+			}
+
+			if (query.threadId && !trace_summary::MayContainThread(header, *query.threadId))
+			{
+				continue;
+			}
+
+			if (!query.blocks.empty() &&
+				std::none_of(query.blocks.begin(), query.blocks.end(), [&](uint64_t address) { return trace_summary::MayContainBlock(header, address); }))
+			{
+				continue;
+			}
+
+			result.push_back(i);
+		}
+		return result;
+	}
+
+	TraceQueryResult run(TraceQuery query, size_t threadCount = TraceReader::DefaultThreadCount())
+	{
+		std::sort(query.blocks.begin(), query.blocks.end());
+
+		TraceQueryResult result;
+		result.totalChunks = m_reader.chunkCount();
+
+		const std::vector<size_t> chunks = selectChunks(query);
+		result.scannedChunks = chunks.size();
+
+		std::mutex mutex;
+		std::unordered_map<uint64_t, BlockHitSummary> merged;
+
+		result.failedChunks = m_reader.forEachChunkParallel(chunks, threadCount, [&](size_t, const DecodedChunk& chunk)
+			{
+				// チャンク内で集計してからまとめて合流する
+				std::unordered_map<uint64_t, BlockHitSummary> local;
+				uint64_t matched = 0;
+				for (const auto& ev : chunk.events)
+				{
+					if (ev.type != EventType::BasicBlockHit)
+					{
+						continue;
+					}
+
+					const BBEvent& bb = ev.bb;
+					if (bb.timestamp_us < query.beginTimestamp || query.endTimestamp <= bb.timestamp_us)
+					{
+						continue;
+					}
+
+					if (query.threadId && bb.tid != *query.threadId)
+					{
+						continue;
+					}
+
+					if (!query.blocks.empty() && !std::binary_search(query.blocks.begin(), query.blocks.end(), bb.app_pc))
+					{
+						continue;
+					}
+
+					auto [it, inserted] = local.try_emplace(bb.app_pc);
+					if (inserted)
+					{
+						it->second.address = bb.app_pc;
+					}
+					it->second.add(bb);
+					++matched;
+				}
+
+				std::lock_guard lock(mutex);
+				for (const auto& [address, summary] : local)
+				{
+					auto [it, inserted] = merged.try_emplace(address, summary);
+					if (!inserted)
+					{
+						it->second.merge(summary);
+					}
+				}
+				result.matchedEvents += matched;
+			});
+
+		result.blocks.reserve(merged.size());
+		for (const auto& [address, summary] : merged)
+		{
+			result.blocks.push_back(summary);
+		}
+		std::sort(result.blocks.begin(), result.blocks.end(),
+			[](const BlockHitSummary& a, const BlockHitSummary& b) { return a.address < b.address; });
+
+		return result;
+	}
+
+private:
+
+	TraceReader& m_reader;
+
+	bool m_modulesLoaded = false;
+	std::vector<TraceModule> m_modules;
+};
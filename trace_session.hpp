@@ -0,0 +1,273 @@
+﻿#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cwchar>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "trace_common.hpp"
+
+/////////////////////////////////////
+// 受け取る側（ビューアやヘッドレスのツール）のセッション
+//
+// セッションのディレクトリと、プロセスごとのチャンネルを起動前にまとめて作っておく
+// トレースするプロセスは（子プロセスも）起動時に番号を取ってチャンネルを開き、ディレクトリに pid を登録する
+// 受け取る側は登録されたチャンネルをそれぞれ別のスレッドで読む
+
+class TraceSession
+{
+public:
+
+	static constexpr uint32_t MaxProcesses = static_cast<uint32_t>(std::size(SessionDirectory{}.entries));
+
+	TraceSession() = default;
+
+	TraceSession(const TraceSession&) = delete;
+	TraceSession& operator=(const TraceSession&) = delete;
+
+	~TraceSession()
+	{
+		close();
+	}
+
+	// name は共有メモリの名前（例: Local\bbtrace_shm_<UUID>）で、クライアントには --channel で渡す
+	bool create(const std::wstring& name)
+	{
+		close();
+
+		m_directoryMap = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, static_cast<DWORD>(sizeof(SessionDirectory)), name.c_str());
+		if (!m_directoryMap)
+		{
+			return false;
+		}
+
+		m_directory = static_cast<SessionDirectory*>(MapViewOfFile(m_directoryMap, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+		if (!m_directory)
+		{
+			close();
+			return false;
+		}
+
+		// 新しく作ったマッピングは 0 で埋まっているので、ヘッダだけ書けばよい
+		m_directory->maxProcesses = MaxProcesses;
+		m_directory->claimedCount = 0;
+
+		for (uint32_t slot = 0; slot < MaxProcesses; ++slot)
+		{
+			wchar_t channelName[160];
+			swprintf_s(channelName, SessionChannelFormat, name.c_str(), slot);
+
+			HANDLE map = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, static_cast<DWORD>(sizeof(ShmLayout)), channelName);
+			ShmLayout* shm = map ? static_cast<ShmLayout*>(MapViewOfFile(map, FILE_MAP_ALL_ACCESS, 0, 0, 0)) : nullptr;
+			if (!shm)
+			{
+				if (map)
+				{
+					CloseHandle(map);
+				}
+				close();
+				return false;
+			}
+
+			shm->header.channel = slot;
+			shm->header.eventsCapacity = static_cast<uint32_t>(std::size(shm->eventBuffer));
+			shm->header.commandsCapacity = static_cast<uint32_t>(std::size(shm->commandBuffer));
+			shm->eventHeader.capacity = shm->header.eventsCapacity;
+			shm->commandHeader.capacity = shm->header.commandsCapacity;
+			shm->header.magic = ShmMagic;
+
+			m_channelMaps.push_back(map);
+			m_channels.push_back(shm);
+		}
+
+		// 複数のプロセスがシグナルにするので自動リセットにして、起きたらディレクトリを見直す
+		m_readyEvent = CreateEventW(nullptr, FALSE, FALSE, (name + ShmReadyEventSuffix).c_str());
+		m_announced.assign(MaxProcesses, false);
+		m_name = name;
+
+		m_directory->magic = SessionMagic;
+		return true;
+	}
+
+	void close()
+	{
+		for (ShmLayout* shm : m_channels)
+		{
+			UnmapViewOfFile(shm);
+		}
+		for (HANDLE map : m_channelMaps)
+		{
+			CloseHandle(map);
+		}
+		m_channels.clear();
+		m_channelMaps.clear();
+		m_announced.clear();
+
+		if (m_directory)
+		{
+			UnmapViewOfFile(m_directory);
+			m_directory = nullptr;
+		}
+		if (m_directoryMap)
+		{
+			CloseHandle(m_directoryMap);
+			m_directoryMap = nullptr;
+		}
+		if (m_readyEvent)
+		{
+			CloseHandle(m_readyEvent);
+			m_readyEvent = nullptr;
+		}
+		m_name.clear();
+	}
+
+	bool isOpen() const
+	{
+		return m_directory != nullptr;
+	}
+
+	const std::wstring& name() const
+	{
+		return m_name;
+	}
+
+	// クライアントが登録するたびにシグナルになる（待たずに pollProcesses を呼んでもよい）
+	HANDLE readyEvent() const
+	{
+		return m_readyEvent;
+	}
+
+	// 番号 slot のチャンネル（登録される前から受信を始めてよい）
+	ShmLayout* channel(uint32_t slot) const
+	{
+		return (slot < m_channels.size()) ? m_channels[slot] : nullptr;
+	}
+
+	// 前回から登録されたプロセスを onProcess(slot, pid, channel) で渡す
+	// 番号は起動した順に取られるので、0 番が最初に起動したプロセス（drrun で起動した exe）になる
+	template <class OnProcess>
+	uint32_t pollProcesses(OnProcess&& onProcess)
+	{
+		if (!m_directory)
+		{
+			return 0;
+		}
+
+		uint32_t found = 0;
+		const uint32_t claimed = std::min<uint32_t>(m_directory->claimedCount, MaxProcesses);
+		for (uint32_t slot = 0; slot < claimed; ++slot)
+		{
+			const volatile SessionEntry& entry = m_directory->entries[slot];
+			if (m_announced[slot] || entry.state != SessionEntryReady)
+			{
+				continue;
+			}
+
+			_ReadWriteBarrier();
+			m_announced[slot] = true;
+			onProcess(slot, static_cast<uint32_t>(entry.pid), m_channels[slot]);
+			++found;
+		}
+		return found;
+	}
+
+	// 番号が足りずにトレースされなかったプロセスの数
+	uint32_t overflowCount() const
+	{
+		return (m_directory && MaxProcesses < m_directory->claimedCount) ? (m_directory->claimedCount - MaxProcesses) : 0;
+	}
+
+private:
+
+	std::wstring m_name;
+
+	HANDLE m_directoryMap = nullptr;
+	SessionDirectory* m_directory = nullptr;
+	HANDLE m_readyEvent = nullptr;
+
+	std::vector<HANDLE> m_channelMaps;
+	std::vector<ShmLayout*> m_channels;
+
+	// pollProcesses で渡したか
+	std::vector<bool> m_announced;
+};
+
+// 1 つのチャンネルを専用のスレッドで読み続ける（プロセスごとに 1 つ）
+class ChannelReader
+{
+public:
+
+	ChannelReader() = default;
+
+	ChannelReader(const ChannelReader&) = delete;
+	ChannelReader& operator=(const ChannelReader&) = delete;
+
+	~ChannelReader()
+	{
+		stop();
+	}
+
+	// onEvent(const EventArgs&, std::string_view modulePath) は読み取りスレッドから呼ぶ（modulePath は ModuleAdd のときのパス）
+	template <class OnEvent>
+	void start(ShmLayout* shm, OnEvent onEvent)
+	{
+		stop();
+		m_stopRequest = false;
+		m_thread = std::thread([this, shm, onEvent = std::move(onEvent)]() mutable
+			{
+				for (;;)
+				{
+					// 止めるときも、クライアントが書き終えた分は読み切る
+					const bool stopping = m_stopRequest;
+
+					EventArgs ev;
+					bool received = false;
+					while (spscPop(&shm->eventHeader, shm->eventBuffer, ev))
+					{
+						std::string_view modulePath;
+						if (ev.type == EventType::ModuleAdd)
+						{
+							modulePath = std::string_view(&shm->strBuffer[ev.mod.pathIndex], ev.mod.path_len);
+						}
+
+						onEvent(ev, modulePath);
+						m_eventCount.fetch_add(1, std::memory_order_relaxed);
+						received = true;
+					}
+
+					if (stopping)
+					{
+						break;
+					}
+
+					if (!received)
+					{
+						std::this_thread::sleep_for(std::chrono::milliseconds(1));
+					}
+				}
+			});
+	}
+
+	void stop()
+	{
+		if (m_thread.joinable())
+		{
+			m_stopRequest = true;
+			m_thread.join();
+		}
+	}
+
+	uint64_t eventCount() const
+	{
+		return m_eventCount.load(std::memory_order_relaxed);
+	}
+
+private:
+
+	std::thread m_thread;
+	std::atomic<bool> m_stopRequest = false;
+	std::atomic<uint64_t> m_eventCount = 0;
+};